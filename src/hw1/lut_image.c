@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/***************************** Lookup tables ****************************
+  8-bit pixels only have 256 possible values, so any per-pixel function
+  of them can be computed once per value and then looked up. Float output
+  uses AVX2 gathers, 8-bit output uses byte shuffles (pshufb) over the 16
+  sixteen-entry slices of the table.
+************************************************************************/
+
+#define LUT_BLOCK 16384
+
+// Builds a lookup table by evaluating f at every 8-bit value.
+// float (*f)(float v, void *p): function to tabulate, v is in [0, 1].
+// void *p: extra parameters passed through to f.
+// returns: table with f(i/255) at entry i.
+lut make_lut(float (*f)(float v, void *p), void *p)
+{
+    lut l;
+    int i;
+    for(i = 0; i < 256; ++i){
+        l.v[i] = f(i/255., p);
+    }
+    return l;
+}
+
+static float identity_fn(float v, void *p)
+{
+    return v;
+}
+
+static float gamma_fn(float v, void *p)
+{
+    return powf(v, *(float *)p);
+}
+
+static float threshold_fn(float v, void *p)
+{
+    return v > *(float *)p ? 1 : v;
+}
+
+static float contrast_fn(float v, void *p)
+{
+    float *cp = (float *)p;
+    float gain = cp[0], mid = cp[1];
+    float lo = 1/(1 + expf(gain*mid));
+    float hi = 1/(1 + expf(-gain*(1 - mid)));
+    return (1/(1 + expf(-gain*(v - mid))) - lo)/(hi - lo);
+}
+
+// Table that just converts to [0, 1], like load_image does.
+lut make_identity_lut()
+{
+    return make_lut(identity_fn, 0);
+}
+
+// Table for v^gamma.
+lut make_gamma_lut(float gamma)
+{
+    return make_lut(gamma_fn, &gamma);
+}
+
+// Table that sets every value above thresh to 1, like filter_noise.
+lut make_threshold_lut(float thresh)
+{
+    return make_lut(threshold_fn, &thresh);
+}
+
+// Sigmoid contrast curve centred on mid, rescaled so 0 and 1 are fixed.
+// float gain: steepness of the curve, larger is more contrast.
+// float mid: value the curve is centred on.
+lut make_contrast_lut(float gain, float mid)
+{
+    float p[2] = {gain, mid};
+    return make_lut(contrast_fn, p);
+}
+
+// Looks up n bytes through a float table.
+static void lut_block(const unsigned char *x, float *y, int n, const float *t)
+{
+    int i = 0;
+#ifdef __AVX2__
+    for(; i + 8 <= n; i += 8){
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(x + i)));
+        _mm256_storeu_ps(y + i, _mm256_i32gather_ps(t, idx, 4));
+    }
+#endif
+    for(; i < n; ++i){
+        y[i] = t[x[i]];
+    }
+}
+
+// Sums three gathered tables, used for weighted grayscale.
+static void lut3_block(const unsigned char *r, const unsigned char *g, const unsigned char *b,
+        float *y, int n, const float *tr, const float *tg, const float *tb)
+{
+    int i = 0;
+#ifdef __AVX2__
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1);
+    for(; i + 8 <= n; i += 8){
+        __m256i ir = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(r + i)));
+        __m256i ig = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(g + i)));
+        __m256i ib = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(b + i)));
+        __m256 v = _mm256_add_ps(_mm256_i32gather_ps(tr, ir, 4), _mm256_i32gather_ps(tg, ig, 4));
+        v = _mm256_add_ps(v, _mm256_i32gather_ps(tb, ib, 4));
+        _mm256_storeu_ps(y + i, _mm256_min_ps(_mm256_max_ps(v, zero), one));
+    }
+#endif
+    for(; i < n; ++i){
+        float v = tr[r[i]] + tg[g[i]] + tb[b[i]];
+        y[i] = MIN(MAX(v, 0), 1);
+    }
+}
+
+// Looks up n bytes through a byte table, in place.
+static void lut8_block(unsigned char *x, int n, const unsigned char *t)
+{
+    int i = 0;
+#ifdef __AVX2__
+    __m256i slices[16];
+    int k;
+    for(k = 0; k < 16; ++k){
+        slices[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(t + 16*k)));
+    }
+    __m256i low = _mm256_set1_epi8(0x0F);
+    for(; i + 32 <= n; i += 32){
+        __m256i v = _mm256_loadu_si256((const __m256i *)(x + i));
+        __m256i lo = _mm256_and_si256(v, low);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+        __m256i r = _mm256_setzero_si256();
+        for(k = 0; k < 16; ++k){
+            __m256i m = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(k));
+            r = _mm256_or_si256(r, _mm256_and_si256(m, _mm256_shuffle_epi8(slices[k], lo)));
+        }
+        _mm256_storeu_si256((__m256i *)(x + i), r);
+    }
+#elif defined(__SSSE3__)
+    __m128i slices[16];
+    int k;
+    for(k = 0; k < 16; ++k){
+        slices[k] = _mm_loadu_si128((const __m128i *)(t + 16*k));
+    }
+    __m128i low = _mm_set1_epi8(0x0F);
+    for(; i + 16 <= n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)(x + i));
+        __m128i lo = _mm_and_si128(v, low);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low);
+        __m128i r = _mm_setzero_si128();
+        for(k = 0; k < 16; ++k){
+            __m128i m = _mm_cmpeq_epi8(hi, _mm_set1_epi8(k));
+            r = _mm_or_si128(r, _mm_and_si128(m, _mm_shuffle_epi8(slices[k], lo)));
+        }
+        _mm_storeu_si128((__m128i *)(x + i), r);
+    }
+#endif
+    for(; i < n; ++i){
+        x[i] = t[x[i]];
+    }
+}
+
+// Applies a separate table to each channel of an 8-bit image.
+// image_u8 im: input image.
+// lut *l: im.c tables, one per channel.
+// returns: float image of the looked up values.
+image apply_channel_luts(image_u8 im, lut *l)
+{
+    image out = make_image(im.w, im.h, im.c);
+    int size = im.w*im.h;
+    int nblocks = (size + LUT_BLOCK - 1)/LUT_BLOCK;
+    int j;
+    #pragma omp parallel for schedule(static)
+    for(j = 0; j < nblocks*im.c; ++j){
+        int k = j/nblocks;
+        int start = k*size + (j%nblocks)*LUT_BLOCK;
+        int n = MIN(LUT_BLOCK, (k+1)*size - start);
+        lut_block(im.data + start, out.data + start, n, l[k].v);
+    }
+    return out;
+}
+
+// Applies the same table to every channel of an 8-bit image.
+// image_u8 im: input image.
+// lut l: table to apply.
+// returns: float image of the looked up values.
+image apply_lut(image_u8 im, lut l)
+{
+    lut *ls = calloc(im.c, sizeof(lut));
+    int k;
+    for(k = 0; k < im.c; ++k) ls[k] = l;
+    image out = apply_channel_luts(im, ls);
+    free(ls);
+    return out;
+}
+
+// Applies a table to an 8-bit image in place, keeping it 8-bit.
+// Table values are clamped to [0, 1] and rounded to the nearest byte.
+// image_u8 im: image to modify.
+// lut l: table to apply.
+void apply_lut_u8(image_u8 im, lut l)
+{
+    unsigned char t[256];
+    int i;
+    for(i = 0; i < 256; ++i){
+        t[i] = (unsigned char) roundf(255*MIN(MAX(l.v[i], 0), 1));
+    }
+    int size = im.w*im.h*im.c;
+    int nblocks = (size + LUT_BLOCK - 1)/LUT_BLOCK;
+    int j;
+    #pragma omp parallel for schedule(static)
+    for(j = 0; j < nblocks; ++j){
+        int start = j*LUT_BLOCK;
+        lut8_block(im.data + start, MIN(LUT_BLOCK, size - start), t);
+    }
+}
+
+// Weighted sum of three 8-bit channels through per-channel tables, clamped
+// to [0, 1]. With weights .299, .587, .114 this is rgb_to_grayscale.
+// image_u8 im: 3 channel input image.
+// float r, g, b: weight of each channel.
+// returns: 1 channel float image.
+image lut_grayscale(image_u8 im, float r, float g, float b)
+{
+    assert(im.c == 3);
+    float tr[256], tg[256], tb[256];
+    int i;
+    for(i = 0; i < 256; ++i){
+        tr[i] = r*(i/255.);
+        tg[i] = g*(i/255.);
+        tb[i] = b*(i/255.);
+    }
+    image out = make_image(im.w, im.h, 1);
+    int size = im.w*im.h;
+    int nblocks = (size + LUT_BLOCK - 1)/LUT_BLOCK;
+    int j;
+    #pragma omp parallel for schedule(static)
+    for(j = 0; j < nblocks; ++j){
+        int start = j*LUT_BLOCK;
+        lut3_block(im.data + start, im.data + size + start, im.data + 2*size + start,
+                out.data + start, MIN(LUT_BLOCK, size - start), tr, tg, tb);
+    }
+    return out;
+}
@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/***************************** Point-op pipelines ***********************
+  Chains like shift -> scale -> clamp -> feature_normalize each walk the
+  whole image. A pipeline records the chain first and then runs it in as
+  few sweeps as possible:
+
+  - shift, scale and the two normalizations are all affine per channel,
+    so runs of them fold into a single a*x + b.
+  - clamps can't fold, so the chain compiles into "steps" that each do
+    clamp(a*x + b), plus one pending affine at the end.
+  - reductions (min/max for feature_normalize, sum for l1_normalize) need
+    a read-only sweep, but the per-channel stats from that sweep can be
+    pushed through any later affines, so only a clamp between two
+    reductions forces another sweep.
+
+  The final sweep reads each pixel once, runs every step in registers,
+  and writes it once.
+************************************************************************/
+
+#define POINTOP_BLOCK 16384
+
+// Per-channel statistics of the values coming out of the compiled steps.
+typedef struct{
+    float min, max;
+    double sum;
+} pointop_stats;
+
+// Compiled form of a pipeline for an image with a fixed number of channels.
+// int nsteps: number of clamp(a*x + b) steps.
+// float *a, *b: step coefficients, nsteps rows of im.c values each.
+// float *pa, *pb: pending affine after the last step, one per channel.
+typedef struct{
+    int c, nsteps;
+    float *a, *b;
+    float *pa, *pb;
+} pointop_program;
+
+// Creates an empty pipeline.
+// returns: pipeline with no operations.
+pointop_pipeline make_pointop_pipeline()
+{
+    pointop_pipeline p;
+    p.n = 0;
+    p.ops = 0;
+    return p;
+}
+
+// Frees the operations held by a pipeline.
+// pointop_pipeline p: pipeline to free.
+void free_pointop_pipeline(pointop_pipeline p)
+{
+    free(p.ops);
+}
+
+static void pipeline_add(pointop_pipeline *p, POINTOP op, int c, float v)
+{
+    p->ops = realloc(p->ops, (p->n + 1)*sizeof(pointop));
+    p->ops[p->n].op = op;
+    p->ops[p->n].c = c;
+    p->ops[p->n].v = v;
+    ++p->n;
+}
+
+// Records adding v to channel c, or to every channel if c < 0.
+// Unlike shift_image this does not clamp, add a pipeline_clamp for that.
+void pipeline_shift(pointop_pipeline *p, int c, float v)
+{
+    pipeline_add(p, OP_SHIFT, c, v);
+}
+
+// Records multiplying channel c by v, or every channel if c < 0.
+void pipeline_scale(pointop_pipeline *p, int c, float v)
+{
+    pipeline_add(p, OP_SCALE, c, v);
+}
+
+// Records clamping every pixel to [0, 1].
+void pipeline_clamp(pointop_pipeline *p)
+{
+    pipeline_add(p, OP_CLAMP, -1, 0);
+}
+
+// Records a feature_normalize of the whole image.
+void pipeline_feature_normalize(pointop_pipeline *p)
+{
+    pipeline_add(p, OP_FEATURE_NORMALIZE, -1, 0);
+}
+
+// Records an l1_normalize of the whole image.
+void pipeline_l1_normalize(pointop_pipeline *p)
+{
+    pipeline_add(p, OP_L1_NORMALIZE, -1, 0);
+}
+
+// Runs the steps of one channel over a block of pixels.
+// float *x: pixels to process.
+// int n: number of pixels.
+// float *a, *b: step coefficients for this channel, stride c between steps.
+// int nsteps, c: number of steps and channel stride.
+// float fa, fb: final affine, only applied when writing.
+// int write: 1 to store the result, 0 to only collect statistics.
+// pointop_stats *s: statistics of the step output, filled in when not writing.
+static void pointop_block(float *x, int n, const float *a, const float *b, int nsteps, int c,
+        float fa, float fb, int write, pointop_stats *s)
+{
+    int i = 0, k;
+    float mn = INFINITY, mx = -INFINITY;
+    double sum = 0;
+#ifdef __AVX__
+    __m256 zero8 = _mm256_setzero_ps();
+    __m256 one8 = _mm256_set1_ps(1);
+    __m256 fa8 = _mm256_set1_ps(fa);
+    __m256 fb8 = _mm256_set1_ps(fb);
+    __m256 mn8 = _mm256_set1_ps(INFINITY);
+    __m256 mx8 = _mm256_set1_ps(-INFINITY);
+    __m256 sum8 = _mm256_setzero_ps();
+    for(; i + 8 <= n; i += 8){
+        __m256 v = _mm256_loadu_ps(x + i);
+        for(k = 0; k < nsteps; ++k){
+            v = _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(a[k*c])), _mm256_set1_ps(b[k*c]));
+            v = _mm256_min_ps(_mm256_max_ps(v, zero8), one8);
+        }
+        if(write){
+            _mm256_storeu_ps(x + i, _mm256_add_ps(_mm256_mul_ps(v, fa8), fb8));
+        } else {
+            mn8 = _mm256_min_ps(mn8, v);
+            mx8 = _mm256_max_ps(mx8, v);
+            sum8 = _mm256_add_ps(sum8, v);
+        }
+    }
+    if(!write){
+        float t[8];
+        _mm256_storeu_ps(t, mn8);
+        for(k = 0; k < 8; ++k) mn = MIN(mn, t[k]);
+        _mm256_storeu_ps(t, mx8);
+        for(k = 0; k < 8; ++k) mx = MAX(mx, t[k]);
+        _mm256_storeu_ps(t, sum8);
+        for(k = 0; k < 8; ++k) sum += t[k];
+    }
+#elif defined(__SSE2__)
+    __m128 zero4 = _mm_setzero_ps();
+    __m128 one4 = _mm_set1_ps(1);
+    __m128 fa4 = _mm_set1_ps(fa);
+    __m128 fb4 = _mm_set1_ps(fb);
+    __m128 mn4 = _mm_set1_ps(INFINITY);
+    __m128 mx4 = _mm_set1_ps(-INFINITY);
+    __m128 sum4 = _mm_setzero_ps();
+    for(; i + 4 <= n; i += 4){
+        __m128 v = _mm_loadu_ps(x + i);
+        for(k = 0; k < nsteps; ++k){
+            v = _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(a[k*c])), _mm_set1_ps(b[k*c]));
+            v = _mm_min_ps(_mm_max_ps(v, zero4), one4);
+        }
+        if(write){
+            _mm_storeu_ps(x + i, _mm_add_ps(_mm_mul_ps(v, fa4), fb4));
+        } else {
+            mn4 = _mm_min_ps(mn4, v);
+            mx4 = _mm_max_ps(mx4, v);
+            sum4 = _mm_add_ps(sum4, v);
+        }
+    }
+    if(!write){
+        float t[4];
+        _mm_storeu_ps(t, mn4);
+        for(k = 0; k < 4; ++k) mn = MIN(mn, t[k]);
+        _mm_storeu_ps(t, mx4);
+        for(k = 0; k < 4; ++k) mx = MAX(mx, t[k]);
+        _mm_storeu_ps(t, sum4);
+        for(k = 0; k < 4; ++k) sum += t[k];
+    }
+#endif
+    for(; i < n; ++i){
+        float v = x[i];
+        for(k = 0; k < nsteps; ++k){
+            v = a[k*c]*v + b[k*c];
+            v = MIN(MAX(v, 0), 1);
+        }
+        if(write){
+            x[i] = fa*v + fb;
+        } else {
+            mn = MIN(mn, v);
+            mx = MAX(mx, v);
+            sum += v;
+        }
+    }
+    if(!write){
+        s->min = mn;
+        s->max = mx;
+        s->sum = sum;
+    }
+}
+
+// Sweeps the whole image once through the compiled steps.
+// image im: image to process.
+// pointop_program *pr: compiled program.
+// int write: 1 to apply steps and pending affine in place, 0 for stats only.
+// pointop_stats *s: per-channel statistics, filled in when not writing.
+static void pointop_sweep(image im, pointop_program *pr, int write, pointop_stats *s)
+{
+    int size = im.w*im.h;
+    int nblocks = (size + POINTOP_BLOCK - 1)/POINTOP_BLOCK;
+    pointop_stats *partial = calloc(nblocks*im.c, sizeof(pointop_stats));
+    int j;
+    #pragma omp parallel for schedule(static)
+    for(j = 0; j < nblocks*im.c; ++j){
+        int k = j/nblocks;
+        int start = (j%nblocks)*POINTOP_BLOCK;
+        int n = MIN(POINTOP_BLOCK, size - start);
+        const float *a = pr->nsteps ? pr->a + k : 0;
+        const float *b = pr->nsteps ? pr->b + k : 0;
+        pointop_block(im.data + k*size + start, n, a, b, pr->nsteps, pr->c,
+                pr->pa[k], pr->pb[k], write, partial + j);
+    }
+    if(!write){
+        // Combine in block order so the result does not depend on threads.
+        int k;
+        for(k = 0; k < im.c; ++k){
+            s[k].min = INFINITY;
+            s[k].max = -INFINITY;
+            s[k].sum = 0;
+            for(j = 0; j < nblocks; ++j){
+                pointop_stats p = partial[k*nblocks + j];
+                s[k].min = MIN(s[k].min, p.min);
+                s[k].max = MAX(s[k].max, p.max);
+                s[k].sum += p.sum;
+            }
+        }
+    }
+    free(partial);
+}
+
+// Runs a recorded pipeline on an image in place.
+// pointop_pipeline p: operations to apply, in order.
+// image im: image to modify.
+void run_pointop_pipeline(pointop_pipeline p, image im)
+{
+    int i, k;
+    int size = im.w*im.h;
+    pointop_program pr;
+    pr.c = im.c;
+    pr.nsteps = 0;
+    pr.a = 0;
+    pr.b = 0;
+    pr.pa = calloc(im.c, sizeof(float));
+    pr.pb = calloc(im.c, sizeof(float));
+    for(k = 0; k < im.c; ++k) pr.pa[k] = 1;
+
+    pointop_stats *s = calloc(im.c, sizeof(pointop_stats));
+    int have_stats = 0;
+
+    for(i = 0; i < p.n; ++i){
+        pointop op = p.ops[i];
+        int lo = 0, hi = im.c;
+        if(op.c >= 0){
+            lo = MIN(op.c, im.c - 1);
+            hi = lo + 1;
+        }
+        if(op.op == OP_SHIFT){
+            for(k = lo; k < hi; ++k) pr.pb[k] += op.v;
+        } else if(op.op == OP_SCALE){
+            for(k = lo; k < hi; ++k){
+                pr.pa[k] *= op.v;
+                pr.pb[k] *= op.v;
+            }
+        } else if(op.op == OP_CLAMP){
+            // Turn the pending affine into a clamped step.
+            pr.a = realloc(pr.a, (pr.nsteps + 1)*im.c*sizeof(float));
+            pr.b = realloc(pr.b, (pr.nsteps + 1)*im.c*sizeof(float));
+            for(k = 0; k < im.c; ++k){
+                pr.a[pr.nsteps*im.c + k] = pr.pa[k];
+                pr.b[pr.nsteps*im.c + k] = pr.pb[k];
+                pr.pa[k] = 1;
+                pr.pb[k] = 0;
+            }
+            ++pr.nsteps;
+            have_stats = 0;
+        } else {
+            if(!have_stats){
+                pointop_sweep(im, &pr, 0, s);
+                have_stats = 1;
+            }
+            // Push the step statistics through the pending affine.
+            float min = INFINITY, max = -INFINITY;
+            double sum = 0;
+            for(k = 0; k < im.c; ++k){
+                float v1 = pr.pa[k]*s[k].min + pr.pb[k];
+                float v2 = pr.pa[k]*s[k].max + pr.pb[k];
+                min = MIN(min, MIN(v1, v2));
+                max = MAX(max, MAX(v1, v2));
+                sum += pr.pa[k]*s[k].sum + (double)pr.pb[k]*size;
+            }
+            float scale, shift;
+            if(op.op == OP_FEATURE_NORMALIZE){
+                float diff = max - min;
+                scale = diff == 0 ? 0 : 1/diff;
+                shift = diff == 0 ? 0 : -min/diff;
+            } else {
+                scale = 1/(float)sum;
+                shift = 0;
+            }
+            for(k = 0; k < im.c; ++k){
+                pr.pa[k] *= scale;
+                pr.pb[k] = pr.pb[k]*scale + shift;
+            }
+        }
+    }
+
+    int identity = pr.nsteps == 0;
+    for(k = 0; k < im.c; ++k){
+        if(pr.pa[k] != 1 || pr.pb[k] != 0) identity = 0;
+    }
+    if(!identity) pointop_sweep(im, &pr, 1, 0);
+
+    free(s);
+    free(pr.a);
+    free(pr.b);
+    free(pr.pa);
+    free(pr.pb);
+}
@@ -73,6 +73,18 @@ void shift_image(image im, int c, float v) {
     clamp_image(im);
 }
 
+void scale_image(image im, int c, float v) {
+    float* ptr = im.data;
+    c = fmin(im.c - 1, c);
+    c = fmax(0, c);
+
+    ptr += im.h * im.w * c;  // get to channel
+    for (int i = 0; i < im.h * im.w; i++) {
+        *ptr = *ptr * v;
+        ptr++;
+    }
+}
+
 void clamp_image(image im) {
     float* ptr = im.data;
     for (int i = 0; i < im.h * im.w * im.c; i++) {
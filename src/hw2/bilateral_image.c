@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+/***************************** Bilateral filter *************************
+  The exact filter weights every neighbour in a 6*sigma1 window by both
+  its distance and its difference in value, so its cost grows with
+  sigma1 squared.
+
+  The fast version uses the bilateral grid (Chen, Paris and Durand): each
+  channel is lifted into a 3d grid over (x, y, value) sampled every sigma1
+  pixels and every sigma2 in value. Pixels are splatted into the grid,
+  the grid is blurred with a small separable Gaussian, and every pixel
+  reads its result back with trilinear interpolation. The grid shrinks as
+  sigma1 grows, so the cost stays linear in the number of pixels. Below
+  sigma1 = 1.5 the exact window is small enough to be the faster choice.
+************************************************************************/
+
+#define GRID_PAD 3
+#define GRID_MAX_DEPTH 256
+
+// A bilateral grid for one channel.
+// int w, h, d: grid size in x, y and value.
+// float ss, sr: spatial and range sampling rates.
+// float min: value mapped to the first range cell (before padding).
+// float *val, *wgt: accumulated values and weights.
+typedef struct{
+    int w, h, d;
+    float ss, sr, min;
+    float *val, *wgt;
+} bilateral_grid;
+
+// Brute force bilateral filter, following the homework definition.
+// image im: image to filter.
+// float sigma1: spatial standard deviation, window is 6*sigma1 wide.
+// float sigma2: standard deviation of per-channel value differences.
+// returns: filtered image.
+image apply_bilateral_filter_exact(image im, float sigma1, float sigma2)
+{
+    image spatial = make_gaussian_filter(sigma1);
+    image out = make_image(im.w, im.h, im.c);
+    int r = spatial.w/2;
+    float inv = 1/(2*sigma2*sigma2);
+    int k;
+    for(k = 0; k < im.c; ++k){
+        int j;
+        #pragma omp parallel for schedule(static)
+        for(j = 0; j < im.h; ++j){
+            int i, dx, dy;
+            for(i = 0; i < im.w; ++i){
+                float center = im.data[k*im.w*im.h + j*im.w + i];
+                float sum = 0, norm = 0;
+                for(dy = -r; dy <= r; ++dy){
+                    for(dx = -r; dx <= r; ++dx){
+                        float v = get_pixel(im, i+dx, j+dy, k);
+                        float d = v - center;
+                        float wt = spatial.data[(dy+r)*spatial.w + dx+r]*expf(-d*d*inv);
+                        sum += wt*v;
+                        norm += wt;
+                    }
+                }
+                out.data[k*im.w*im.h + j*im.w + i] = sum/norm;
+            }
+        }
+    }
+    free_image(spatial);
+    return out;
+}
+
+// Makes an empty grid covering one channel of an image.
+static bilateral_grid make_bilateral_grid(image im, int c, float sigma1, float sigma2)
+{
+    float *x = im.data + c*im.w*im.h;
+    float min = x[0], max = x[0];
+    int i;
+    for(i = 1; i < im.w*im.h; ++i){
+        min = MIN(min, x[i]);
+        max = MAX(max, x[i]);
+    }
+    bilateral_grid g;
+    g.ss = MAX(sigma1, 1);
+    g.sr = MAX(sigma2, (max - min)/(GRID_MAX_DEPTH - 2*GRID_PAD - 2));
+    if(g.sr <= 0) g.sr = 1;
+    g.min = min;
+    g.w = (int)((im.w - 1)/g.ss) + 2*GRID_PAD + 2;
+    g.h = (int)((im.h - 1)/g.ss) + 2*GRID_PAD + 2;
+    g.d = (int)((max - min)/g.sr) + 2*GRID_PAD + 2;
+    g.val = calloc(g.w*g.h*g.d, sizeof(float));
+    g.wgt = calloc(g.w*g.h*g.d, sizeof(float));
+    return g;
+}
+
+static void free_bilateral_grid(bilateral_grid g)
+{
+    free(g.val);
+    free(g.wgt);
+}
+
+// Trilinear weights and base cell for a position in grid coordinates.
+static inline int grid_cell(bilateral_grid *g, float gx, float gy, float gz, float *fx, float *fy, float *fz)
+{
+    int x = (int)gx, y = (int)gy, z = (int)gz;
+    *fx = gx - x;
+    *fy = gy - y;
+    *fz = gz - z;
+    return (z*g->h + y)*g->w + x;
+}
+
+// Adds every pixel of a channel into the grid with trilinear weights.
+static void splat_grid(bilateral_grid *g, image im, int c)
+{
+    float *x = im.data + c*im.w*im.h;
+    int sx = 1, sy = g->w, sz = g->w*g->h;
+    int i, j;
+    for(j = 0; j < im.h; ++j){
+        for(i = 0; i < im.w; ++i){
+            float v = x[j*im.w + i];
+            float fx, fy, fz;
+            int b = grid_cell(g, i/g->ss + GRID_PAD, j/g->ss + GRID_PAD,
+                    (v - g->min)/g->sr + GRID_PAD, &fx, &fy, &fz);
+            int dz, dy, dx;
+            for(dz = 0; dz < 2; ++dz){
+                float wz = dz ? fz : 1 - fz;
+                for(dy = 0; dy < 2; ++dy){
+                    float wy = wz*(dy ? fy : 1 - fy);
+                    for(dx = 0; dx < 2; ++dx){
+                        float wt = wy*(dx ? fx : 1 - fx);
+                        int o = b + dz*sz + dy*sy + dx*sx;
+                        g->val[o] += wt*v;
+                        g->wgt[o] += wt;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Blurs a grid buffer along one axis with a 1d kernel.
+// float *a: grid buffer.
+// int n: number of cells along the axis.
+// int stride: distance between neighbouring cells along the axis.
+// int lines, line_stride, inner: how the other two axes are laid out,
+//     lines*inner independent lines each starting at l*line_stride + i.
+// float *k: kernel of 2r+1 taps.
+static void blur_axis(float *a, int n, int stride, int lines, int line_stride, int inner, float *k, int r)
+{
+    int l;
+    #pragma omp parallel for schedule(static)
+    for(l = 0; l < lines; ++l){
+        float *tmp = calloc(n, sizeof(float));
+        int i, t, d;
+        for(i = 0; i < inner; ++i){
+            float *p = a + l*line_stride + i;
+            for(t = 0; t < n; ++t){
+                float sum = 0;
+                for(d = -r; d <= r; ++d){
+                    int s = t + d;
+                    if(s >= 0 && s < n) sum += k[d + r]*p[s*stride];
+                }
+                tmp[t] = sum;
+            }
+            for(t = 0; t < n; ++t) p[t*stride] = tmp[t];
+        }
+        free(tmp);
+    }
+}
+
+// Builds a Gaussian kernel with standard deviation sigma cells.
+static float *grid_kernel(float sigma, int *r)
+{
+    *r = MAX(1, (int)ceilf(2*sigma));
+    *r = MIN(*r, GRID_PAD - 1);
+    float *k = calloc(2*(*r) + 1, sizeof(float));
+    int d;
+    for(d = -*r; d <= *r; ++d){
+        k[d + *r] = expf(-(d*d)/(2*sigma*sigma));
+    }
+    return k;
+}
+
+// Blurs values and weights of a grid in all three dimensions.
+static void blur_grid(bilateral_grid *g, float sigma1, float sigma2)
+{
+    int rs, rr;
+    float *ks = grid_kernel(sigma1/g->ss, &rs);
+    float *kr = grid_kernel(sigma2/g->sr, &rr);
+    float *bufs[2] = {g->val, g->wgt};
+    int b;
+    for(b = 0; b < 2; ++b){
+        float *a = bufs[b];
+        // x: lines are rows, one per (z, y).
+        blur_axis(a, g->w, 1, g->d*g->h, g->w, 1, ks, rs);
+        // y: one block per z, w columns inside it.
+        blur_axis(a, g->h, g->w, g->d, g->w*g->h, g->w, ks, rs);
+        // z: one block per y, w columns inside it.
+        blur_axis(a, g->d, g->w*g->h, g->h, g->w, g->w, kr, rr);
+    }
+    free(ks);
+    free(kr);
+}
+
+// Reads the filtered channel back out of the grid.
+static void slice_grid(bilateral_grid *g, image im, int c, image out)
+{
+    float *x = im.data + c*im.w*im.h;
+    float *o = out.data + c*im.w*im.h;
+    int sy = g->w, sz = g->w*g->h;
+    int j;
+    #pragma omp parallel for schedule(static)
+    for(j = 0; j < im.h; ++j){
+        int i;
+        for(i = 0; i < im.w; ++i){
+            float v = x[j*im.w + i];
+            float fx, fy, fz;
+            int b = grid_cell(g, i/g->ss + GRID_PAD, j/g->ss + GRID_PAD,
+                    (v - g->min)/g->sr + GRID_PAD, &fx, &fy, &fz);
+            float val = 0, wgt = 0;
+            int dz, dy, dx;
+            for(dz = 0; dz < 2; ++dz){
+                float wz = dz ? fz : 1 - fz;
+                for(dy = 0; dy < 2; ++dy){
+                    float wy = wz*(dy ? fy : 1 - fy);
+                    for(dx = 0; dx < 2; ++dx){
+                        float wt = wy*(dx ? fx : 1 - fx);
+                        int q = b + dz*sz + dy*sy + dx;
+                        val += wt*g->val[q];
+                        wgt += wt*g->wgt[q];
+                    }
+                }
+            }
+            o[j*im.w + i] = wgt > 0 ? val/wgt : v;
+        }
+    }
+}
+
+// Edge-preserving smoothing with a bilateral grid approximation.
+// image im: image to filter.
+// float sigma1: spatial standard deviation in pixels.
+// float sigma2: standard deviation of per-channel value differences.
+// returns: filtered image.
+image apply_bilateral_filter(image im, float sigma1, float sigma2)
+{
+    // Tiny windows are cheaper to do exactly than to grid.
+    if(sigma1 < 1.5) return apply_bilateral_filter_exact(im, sigma1, sigma2);
+    image out = make_image(im.w, im.h, im.c);
+    int k;
+    for(k = 0; k < im.c; ++k){
+        bilateral_grid g = make_bilateral_grid(im, k, sigma1, sigma2);
+        splat_grid(&g, im, k);
+        blur_grid(&g, sigma1, sigma2);
+        slice_grid(&g, im, k, out);
+        free_bilateral_grid(g);
+    }
+    return out;
+}
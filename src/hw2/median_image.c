@@ -0,0 +1,297 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/***************************** Median filter ****************************
+  3x3 and 5x5 use fixed sorting networks (Paeth / Devillard), run on a
+  vector of neighbouring output pixels at a time so each compare-swap is
+  one min and one max instruction. These are exact.
+
+  Larger windows use the constant-time algorithm of Perreault and Hebert
+  on values quantised to 8 bits: every column keeps a histogram of the
+  2r+1 pixels above and below the current row, and the kernel histogram
+  slides right by adding one column histogram and removing another.
+  Histograms are split into 16 coarse and 256 fine bins, and fine kernel
+  bins are only brought up to date for the coarse bin the median lands
+  in, so the cost per pixel does not depend on the kernel size.
+
+  Borders are clamped like get_pixel.
+************************************************************************/
+
+#if defined(__AVX__)
+typedef __m256 vecf;
+#define VW 8
+#define VLOAD _mm256_loadu_ps
+#define VSTORE _mm256_storeu_ps
+#define VMIN _mm256_min_ps
+#define VMAX _mm256_max_ps
+#elif defined(__SSE2__)
+typedef __m128 vecf;
+#define VW 4
+#define VLOAD _mm_loadu_ps
+#define VSTORE _mm_storeu_ps
+#define VMIN _mm_min_ps
+#define VMAX _mm_max_ps
+#else
+typedef float vecf;
+#define VW 1
+#define VLOAD(p) (*(p))
+#define VSTORE(p, v) (*(p) = (v))
+#define VMIN(a, b) ((a) < (b) ? (a) : (b))
+#define VMAX(a, b) ((a) < (b) ? (b) : (a))
+#endif
+
+#define PIX_SORT(a, b) { vecf t = VMIN(p[a], p[b]); p[b] = VMAX(p[a], p[b]); p[a] = t; }
+
+#define MEDIAN_STRIP 128
+
+static vecf median9(vecf *p)
+{
+    PIX_SORT(1, 2); PIX_SORT(4, 5); PIX_SORT(7, 8);
+    PIX_SORT(0, 1); PIX_SORT(3, 4); PIX_SORT(6, 7);
+    PIX_SORT(1, 2); PIX_SORT(4, 5); PIX_SORT(7, 8);
+    PIX_SORT(0, 3); PIX_SORT(5, 8); PIX_SORT(4, 7);
+    PIX_SORT(3, 6); PIX_SORT(1, 4); PIX_SORT(2, 5);
+    PIX_SORT(4, 7); PIX_SORT(4, 2); PIX_SORT(6, 4);
+    PIX_SORT(4, 2);
+    return p[4];
+}
+
+static vecf median25(vecf *p)
+{
+    PIX_SORT(0, 1);   PIX_SORT(3, 4);   PIX_SORT(2, 4);
+    PIX_SORT(2, 3);   PIX_SORT(6, 7);   PIX_SORT(5, 7);
+    PIX_SORT(5, 6);   PIX_SORT(9, 10);  PIX_SORT(8, 10);
+    PIX_SORT(8, 9);   PIX_SORT(12, 13); PIX_SORT(11, 13);
+    PIX_SORT(11, 12); PIX_SORT(15, 16); PIX_SORT(14, 16);
+    PIX_SORT(14, 15); PIX_SORT(18, 19); PIX_SORT(17, 19);
+    PIX_SORT(17, 18); PIX_SORT(21, 22); PIX_SORT(20, 22);
+    PIX_SORT(20, 21); PIX_SORT(23, 24); PIX_SORT(2, 5);
+    PIX_SORT(3, 6);   PIX_SORT(0, 6);   PIX_SORT(0, 3);
+    PIX_SORT(4, 7);   PIX_SORT(1, 7);   PIX_SORT(1, 4);
+    PIX_SORT(11, 14); PIX_SORT(8, 14);  PIX_SORT(8, 11);
+    PIX_SORT(12, 15); PIX_SORT(9, 15);  PIX_SORT(9, 12);
+    PIX_SORT(13, 16); PIX_SORT(10, 16); PIX_SORT(10, 13);
+    PIX_SORT(20, 23); PIX_SORT(17, 23); PIX_SORT(17, 20);
+    PIX_SORT(21, 24); PIX_SORT(18, 24); PIX_SORT(18, 21);
+    PIX_SORT(19, 22); PIX_SORT(8, 17);  PIX_SORT(9, 18);
+    PIX_SORT(0, 18);  PIX_SORT(0, 9);   PIX_SORT(10, 19);
+    PIX_SORT(1, 19);  PIX_SORT(1, 10);  PIX_SORT(11, 20);
+    PIX_SORT(2, 20);  PIX_SORT(2, 11);  PIX_SORT(12, 21);
+    PIX_SORT(3, 21);  PIX_SORT(3, 12);  PIX_SORT(13, 22);
+    PIX_SORT(4, 22);  PIX_SORT(4, 13);  PIX_SORT(14, 23);
+    PIX_SORT(5, 23);  PIX_SORT(5, 14);  PIX_SORT(15, 24);
+    PIX_SORT(6, 24);  PIX_SORT(6, 15);  PIX_SORT(7, 16);
+    PIX_SORT(7, 19);  PIX_SORT(13, 21); PIX_SORT(15, 23);
+    PIX_SORT(7, 13);  PIX_SORT(7, 15);  PIX_SORT(1, 9);
+    PIX_SORT(3, 11);  PIX_SORT(5, 17);  PIX_SORT(11, 17);
+    PIX_SORT(9, 17);  PIX_SORT(4, 10);  PIX_SORT(6, 12);
+    PIX_SORT(7, 14);  PIX_SORT(4, 6);   PIX_SORT(4, 7);
+    PIX_SORT(12, 14); PIX_SORT(10, 14); PIX_SORT(6, 7);
+    PIX_SORT(10, 12); PIX_SORT(6, 10);  PIX_SORT(6, 17);
+    PIX_SORT(12, 17); PIX_SORT(7, 17);  PIX_SORT(7, 10);
+    PIX_SORT(12, 18); PIX_SORT(7, 12);  PIX_SORT(10, 18);
+    PIX_SORT(12, 20); PIX_SORT(10, 20); PIX_SORT(10, 12);
+    return p[12];
+}
+
+// Copies one channel into a buffer with r clamped pixels on every side and
+// VW extra columns on the right, so vector loads never need a bounds check.
+// image im: source image.
+// int c: channel to copy.
+// int r: halo size.
+// int *pw: filled in with the row stride of the buffer.
+// returns: the padded buffer.
+static float *pad_channel(image im, int c, int r, int *pw)
+{
+    int w = im.w + 2*r + VW;
+    int h = im.h + 2*r;
+    float *pad = calloc(w*h, sizeof(float));
+    int x, y;
+    for(y = 0; y < h; ++y){
+        int sy = MIN(MAX(y - r, 0), im.h - 1);
+        float *src = im.data + c*im.w*im.h + sy*im.w;
+        float *dst = pad + y*w;
+        for(x = 0; x < r; ++x) dst[x] = src[0];
+        memcpy(dst + r, src, im.w*sizeof(float));
+        for(x = r + im.w; x < w; ++x) dst[x] = src[im.w - 1];
+    }
+    *pw = w;
+    return pad;
+}
+
+// Median filter with a 3x3 or 5x5 sorting network.
+// image im: image to filter.
+// int r: 1 for 3x3, 2 for 5x5.
+// returns: filtered image.
+static image median_network(image im, int r)
+{
+    image out = make_image(im.w, im.h, im.c);
+    int k = 2*r + 1;
+    int c;
+    for(c = 0; c < im.c; ++c){
+        int pw;
+        float *pad = pad_channel(im, c, r, &pw);
+        float *o = out.data + c*im.w*im.h;
+        int y;
+        #pragma omp parallel for schedule(static)
+        for(y = 0; y < im.h; ++y){
+            vecf p[25];
+            float tmp[VW];
+            int x, dx, dy;
+            for(x = 0; x < im.w; x += VW){
+                for(dy = 0; dy < k; ++dy){
+                    for(dx = 0; dx < k; ++dx){
+                        p[dy*k + dx] = VLOAD(pad + (y + dy)*pw + x + dx);
+                    }
+                }
+                vecf m = r == 1 ? median9(p) : median25(p);
+                if(x + VW <= im.w){
+                    VSTORE(o + y*im.w + x, m);
+                } else {
+                    VSTORE(tmp, m);
+                    memcpy(o + y*im.w + x, tmp, (im.w - x)*sizeof(float));
+                }
+            }
+        }
+        free(pad);
+    }
+    return out;
+}
+
+// Per-strip state for the histogram median.
+// unsigned short *cc, *cf: coarse (16) and fine (256) histogram per column.
+// unsigned int kc[16], kf[256]: kernel histogram, fine bins may be stale.
+// int luc[16]: column the fine bins of each coarse bin were last updated at.
+typedef struct{
+    unsigned short *cc, *cf;
+    unsigned int kc[16], kf[256];
+    int luc[16];
+} median_hist;
+
+static inline int clampi(int v, int lo, int hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// Brings the fine bins of coarse bin s up to date for the kernel at column x.
+static void update_fine(median_hist *mh, int s, int x, int r, int w)
+{
+    unsigned int *kf = mh->kf + 16*s;
+    int j, b;
+    if(mh->luc[s] <= x - (2*r + 1)){
+        memset(kf, 0, 16*sizeof(unsigned int));
+        for(j = x - r; j <= x + r; ++j){
+            unsigned short *cf = mh->cf + 256*clampi(j, 0, w - 1) + 16*s;
+            for(b = 0; b < 16; ++b) kf[b] += cf[b];
+        }
+    } else {
+        for(j = mh->luc[s] + 1; j <= x; ++j){
+            unsigned short *add = mh->cf + 256*clampi(j + r, 0, w - 1) + 16*s;
+            unsigned short *sub = mh->cf + 256*clampi(j - r - 1, 0, w - 1) + 16*s;
+            for(b = 0; b < 16; ++b) kf[b] += add[b] - sub[b];
+        }
+    }
+    mh->luc[s] = x;
+}
+
+// Histogram median over rows [y0, y1) of one quantised channel.
+// unsigned char *q: quantised channel.
+// float *o: output channel.
+// int w, h: channel size.
+// int r: kernel radius.
+static void median_histogram_strip(const unsigned char *q, float *o, int w, int h, int r, int y0, int y1)
+{
+    median_hist mh;
+    mh.cc = calloc(16*w, sizeof(unsigned short));
+    mh.cf = calloc(256*w, sizeof(unsigned short));
+    int half = (2*r + 1)*(2*r + 1)/2;
+    int x, y, j, b;
+
+    // Column histograms for the rows around y0.
+    for(j = y0 - r; j <= y0 + r; ++j){
+        const unsigned char *row = q + clampi(j, 0, h - 1)*w;
+        for(x = 0; x < w; ++x){
+            ++mh.cc[16*x + (row[x] >> 4)];
+            ++mh.cf[256*x + row[x]];
+        }
+    }
+
+    for(y = y0; y < y1; ++y){
+        if(y > y0){
+            const unsigned char *out_row = q + clampi(y - r - 1, 0, h - 1)*w;
+            const unsigned char *in_row = q + clampi(y + r, 0, h - 1)*w;
+            for(x = 0; x < w; ++x){
+                --mh.cc[16*x + (out_row[x] >> 4)];
+                --mh.cf[256*x + out_row[x]];
+                ++mh.cc[16*x + (in_row[x] >> 4)];
+                ++mh.cf[256*x + in_row[x]];
+            }
+        }
+
+        // Kernel histogram at x = 0, fine bins filled in lazily.
+        memset(mh.kc, 0, sizeof(mh.kc));
+        for(j = -r; j <= r; ++j){
+            unsigned short *cc = mh.cc + 16*clampi(j, 0, w - 1);
+            for(b = 0; b < 16; ++b) mh.kc[b] += cc[b];
+        }
+        for(b = 0; b < 16; ++b) mh.luc[b] = -(2*r + 1);
+
+        for(x = 0; x < w; ++x){
+            if(x > 0){
+                unsigned short *add = mh.cc + 16*clampi(x + r, 0, w - 1);
+                unsigned short *sub = mh.cc + 16*clampi(x - r - 1, 0, w - 1);
+                for(b = 0; b < 16; ++b) mh.kc[b] += add[b] - sub[b];
+            }
+            int s, sum = 0;
+            for(s = 0; s < 15 && sum + (int)mh.kc[s] <= half; ++s) sum += mh.kc[s];
+            update_fine(&mh, s, x, r, w);
+            unsigned int *kf = mh.kf + 16*s;
+            for(b = 0; b < 15 && sum + (int)kf[b] <= half; ++b) sum += kf[b];
+            o[y*w + x] = (16*s + b)/255.;
+        }
+    }
+    free(mh.cc);
+    free(mh.cf);
+}
+
+// Median filter using column histograms over 8-bit quantised values.
+// image im: image to filter.
+// int r: kernel radius.
+// returns: filtered image, values are multiples of 1/255.
+static image median_histogram(image im, int r)
+{
+    image out = make_image(im.w, im.h, im.c);
+    image_u8 q = image_to_u8(im);
+    int size = im.w*im.h;
+    int nstrips = (im.h + MEDIAN_STRIP - 1)/MEDIAN_STRIP;
+    int j;
+    #pragma omp parallel for schedule(dynamic)
+    for(j = 0; j < nstrips*im.c; ++j){
+        int c = j/nstrips;
+        int y0 = (j%nstrips)*MEDIAN_STRIP;
+        int y1 = MIN(y0 + MEDIAN_STRIP, im.h);
+        median_histogram_strip(q.data + c*size, out.data + c*size, im.w, im.h, r, y0, y1);
+    }
+    free_image_u8(q);
+    return out;
+}
+
+// Applies a median filter to every channel of an image.
+// image im: image to filter.
+// int kernel_size: width of the square window, even sizes round up.
+// returns: filtered image. 3x3 and 5x5 are exact, larger windows work on
+//          values clamped to [0, 1] and quantised to 8 bits.
+image apply_median_filter(image im, int kernel_size)
+{
+    int r = kernel_size/2;
+    if(r <= 0) return copy_image(im);
+    if(r <= 2) return median_network(im, r);
+    return median_histogram(im, r);
+}
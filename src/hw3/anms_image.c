@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+/***************************** Adaptive NMS *****************************
+  Adaptive non-maximal suppression (Brown, Szeliski and Winder) keeps the
+  corners that are the strongest within the largest radius. A corner's
+  radius is the distance to the nearest corner that is clearly stronger
+  (its response times ANMS_ROBUST is still larger), and the k corners
+  with the largest radii are kept, so they are spread over the image.
+
+  Radii are found with a uniform grid of buckets. Each bucket remembers
+  its strongest response, so whole buckets that can't suppress a corner
+  are skipped, and rings of buckets are searched outwards only until
+  they are further away than the best distance found so far. The k
+  largest radii are then picked with quickselect instead of sorting.
+************************************************************************/
+
+#define ANMS_ROBUST .9
+
+typedef struct{
+    float r2;
+    float v;
+    int i;
+} anms_point;
+
+// Orders points by radius, then response, then index, largest first.
+static inline int anms_before(anms_point a, anms_point b)
+{
+    if(a.r2 != b.r2) return a.r2 > b.r2;
+    if(a.v != b.v) return a.v > b.v;
+    return a.i < b.i;
+}
+
+// Rearranges p so its first k entries are the k that sort first.
+static void anms_partial_select(anms_point *p, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+    while(lo < hi){
+        int mid = lo + (hi - lo)/2;
+        // Median of three as the pivot.
+        if(anms_before(p[mid], p[lo])){ anms_point t = p[mid]; p[mid] = p[lo]; p[lo] = t; }
+        if(anms_before(p[hi], p[lo])){ anms_point t = p[hi]; p[hi] = p[lo]; p[lo] = t; }
+        if(anms_before(p[hi], p[mid])){ anms_point t = p[hi]; p[hi] = p[mid]; p[mid] = t; }
+        anms_point pivot = p[mid];
+        int i = lo, j = hi;
+        while(i <= j){
+            while(anms_before(p[i], pivot)) ++i;
+            while(anms_before(pivot, p[j])) --j;
+            if(i <= j){
+                anms_point t = p[i]; p[i] = p[j]; p[j] = t;
+                ++i; --j;
+            }
+        }
+        if(k - 1 <= j) hi = j;
+        else if(k - 1 >= i) lo = i;
+        else break;
+    }
+}
+
+static int int_compare(const void *a, const void *b)
+{
+    int ia = *(int *)a;
+    int ib = *(int *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+// Picks up to k well spread corners from a list of candidates.
+// image R: 1-channel response map the candidates came from.
+// int *idx: candidate pixel indexes, e.g. from nms_candidates.
+// int n: number of candidates.
+// int k: number of corners to keep, 0 keeps them all.
+// int *kept: filled in with the number of corners returned.
+// returns: indexes of the kept corners in row-major order.
+int *anms_select(image R, int *idx, int n, int k, int *kept)
+{
+    int i;
+    if(k <= 0 || k >= n){
+        int *out = calloc(n + 1, sizeof(int));
+        memcpy(out, idx, n*sizeof(int));
+        *kept = n;
+        return out;
+    }
+
+    // Buckets of roughly 4 candidates each.
+    int cell = MAX(1, (int)sqrtf(4.0f*R.w*R.h/n));
+    int gw = (R.w + cell - 1)/cell;
+    int gh = (R.h + cell - 1)/cell;
+    int *start = calloc(gw*gh + 1, sizeof(int));
+    int *order = calloc(n, sizeof(int));
+    float *cellmax = calloc(gw*gh, sizeof(float));
+    float globalmax = -INFINITY;
+    for(i = 0; i < gw*gh; ++i) cellmax[i] = -INFINITY;
+    for(i = 0; i < n; ++i){
+        int x = idx[i]%R.w, y = idx[i]/R.w;
+        int c = (y/cell)*gw + x/cell;
+        float v = R.data[idx[i]];
+        ++start[c + 1];
+        cellmax[c] = MAX(cellmax[c], v);
+        globalmax = MAX(globalmax, v);
+    }
+    for(i = 0; i < gw*gh; ++i) start[i + 1] += start[i];
+    int *fill = calloc(gw*gh, sizeof(int));
+    for(i = 0; i < n; ++i){
+        int x = idx[i]%R.w, y = idx[i]/R.w;
+        int c = (y/cell)*gw + x/cell;
+        order[start[c] + fill[c]++] = idx[i];
+    }
+    free(fill);
+
+    anms_point *p = calloc(n, sizeof(anms_point));
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(i = 0; i < n; ++i){
+        int x = idx[i]%R.w, y = idx[i]/R.w;
+        float v = R.data[idx[i]];
+        float best = INFINITY;
+        if(ANMS_ROBUST*globalmax > v){
+            int cx = x/cell, cy = y/cell;
+            int ring;
+            for(ring = 0; ; ++ring){
+                float reach = (float)(ring - 1)*cell;
+                if(ring > 0 && reach*reach >= best) break;
+                if(cx - ring < 0 && cy - ring < 0 && cx + ring >= gw && cy + ring >= gh) break;
+                int gx, gy;
+                for(gy = cy - ring; gy <= cy + ring; ++gy){
+                    if(gy < 0 || gy >= gh) continue;
+                    int step = (gy == cy - ring || gy == cy + ring) ? 1 : 2*ring;
+                    for(gx = cx - ring; gx <= cx + ring; gx += MAX(step, 1)){
+                        if(gx < 0 || gx >= gw) continue;
+                        int c = gy*gw + gx;
+                        if(ANMS_ROBUST*cellmax[c] <= v) continue;
+                        int j;
+                        for(j = start[c]; j < start[c + 1]; ++j){
+                            int o = order[j];
+                            if(ANMS_ROBUST*R.data[o] <= v) continue;
+                            float ddx = o%R.w - x, ddy = o/R.w - y;
+                            best = MIN(best, ddx*ddx + ddy*ddy);
+                        }
+                    }
+                }
+            }
+        }
+        p[i].r2 = best;
+        p[i].v = v;
+        p[i].i = idx[i];
+    }
+
+    anms_partial_select(p, n, k);
+    int *out = calloc(k, sizeof(int));
+    for(i = 0; i < k; ++i) out[i] = p[i].i;
+    qsort(out, k, sizeof(int), int_compare);
+    *kept = k;
+
+    free(p);
+    free(start);
+    free(order);
+    free(cellmax);
+    return out;
+}
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/***************************** Binary descriptors ***********************
+  BRIEF (Calonder et al.) describes a corner with 256 intensity tests
+  between pairs of points in a 31x31 patch, each giving one bit, so a
+  descriptor is 32 bytes instead of 300 for a 5x5x3 float patch. As in
+  ORB the pairs are drawn once from a Gaussian around the corner and the
+  patch is box filtered 5x5 first so single noisy pixels don't flip bits.
+
+  Each corner copies its own grey patch, clamped at the image borders,
+  and box filters it with running sums, so the cost depends on the
+  number of corners and not the image size.
+
+  Descriptors are compared by Hamming distance: xor and count the set
+  bits. With AVX2 the bits are counted with a nibble lookup table
+  (pshufb) and summed with psadbw, four candidates at a time; otherwise
+  with __builtin_popcountll on 64-bit words, which is the popcnt
+  instruction only with AVX=1 (-mpopcnt) and a libgcc call without.
+************************************************************************/
+
+#define BRIEF_R 15
+#define BRIEF_BOX 2
+#define BRIEF_PATCH (2*(BRIEF_R + BRIEF_BOX) + 1)
+
+// Sampling pattern, BINARY_BITS pairs of points in [-BRIEF_R, BRIEF_R]^2.
+typedef struct{
+    signed char x1, y1, x2, y2;
+} brief_pair;
+
+// Draws the fixed sampling pattern from an isotropic Gaussian with
+// standard deviation 31/5, using its own generator so it never changes
+// and doesn't touch rand().
+static void brief_pattern(brief_pair *pairs)
+{
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    float sigma = (2*BRIEF_R + 1)/5.0f;
+    int i, k;
+    for(i = 0; i < BINARY_BITS; ++i){
+        int v[4];
+        for(k = 0; k < 4; k += 2){
+            state = state*6364136223846793005ULL + 1442695040888963407ULL;
+            float u1 = ((state >> 40) + 1)/16777217.0f;
+            state = state*6364136223846793005ULL + 1442695040888963407ULL;
+            float u2 = (state >> 40)/16777216.0f;
+            float r = sigma*sqrtf(-2*logf(u1));
+            v[k] = (int)roundf(r*cosf(TWOPI*u2));
+            v[k+1] = (int)roundf(r*sinf(TWOPI*u2));
+        }
+        for(k = 0; k < 4; ++k) v[k] = MIN(MAX(v[k], -BRIEF_R), BRIEF_R);
+        pairs[i].x1 = v[0];
+        pairs[i].y1 = v[1];
+        pairs[i].x2 = v[2];
+        pairs[i].y2 = v[3];
+    }
+}
+
+binary_set make_binary_set(int n)
+{
+    binary_set s;
+    s.n = n;
+    s.p = calloc(MAX(n, 1), sizeof(point));
+    size_t bytes = (size_t)MAX(n, 1)*BINARY_WORDS*sizeof(unsigned long long);
+    s.bits = aligned_alloc(32, bytes);
+    memset(s.bits, 0, bytes);
+    return s;
+}
+
+void free_binary_set(binary_set s)
+{
+    free(s.p);
+    free(s.bits);
+}
+
+// Grey patch around (x, y), clamped at borders, then 5x5 box sums.
+// float *box: BRIEF_PATCH - 2*BRIEF_BOX squared box sums.
+static void brief_patch(image im, int x, int y, float *grey, float *rows, float *box)
+{
+    int n = BRIEF_PATCH, m = BRIEF_PATCH - 2*BRIEF_BOX;
+    int r = BRIEF_R + BRIEF_BOX;
+    float wts[3] = {.299, .587, .114};
+    int i, j, c;
+    for(j = 0; j < n; ++j){
+        int sy = MIN(MAX(y + j - r, 0), im.h - 1);
+        for(i = 0; i < n; ++i){
+            int sx = MIN(MAX(x + i - r, 0), im.w - 1);
+            size_t o = (size_t)sy*im.w + sx;
+            if(im.c == 3){
+                float v = 0;
+                for(c = 0; c < 3; ++c) v += wts[c]*im.data[c*(size_t)im.w*im.h + o];
+                grey[j*n + i] = v;
+            } else {
+                grey[j*n + i] = im.data[o];
+            }
+        }
+    }
+    // Horizontal then vertical running sums over 2*BRIEF_BOX + 1.
+    for(j = 0; j < n; ++j){
+        const float *g = grey + j*n;
+        float sum = 0;
+        for(i = 0; i < 2*BRIEF_BOX + 1; ++i) sum += g[i];
+        rows[j*m] = sum;
+        for(i = 1; i < m; ++i){
+            sum += g[i + 2*BRIEF_BOX] - g[i - 1];
+            rows[j*m + i] = sum;
+        }
+    }
+    for(i = 0; i < m; ++i) box[i] = 0;
+    for(j = 0; j < 2*BRIEF_BOX + 1; ++j){
+        for(i = 0; i < m; ++i) box[i] += rows[j*m + i];
+    }
+    for(j = 1; j < m; ++j){
+        for(i = 0; i < m; ++i){
+            box[j*m + i] = box[(j-1)*m + i] + rows[(j + 2*BRIEF_BOX)*m + i] - rows[(j-1)*m + i];
+        }
+    }
+}
+
+// Describes corners with 256-bit BRIEF descriptors.
+// image im: source image, 3 channels are converted to grey.
+// int *idx: pixel index of each corner.
+// int n: number of corners.
+// returns: set of n binary descriptors.
+binary_set describe_binary(image im, int *idx, int n)
+{
+    brief_pair pairs[BINARY_BITS];
+    brief_pattern(pairs);
+    binary_set s = make_binary_set(n);
+    int m = BRIEF_PATCH - 2*BRIEF_BOX;
+    int i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < n; ++i){
+        float grey[BRIEF_PATCH*BRIEF_PATCH];
+        float rows[BRIEF_PATCH*(BRIEF_PATCH - 2*BRIEF_BOX)];
+        float box[(BRIEF_PATCH - 2*BRIEF_BOX)*(BRIEF_PATCH - 2*BRIEF_BOX)];
+        int x = idx[i]%im.w, y = idx[i]/im.w;
+        brief_patch(im, x, y, grey, rows, box);
+        s.p[i].x = x;
+        s.p[i].y = y;
+        unsigned long long *bits = s.bits + (size_t)i*BINARY_WORDS;
+        int k;
+        for(k = 0; k < BINARY_BITS; ++k){
+            const brief_pair *q = pairs + k;
+            float a = box[(q->y1 + BRIEF_R)*m + q->x1 + BRIEF_R];
+            float b = box[(q->y2 + BRIEF_R)*m + q->x2 + BRIEF_R];
+            bits[k/64] |= (unsigned long long)(a < b) << (k%64);
+        }
+    }
+    return s;
+}
+
+// Runs a detector and describes its corners with binary descriptors.
+// Parameters are the same as detect_corner_set.
+binary_set detect_binary_set(image im, DETECTOR det, float sigma, float thresh, int nms, int max_corners)
+{
+    int count = 0;
+    int *idx = detect_corner_indexes(im, det, sigma, thresh, nms, max_corners, &count);
+    binary_set s = describe_binary(im, idx, count);
+    free(idx);
+    return s;
+}
+
+// Hamming distance between two binary descriptors.
+static inline int hamming(const unsigned long long *a, const unsigned long long *b)
+{
+    int d = 0, k;
+    for(k = 0; k < BINARY_WORDS; ++k) d += __builtin_popcountll(a[k] ^ b[k]);
+    return d;
+}
+
+#ifdef __AVX2__
+// Bytewise set bit counts of a 256-bit register, summed into 4 64-bit lanes.
+static inline __m256i popcount_lanes(__m256i v)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+#endif
+
+// Finds the nearest descriptor in b, the lowest index on ties.
+// returns: index in b, distance in *best.
+static int nearest_binary(const unsigned long long *q, binary_set b, int *best)
+{
+    int bind = 0, bdist = BINARY_BITS + 1;
+    int i = 0;
+#ifdef __AVX2__
+    __m256i vq = _mm256_load_si256((const __m256i *)q);
+    for(; i + 4 <= b.n; i += 4){
+        const __m256i *c = (const __m256i *)(b.bits + (size_t)i*BINARY_WORDS);
+        __m256i s0 = popcount_lanes(_mm256_xor_si256(vq, _mm256_load_si256(c)));
+        __m256i s1 = popcount_lanes(_mm256_xor_si256(vq, _mm256_load_si256(c + 1)));
+        __m256i s2 = popcount_lanes(_mm256_xor_si256(vq, _mm256_load_si256(c + 2)));
+        __m256i s3 = popcount_lanes(_mm256_xor_si256(vq, _mm256_load_si256(c + 3)));
+        // Fold the four partial sums of each candidate together.
+        __m256i s01 = _mm256_add_epi64(_mm256_unpacklo_epi64(s0, s1), _mm256_unpackhi_epi64(s0, s1));
+        __m256i s23 = _mm256_add_epi64(_mm256_unpacklo_epi64(s2, s3), _mm256_unpackhi_epi64(s2, s3));
+        __m256i t = _mm256_add_epi64(_mm256_permute2x128_si256(s01, s23, 0x20),
+                _mm256_permute2x128_si256(s01, s23, 0x31));
+        long long d[4];
+        _mm256_storeu_si256((__m256i *)d, t);
+        int k;
+        for(k = 0; k < 4; ++k){
+            if(d[k] < bdist){
+                bdist = d[k];
+                bind = i + k;
+            }
+        }
+    }
+#endif
+    for(; i < b.n; ++i){
+        int d = hamming(q, b.bits + (size_t)i*BINARY_WORDS);
+        if(d < bdist){
+            bdist = d;
+            bind = i;
+        }
+    }
+    *best = bdist;
+    return bind;
+}
+
+// Orders matches by distance, then by index in a.
+static int binary_match_compare(const void *a, const void *b)
+{
+    const match *ra = (const match *)a;
+    const match *rb = (const match *)b;
+    if(ra->distance != rb->distance) return ra->distance < rb->distance ? -1 : 1;
+    return ra->ai - rb->ai;
+}
+
+// Finds best matches between binary descriptors of two images, like
+// match_descriptors: each descriptor in a takes its nearest in b, then
+// from the closest matches up every descriptor in b is used only once.
+// binary_set a, b: descriptors of the two images.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: matches sorted by Hamming distance.
+match *match_binary(binary_set a, binary_set b, int *mn)
+{
+    match *m = calloc(MAX(a.n, 1), sizeof(match));
+    *mn = 0;
+    if(b.n == 0) return m;
+    int j;
+    #pragma omp parallel for schedule(static)
+    for(j = 0; j < a.n; ++j){
+        int best = 0;
+        int bind = nearest_binary(a.bits + (size_t)j*BINARY_WORDS, b, &best);
+        m[j].ai = j;
+        m[j].bi = bind;
+        m[j].p = a.p[j];
+        m[j].q = b.p[bind];
+        m[j].distance = best;
+    }
+    qsort(m, a.n, sizeof(match), binary_match_compare);
+    char *seen = calloc(b.n, 1);
+    int count = 0;
+    for(j = 0; j < a.n; ++j){
+        if(seen[m[j].bi]) continue;
+        seen[m[j].bi] = 1;
+        m[count++] = m[j];
+    }
+    free(seen);
+    *mn = count;
+    return m;
+}
@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/***************************** Descriptor sets **************************
+  A descriptor_set keeps every descriptor of an image in one block: row i
+  starts at data + i*stride and holds size floats followed by zeros up to
+  the stride. The stride is a multiple of DESCRIPTOR_ALIGN floats and the
+  block is aligned to match, so every row starts on a vector boundary and
+  kernels can run over whole strides without tail handling. Keypoints are
+  kept in their own array next to it.
+
+  describe_corners fills a set for a whole list of corners at once. Patch
+  rows are loaded whole with no per-tap clamping and written straight
+  into the set. Corners near the border first copy their patch into a
+  small buffer padded with clamped values, so they take the same path.
+************************************************************************/
+
+#define DESCRIPTOR_ALIGN 8
+#define DESCRIPTOR_MAGIC 0x44455343
+#define DESCRIBE_W 5
+#define DESCRIBE_R (DESCRIBE_W/2)
+
+// Makes a zeroed set.
+// int n: number of descriptors.
+// int size: floats per descriptor.
+// returns: the set.
+descriptor_set make_descriptor_set(int n, int size)
+{
+    descriptor_set s;
+    s.n = n;
+    s.size = size;
+    s.stride = (size + DESCRIPTOR_ALIGN - 1)/DESCRIPTOR_ALIGN*DESCRIPTOR_ALIGN;
+    if(s.stride == 0) s.stride = DESCRIPTOR_ALIGN;
+    size_t bytes = (size_t)MAX(n, 1)*s.stride*sizeof(float);
+    s.data = aligned_alloc(DESCRIPTOR_ALIGN*sizeof(float), bytes);
+    memset(s.data, 0, bytes);
+    s.p = calloc(MAX(n, 1), sizeof(point));
+    return s;
+}
+
+void free_descriptor_set(descriptor_set s)
+{
+    free(s.data);
+    free(s.p);
+}
+
+// Copies an array of descriptors into a set.
+// descriptor *d: descriptors, all of the same length.
+// int n: number of descriptors.
+// returns: the set.
+descriptor_set descriptors_to_set(descriptor *d, int n)
+{
+    descriptor_set s = make_descriptor_set(n, n ? d[0].n : 0);
+    int i;
+    for(i = 0; i < n; ++i){
+        assert(d[i].n == s.size);
+        s.p[i] = d[i].p;
+        memcpy(s.data + (size_t)i*s.stride, d[i].data, s.size*sizeof(float));
+    }
+    return s;
+}
+
+// Makes descriptors that point into a set without copying.
+// descriptor_set s: set to view, must outlive the view.
+// returns: s.n descriptors, release with free(), not free_descriptors.
+descriptor *descriptor_set_view(descriptor_set s)
+{
+    descriptor *d = calloc(MAX(s.n, 1), sizeof(descriptor));
+    int i;
+    for(i = 0; i < s.n; ++i){
+        d[i].p = s.p[i];
+        d[i].n = s.size;
+        d[i].data = s.data + (size_t)i*s.stride;
+    }
+    return d;
+}
+
+// Copies a set out into separately allocated descriptors.
+// descriptor_set s: set to copy.
+// returns: s.n descriptors, release with free_descriptors.
+descriptor *set_to_descriptors(descriptor_set s)
+{
+    descriptor *d = calloc(MAX(s.n, 1), sizeof(descriptor));
+    int i;
+    for(i = 0; i < s.n; ++i){
+        d[i].p = s.p[i];
+        d[i].n = s.size;
+        d[i].data = calloc(s.size, sizeof(float));
+        memcpy(d[i].data, s.data + (size_t)i*s.stride, s.size*sizeof(float));
+    }
+    return d;
+}
+
+// Writes a set to a binary file: a header, the keypoints, then the rows
+// without their padding.
+void save_descriptor_set(descriptor_set s, const char *fname)
+{
+    FILE *fp = fopen(fname, "wb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return;
+    }
+    int magic = DESCRIPTOR_MAGIC;
+    fwrite(&magic, sizeof(int), 1, fp);
+    fwrite(&s.n, sizeof(int), 1, fp);
+    fwrite(&s.size, sizeof(int), 1, fp);
+    fwrite(s.p, sizeof(point), s.n, fp);
+    int i;
+    for(i = 0; i < s.n; ++i){
+        fwrite(s.data + (size_t)i*s.stride, sizeof(float), s.size, fp);
+    }
+    fclose(fp);
+}
+
+// Reads a set written by save_descriptor_set.
+// returns: the set, empty if the file can't be read.
+descriptor_set load_descriptor_set(const char *fname)
+{
+    int magic = 0, n = 0, size = 0;
+    FILE *fp = fopen(fname, "rb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return make_descriptor_set(0, 0);
+    }
+    if(fread(&magic, sizeof(int), 1, fp) != 1 || magic != DESCRIPTOR_MAGIC ||
+            fread(&n, sizeof(int), 1, fp) != 1 || fread(&size, sizeof(int), 1, fp) != 1 ||
+            n < 0 || size < 0){
+        fprintf(stderr, "Bad descriptor file %s\n", fname);
+        fclose(fp);
+        return make_descriptor_set(0, 0);
+    }
+    descriptor_set s = make_descriptor_set(n, size);
+    int ok = fread(s.p, sizeof(point), n, fp) == (size_t)n;
+    int i;
+    for(i = 0; ok && i < n; ++i){
+        ok = fread(s.data + (size_t)i*s.stride, sizeof(float), size, fp) == (size_t)size;
+    }
+    fclose(fp);
+    if(!ok){
+        fprintf(stderr, "Truncated descriptor file %s\n", fname);
+        free_descriptor_set(s);
+        return make_descriptor_set(0, 0);
+    }
+    return s;
+}
+
+// Copies the clamped patch around (x, y) of one channel into buf, rows of
+// 8 floats. Only used near borders, elsewhere patches are read in place.
+static void padded_patch(image im, int c, int x, int y, float *buf)
+{
+    int dx, dy;
+    for(dy = 0; dy < DESCRIBE_W; ++dy){
+        int sy = MIN(MAX(y + dy - DESCRIBE_R, 0), im.h - 1);
+        const float *src = im.data + ((size_t)c*im.h + sy)*im.w;
+        for(dx = 0; dx < DESCRIBE_W; ++dx){
+            buf[dy*8 + dx] = src[MIN(MAX(x + dx - DESCRIBE_R, 0), im.w - 1)];
+        }
+    }
+}
+
+// Describes a list of corners at once, same values as describe_index.
+// image im: source image.
+// int *idx: pixel index of each corner.
+// int n: number of corners.
+// int normalize: if set, scale each descriptor to unit length.
+// returns: set of n descriptors of 5x5xC values.
+descriptor_set describe_corners(image im, int *idx, int n, int normalize)
+{
+    int r = DESCRIBE_R;
+    descriptor_set s = make_descriptor_set(n, DESCRIBE_W*DESCRIBE_W*im.c);
+    int i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < n; ++i){
+        int x = idx[i]%im.w, y = idx[i]/im.w;
+        float *row = s.data + (size_t)i*s.stride;
+        s.p[i].x = x;
+        s.p[i].y = y;
+        int inside = x >= r && y >= r && x < im.w - r && y < im.h - r;
+        int c, dx, dy;
+        for(c = 0; c < im.c; ++c){
+            float cval = im.data[(size_t)c*im.w*im.h + idx[i]];
+            float buf[DESCRIBE_W*8];
+            const float *patch = im.data + ((size_t)c*im.h + y - r)*im.w + x - r;
+            int pitch = im.w;
+            if(!inside){
+                padded_patch(im, c, x, y, buf);
+                patch = buf;
+                pitch = 8;
+            }
+            float *out = row + c*DESCRIBE_W*DESCRIBE_W;
+            // Differences for one patch row at a time, stored transposed
+            // since describe_index walks the patch column by column.
+            float diff[8];
+            for(dy = 0; dy < DESCRIBE_W; ++dy){
+                const float *src = patch + (size_t)dy*pitch;
+                dx = 0;
+#ifdef __SSE2__
+                _mm_storeu_ps(diff, _mm_sub_ps(_mm_set1_ps(cval), _mm_loadu_ps(src)));
+                dx = 4;
+#endif
+                for(; dx < DESCRIBE_W; ++dx) diff[dx] = cval - src[dx];
+                for(dx = 0; dx < DESCRIBE_W; ++dx) out[dx*DESCRIBE_W + dy] = diff[dx];
+            }
+        }
+        if(normalize){
+            float sum = 0;
+            int j;
+            for(j = 0; j < s.stride; ++j) sum += row[j]*row[j];
+            if(sum > 0){
+                float inv = 1/sqrtf(sum);
+                for(j = 0; j < s.stride; ++j) row[j] *= inv;
+            }
+        }
+    }
+    return s;
+}
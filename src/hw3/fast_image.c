@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/***************************** FAST corners *****************************
+  FAST (Rosten and Drummond) looks at the 16 pixels on a circle of radius
+  3 around each pixel. The pixel is a corner if arc of them in a row are
+  all brighter than the centre plus thresh, or all darker than it minus
+  thresh. Any such arc covers at least arc/4 of the four compass pixels,
+  so those are tested first and most pixels stop there.
+
+  The test runs on 8 pixels at once with AVX (4 with SSE). The 16 circle
+  compares are walked twice round while keeping run lengths of brighter
+  and darker pixels in every lane, so a lane is a corner once a run
+  reaches arc. The score of a corner is the largest thresh at which it
+  would still pass, which NMS then uses to pick one pixel per corner.
+************************************************************************/
+
+static const int fast_dx[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+static const int fast_dy[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+
+// Checks a 16 bit ring for a run of at least arc ones, wrapping around.
+static inline int has_arc(unsigned m, int arc)
+{
+    m |= m << 16;
+    unsigned r = m;
+    int i;
+    for(i = 1; i < arc; ++i) r &= m >> i;
+    return (r & 0xFFFF) != 0;
+}
+
+// Largest thresh at which a pixel still passes the segment test. Window
+// minima and maxima over arc consecutive circle pixels are built up by
+// doubling, so each step is one pass of 16 vector friendly min/max ops.
+// const float *p: the pixel.
+// const int *off: offsets of the circle pixels from p.
+static float fast_pixel_score(const float *p, const int *off, int arc)
+{
+    // Differences, repeated so windows can run past the end of the circle.
+    float d[48], lo[48], hi[48], wlo[48], whi[48];
+    int k;
+    for(k = 0; k < 16; ++k){
+        d[k] = d[k + 16] = d[k + 32] = p[off[k]] - p[0];
+    }
+    // lo, hi hold windows of size w, wlo, whi of the arc so far.
+    int w = 1, have = 0;
+    for(k = 0; k < 48; ++k) lo[k] = hi[k] = d[k];
+    int rest = arc;
+    while(rest){
+        if(rest & 1){
+            if(!have){
+                for(k = 0; k < 32; ++k){ wlo[k] = lo[k]; whi[k] = hi[k]; }
+            } else {
+                for(k = 0; k < 32; ++k){
+                    wlo[k] = MIN(wlo[k], lo[k + have]);
+                    whi[k] = MAX(whi[k], hi[k + have]);
+                }
+            }
+            have += w;
+        }
+        rest >>= 1;
+        if(rest){
+            for(k = 0; k + w < 48; ++k){
+                lo[k] = MIN(lo[k], lo[k + w]);
+                hi[k] = MAX(hi[k], hi[k + w]);
+            }
+            w *= 2;
+        }
+    }
+    float bright = wlo[0], dark = -whi[0];
+    for(k = 1; k < 16; ++k){
+        bright = MAX(bright, wlo[k]);
+        dark = MAX(dark, -whi[k]);
+    }
+    return MAX(bright, dark);
+}
+
+// Full segment test on one pixel.
+static inline int fast_pixel_test(const float *p, const int *off, float thresh, int arc)
+{
+    float hi = p[0] + thresh, lo = p[0] - thresh;
+    unsigned b = 0, d = 0;
+    int k;
+    for(k = 0; k < 16; ++k){
+        float v = p[off[k]];
+        b |= (unsigned)(v > hi) << k;
+        d |= (unsigned)(v < lo) << k;
+    }
+    return has_arc(b, arc) || has_arc(d, arc);
+}
+
+// Scores one row, leaving non-corners at 0.
+static void fast_row(image g, int y, const int *off, float thresh, int arc, float *out)
+{
+    const float *row = g.data + y*g.w;
+    int need = arc/4;
+    int x = 3;
+#ifdef __AVX__
+    __m256 t = _mm256_set1_ps(thresh);
+    __m256 one = _mm256_set1_ps(1);
+    __m256 vneed = _mm256_set1_ps(need);
+    __m256 varc = _mm256_set1_ps(arc);
+    for(; x + 8 <= g.w - 3; x += 8){
+        const float *p = row + x;
+        __m256 c = _mm256_loadu_ps(p);
+        __m256 hi = _mm256_add_ps(c, t);
+        __m256 lo = _mm256_sub_ps(c, t);
+        __m256 nb = _mm256_setzero_ps(), nd = _mm256_setzero_ps();
+        int k;
+        for(k = 0; k < 16; k += 4){
+            __m256 v = _mm256_loadu_ps(p + off[k]);
+            nb = _mm256_add_ps(nb, _mm256_and_ps(_mm256_cmp_ps(v, hi, _CMP_GT_OQ), one));
+            nd = _mm256_add_ps(nd, _mm256_and_ps(_mm256_cmp_ps(v, lo, _CMP_LT_OQ), one));
+        }
+        __m256 maybe = _mm256_or_ps(_mm256_cmp_ps(nb, vneed, _CMP_GE_OQ), _mm256_cmp_ps(nd, vneed, _CMP_GE_OQ));
+        if(!_mm256_movemask_ps(maybe)) continue;
+        // Run lengths of brighter and darker pixels, twice round the circle.
+        __m256 bm[16], dm[16];
+        for(k = 0; k < 16; ++k){
+            __m256 v = _mm256_loadu_ps(p + off[k]);
+            bm[k] = _mm256_cmp_ps(v, hi, _CMP_GT_OQ);
+            dm[k] = _mm256_cmp_ps(v, lo, _CMP_LT_OQ);
+        }
+        __m256 rb = _mm256_setzero_ps(), rd = _mm256_setzero_ps();
+        __m256 mb = rb, md = rd;
+        for(k = 0; k < 16 + arc - 1; ++k){
+            rb = _mm256_and_ps(_mm256_add_ps(rb, one), bm[k & 15]);
+            rd = _mm256_and_ps(_mm256_add_ps(rd, one), dm[k & 15]);
+            mb = _mm256_max_ps(mb, rb);
+            md = _mm256_max_ps(md, rd);
+        }
+        int lanes = _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(mb, varc, _CMP_GE_OQ),
+                    _mm256_cmp_ps(md, varc, _CMP_GE_OQ)));
+        while(lanes){
+            int l = __builtin_ctz(lanes);
+            lanes &= lanes - 1;
+            out[x + l] = fast_pixel_score(p + l, off, arc);
+        }
+    }
+#elif defined(__SSE2__)
+    __m128 t = _mm_set1_ps(thresh);
+    __m128 one = _mm_set1_ps(1);
+    __m128 vneed = _mm_set1_ps(need);
+    __m128 varc = _mm_set1_ps(arc);
+    for(; x + 4 <= g.w - 3; x += 4){
+        const float *p = row + x;
+        __m128 c = _mm_loadu_ps(p);
+        __m128 hi = _mm_add_ps(c, t);
+        __m128 lo = _mm_sub_ps(c, t);
+        __m128 nb = _mm_setzero_ps(), nd = _mm_setzero_ps();
+        int k;
+        for(k = 0; k < 16; k += 4){
+            __m128 v = _mm_loadu_ps(p + off[k]);
+            nb = _mm_add_ps(nb, _mm_and_ps(_mm_cmpgt_ps(v, hi), one));
+            nd = _mm_add_ps(nd, _mm_and_ps(_mm_cmplt_ps(v, lo), one));
+        }
+        if(!_mm_movemask_ps(_mm_or_ps(_mm_cmpge_ps(nb, vneed), _mm_cmpge_ps(nd, vneed)))) continue;
+        __m128 bm[16], dm[16];
+        for(k = 0; k < 16; ++k){
+            __m128 v = _mm_loadu_ps(p + off[k]);
+            bm[k] = _mm_cmpgt_ps(v, hi);
+            dm[k] = _mm_cmplt_ps(v, lo);
+        }
+        __m128 rb = _mm_setzero_ps(), rd = _mm_setzero_ps();
+        __m128 mb = rb, md = rd;
+        for(k = 0; k < 16 + arc - 1; ++k){
+            rb = _mm_and_ps(_mm_add_ps(rb, one), bm[k & 15]);
+            rd = _mm_and_ps(_mm_add_ps(rd, one), dm[k & 15]);
+            mb = _mm_max_ps(mb, rb);
+            md = _mm_max_ps(md, rd);
+        }
+        int lanes = _mm_movemask_ps(_mm_or_ps(_mm_cmpge_ps(mb, varc), _mm_cmpge_ps(md, varc)));
+        while(lanes){
+            int l = __builtin_ctz(lanes);
+            lanes &= lanes - 1;
+            out[x + l] = fast_pixel_score(p + l, off, arc);
+        }
+    }
+#endif
+    for(; x < g.w - 3; ++x){
+        if(fast_pixel_test(row + x, off, thresh, arc)){
+            out[x] = fast_pixel_score(row + x, off, arc);
+        }
+    }
+}
+
+// Runs the FAST segment test on every pixel.
+// image im: input image, converted to grayscale if it has 3 channels,
+//           otherwise the first channel is used.
+// float thresh: how much brighter or darker the arc must be, in [0, 1].
+// int arc: contiguous circle pixels needed, 9 to 16.
+// returns: 1-channel map of corner scores, 0 where there is no corner.
+image fast_score(image im, float thresh, int arc)
+{
+    assert(arc >= 9 && arc <= 16);
+    image g;
+    if(im.c == 3){
+        g = rgb_to_grayscale(im);
+    } else {
+        g = make_image(im.w, im.h, 1);
+        memcpy(g.data, im.data, im.w*im.h*sizeof(float));
+    }
+    image S = make_image(im.w, im.h, 1);
+    int off[16];
+    int k, y;
+    for(k = 0; k < 16; ++k) off[k] = fast_dy[k]*g.w + fast_dx[k];
+    #pragma omp parallel for schedule(static)
+    for(y = 3; y < g.h - 3; ++y){
+        fast_row(g, y, off, thresh, arc, S.data + y*S.w);
+    }
+    free_image(g);
+    return S;
+}
+
+// Finds FAST corners without describing them.
+// image im: input image.
+// float thresh: segment test threshold in [0, 1].
+// int arc: contiguous circle pixels needed, 9 or 12.
+// int nms: distance to look for local-maxes in the score map.
+// int max_corners: most corners to return, picked by adaptive NMS, 0 for no limit.
+// int *n: filled in with the number of corners.
+// returns: pixel indexes of the corners in row-major order.
+int *fast_corner_indexes(image im, float thresh, int arc, int nms, int max_corners, int *n)
+{
+    image S = fast_score(im, thresh, arc);
+    int count = 0;
+    int *idx = nms_candidates(S, nms, 0, &count);
+    if(max_corners > 0 && count > max_corners){
+        int *kept = anms_select(S, idx, count, max_corners, &count);
+        free(idx);
+        idx = kept;
+    }
+    free_image(S);
+    *n = count;
+    return idx;
+}
+
+// Perform FAST corner detection and describe the corners into one block.
+// image im: input image.
+// float thresh: segment test threshold in [0, 1].
+// int arc: contiguous circle pixels needed, 9 or 12.
+// int nms: distance to look for local-maxes in the score map.
+// int max_corners: most corners to return, picked by adaptive NMS, 0 for no limit.
+// int normalize: scale descriptors to unit length.
+// returns: set of descriptors of the corners in the image.
+descriptor_set fast_corner_set(image im, float thresh, int arc, int nms, int max_corners, int normalize)
+{
+    int count = 0;
+    int *idx = fast_corner_indexes(im, thresh, arc, nms, max_corners, &count);
+    descriptor_set s = describe_corners(im, idx, count, normalize);
+    free(idx);
+    return s;
+}
+
+// Perform FAST corner detection and extract features from the corners.
+// image im: input image.
+// float thresh: segment test threshold in [0, 1].
+// int arc: contiguous circle pixels needed, 9 or 12.
+// int nms: distance to look for local-maxes in the score map.
+// int *n: pointer to number of corners detected, should fill in.
+// returns: array of descriptors of the corners in the image.
+descriptor *fast_corner_detector(image im, float thresh, int arc, int nms, int *n)
+{
+    descriptor_set s = fast_corner_set(im, thresh, arc, nms, 0, 0);
+    descriptor *d = set_to_descriptors(s);
+    *n = s.n;
+    free_descriptor_set(s);
+    return d;
+}
+
+// Runs the chosen detector. Harris uses sigma and thresh as usual; FAST
+// ignores sigma and reads thresh in grey levels out of 255, so the usual
+// Harris values of 1-50 are also sensible FAST thresholds.
+// image im: input image.
+// DETECTOR det: HARRIS, FAST9 or FAST12.
+// float sigma: std. dev for harris.
+// float thresh: threshold for corner/no corner.
+// int nms: distance to look for local-maxes.
+// int max_corners: most corners to return, 0 for no limit.
+// int *n: filled in with the number of corners.
+// returns: pixel indexes of the corners in row-major order.
+int *detect_corner_indexes(image im, DETECTOR det, float sigma, float thresh, int nms, int max_corners, int *n)
+{
+    if(det == FAST9) return fast_corner_indexes(im, thresh/255, 9, nms, max_corners, n);
+    if(det == FAST12) return fast_corner_indexes(im, thresh/255, 12, nms, max_corners, n);
+    return harris_corner_indexes(im, sigma, thresh, nms, max_corners, n);
+}
+
+// Runs the chosen detector and describes the corners, see detect_corner_indexes.
+// returns: set of descriptors of the corners in the image.
+descriptor_set detect_corner_set(image im, DETECTOR det, float sigma, float thresh, int nms, int max_corners)
+{
+    int count = 0;
+    int *idx = detect_corner_indexes(im, det, sigma, thresh, nms, max_corners, &count);
+    descriptor_set s = describe_corners(im, idx, count, 0);
+    free(idx);
+    return s;
+}
+
+// Same as detect_corner_set, returning separate descriptors.
+// int *n: pointer to number of corners detected, should fill in.
+descriptor *detect_corners(image im, DETECTOR det, float sigma, float thresh, int nms, int max_corners, int *n)
+{
+    descriptor_set s = detect_corner_set(im, det, sigma, thresh, nms, max_corners);
+    descriptor *d = set_to_descriptors(s);
+    *n = s.n;
+    free_descriptor_set(s);
+    return d;
+}
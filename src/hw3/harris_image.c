@@ -6,6 +6,12 @@
 #include "image.h"
 #include "matrix.h"
 #include <time.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // Frees an array of descriptors.
 // descriptor *d: the array.
@@ -109,11 +115,153 @@ image smooth_image(image im, float sigma)
     image gaus2 = make_image(1,gaus.w,1);
     memcpy(gaus2.data, gaus.data, gaus.w*sizeof(float));
 
-    image copy = convolve_image(im, gaus, 1);
-    copy = convolve_image(copy, gaus2, 1);
+    image rows = convolve_image(im, gaus, 1);
+    image copy = convolve_image(rows, gaus2, 1);
+    free_image(rows);
+    free_image(gaus);
+    free_image(gaus2);
     return copy;
 }
 
+/***************************** Structure matrix *************************
+  The structure matrix is computed in one sweep down the image. For each
+  row the channels are summed, the Sobel gradients are taken from the
+  three neighbouring summed rows, and the products Ix^2, Iy^2 and IxIy
+  are smoothed horizontally straight into a ring of 2r+1 rows. Once the
+  ring covers an output row it is smoothed vertically and written out,
+  either as the three structure planes or directly as the cornerness.
+  Borders are clamped, matching convolve_image. The image is cut into
+  strips that each keep their own ring, so strips run in parallel.
+************************************************************************/
+
+#define STRUCTURE_STRIP 32
+
+// Sums the channels of row y, clamped, into out[1..w] with one clamped
+// pixel of padding on each side.
+static void channel_sum_row(image im, int y, float *out)
+{
+    y = MIN(MAX(y, 0), im.h - 1);
+    int i, c;
+    memcpy(out + 1, im.data + y*im.w, im.w*sizeof(float));
+    for(c = 1; c < im.c; ++c){
+        const float *x = im.data + c*im.w*im.h + y*im.w;
+        for(i = 0; i < im.w; ++i) out[i + 1] += x[i];
+    }
+    out[0] = out[1];
+    out[im.w + 1] = out[im.w];
+}
+
+// Computes the horizontally smoothed gradient products of one row.
+// float *up, *mid, *down: padded channel sums of rows y-1, y, y+1.
+// float *out: 3 rows of w floats, Ix^2, Iy^2 and IxIy.
+// float *k: 1d Gaussian of 2r+1 taps.
+// float *a, *b, *prod: scratch, prod holds 3 rows of w + 2r.
+static void structure_row(int w, const float *up, const float *mid, const float *down,
+        float *out, const float *k, int r, float *a, float *b, float *prod)
+{
+    int i, t, p;
+    for(i = 0; i < w + 2; ++i){
+        a[i] = up[i] + 2*mid[i] + down[i];
+        b[i] = down[i] - up[i];
+    }
+    int pw = w + 2*r;
+    float *pxx = prod, *pyy = prod + pw, *pxy = prod + 2*pw;
+    for(i = 0; i < w; ++i){
+        float gx = a[i + 2] - a[i];
+        float gy = b[i] + 2*b[i + 1] + b[i + 2];
+        pxx[i + r] = gx*gx;
+        pyy[i + r] = gy*gy;
+        pxy[i + r] = gx*gy;
+    }
+    for(p = 0; p < 3; ++p){
+        float *q = prod + p*pw;
+        for(i = 0; i < r; ++i){
+            q[i] = q[r];
+            q[w + r + i] = q[w + r - 1];
+        }
+        float *o = out + p*w;
+        for(i = 0; i < w; ++i) o[i] = k[0]*q[i];
+        for(t = 1; t < 2*r + 1; ++t){
+            const float *qt = q + t;
+            float kt = k[t];
+            for(i = 0; i < w; ++i) o[i] += kt*qt[i];
+        }
+    }
+}
+
+// Runs the fused structure matrix over rows [y0, y1).
+// image out: 3 channel structure matrix, or 1 channel cornerness if response.
+// int oy: image row that lands in row 0 of out.
+static void structure_strip(image im, const float *k, int r, int y0, int y1, image out, int oy, int response)
+{
+    int w = im.w, h = im.h;
+    int ring = 2*r + 1;
+    float *rows = calloc((size_t)ring*3*w, sizeof(float));
+    float *sums = calloc(3*(w + 2), sizeof(float));
+    float *a = calloc(w + 2, sizeof(float));
+    float *b = calloc(w + 2, sizeof(float));
+    float *prod = calloc(3*(w + 2*r), sizeof(float));
+    float *acc = calloc(3*w, sizeof(float));
+    float *up = sums, *mid = sums + w + 2, *down = sums + 2*(w + 2);
+
+    int next = MAX(0, y0 - r);
+    channel_sum_row(im, next - 1, up);
+    channel_sum_row(im, next, mid);
+    int y, i, t;
+    for(y = y0; y < y1; ++y){
+        int last = MIN(h - 1, y + r);
+        for(; next <= last; ++next){
+            channel_sum_row(im, next + 1, down);
+            structure_row(w, up, mid, down, rows + (size_t)(next % ring)*3*w, k, r, a, b, prod);
+            float *tmp = up; up = mid; mid = down; down = tmp;
+        }
+        for(i = 0; i < 3*w; ++i) acc[i] = 0;
+        for(t = -r; t <= r; ++t){
+            int j = MIN(MAX(y + t, 0), h - 1);
+            const float *src = rows + (size_t)(j % ring)*3*w;
+            float kt = k[t + r];
+            for(i = 0; i < 3*w; ++i) acc[i] += kt*src[i];
+        }
+        const float *sxx = acc, *syy = acc + w, *sxy = acc + 2*w;
+        size_t plane = (size_t)out.w*out.h;
+        size_t o0 = (size_t)(y - oy)*w;
+        if(response){
+            float *o = out.data + o0;
+            for(i = 0; i < w; ++i){
+                float d = sxx[i]*syy[i] - sxy[i]*sxy[i];
+                float tr = sxx[i] + syy[i];
+                o[i] = d - .06f*tr*tr;
+            }
+        } else {
+            memcpy(out.data + o0, sxx, w*sizeof(float));
+            memcpy(out.data + plane + o0, syy, w*sizeof(float));
+            memcpy(out.data + 2*plane + o0, sxy, w*sizeof(float));
+        }
+    }
+    free(rows);
+    free(sums);
+    free(a);
+    free(b);
+    free(prod);
+    free(acc);
+}
+
+// Runs the fused structure matrix over the whole image, strips in parallel.
+static void structure_sweep(image im, float sigma, image out, int response)
+{
+    image g = make_1d_gaussian(sigma);
+    int r = g.w/2;
+    int nstrips = (im.h + STRUCTURE_STRIP - 1)/STRUCTURE_STRIP;
+    int s;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(s = 0; s < nstrips; ++s){
+        int y0 = s*STRUCTURE_STRIP;
+        int y1 = MIN(im.h, y0 + STRUCTURE_STRIP);
+        structure_strip(im, g.data, r, y0, y1, out, 0, response);
+    }
+    free_image(g);
+}
+
 // Calculate the structure matrix of an image.
 // image im: the input image.
 // float sigma: std dev. to use for weighted sum.
@@ -121,22 +269,21 @@ image smooth_image(image im, float sigma)
 //          third channel is IxIy.
 image structure_matrix(image im, float sigma)
 {
-    image s = make_image(im.w, im.h, 3);
-
-    // derivatives
-    float* gx = convolve_image(im, make_gx_filter(), 0).data;
-    float* gy = convolve_image(im, make_gy_filter(), 0).data;
-
-    // measures
-    for (int i = 0; i < im.h*im.w; i++) {
-        s.data[i] = (gx[i]*gx[i]);
-        s.data[i+im.h*im.w] = (gy[i]*gy[i]);
-        s.data[i+2*im.h*im.w] = (gx[i]*gy[i]);
-	}
+    image S = make_image(im.w, im.h, 3);
+    structure_sweep(im, sigma, S, 0);
+    return S;
+}
 
-    // weight
-    image fin = smooth_image(s, sigma);
-    return fin;
+// Cornerness of every pixel, same as cornerness_response(structure_matrix(im, sigma))
+// but without storing the structure matrix.
+// image im: the input image.
+// float sigma: std dev. to use for weighted sum.
+// returns: a response map of cornerness calculations.
+image harris_response(image im, float sigma)
+{
+    image R = make_image(im.w, im.h, 1);
+    structure_sweep(im, sigma, R, 1);
+    return R;
 }
 
 // Estimate the cornerness of each pixel given a structure matrix S.
@@ -153,85 +300,321 @@ image cornerness_response(image S)
     return R;
 }
 
+// Running max over a window of 2w+1 along a row, van Herk/Gil-Werman style.
+// Splits the row into blocks of 2w+1 and keeps a prefix max g and suffix
+// max h inside each block, so every window max is max(h[start], g[end])
+// no matter how wide the window is. Values past either end count as -inf.
+// float *x: input row.
+// float *out: output row.
+// int n: row length.
+// int w: window radius.
+// float *g, *h: scratch of at least n + 2w + 1 floats each.
+static void max_filter_row(const float *x, float *out, int n, int w, float *g, float *h)
+{
+    int k = 2*w + 1;
+    int len = n + 2*w;
+    int p;
+    for(p = 0; p < len; ++p){
+        float v = (p < w || p >= n + w) ? -INFINITY : x[p - w];
+        g[p] = (p % k == 0) ? v : MAX(g[p-1], v);
+    }
+    for(p = len - 1; p >= 0; --p){
+        float v = (p < w || p >= n + w) ? -INFINITY : x[p - w];
+        h[p] = (p % k == k - 1 || p == len - 1) ? v : MAX(h[p+1], v);
+    }
+    for(p = 0; p < n; ++p){
+        out[p] = MAX(h[p], g[p + 2*w]);
+    }
+}
+
+// Same running max as max_filter_row, but down the columns of an image.
+// Works on whole rows at a time so the inner loops are plain vector maxes.
+// float *x: input, h rows of w floats.
+// float *out: output, same size.
+// int width, height: image size.
+// int w: window radius.
+static void max_filter_cols(const float *x, float *out, int width, int height, int w)
+{
+    int k = 2*w + 1;
+    int len = height + 2*w;
+    float *g = calloc((size_t)len*width, sizeof(float));
+    float *h = calloc((size_t)len*width, sizeof(float));
+    float *ninf = calloc(width, sizeof(float));
+    int p, i;
+    for(i = 0; i < width; ++i) ninf[i] = -INFINITY;
+    for(p = 0; p < len; ++p){
+        const float *v = (p < w || p >= height + w) ? ninf : x + (p - w)*width;
+        float *gp = g + (size_t)p*width;
+        if(p % k == 0){
+            memcpy(gp, v, width*sizeof(float));
+        } else {
+            const float *prev = gp - width;
+            for(i = 0; i < width; ++i) gp[i] = MAX(prev[i], v[i]);
+        }
+    }
+    for(p = len - 1; p >= 0; --p){
+        const float *v = (p < w || p >= height + w) ? ninf : x + (p - w)*width;
+        float *hp = h + (size_t)p*width;
+        if(p % k == k - 1 || p == len - 1){
+            memcpy(hp, v, width*sizeof(float));
+        } else {
+            const float *next = hp + width;
+            for(i = 0; i < width; ++i) hp[i] = MAX(next[i], v[i]);
+        }
+    }
+    int y;
+    #pragma omp parallel for schedule(static)
+    for(y = 0; y < height; ++y){
+        const float *hp = h + (size_t)y*width;
+        const float *gp = g + (size_t)(y + 2*w)*width;
+        float *o = out + (size_t)y*width;
+        int j;
+        for(j = 0; j < width; ++j) o[j] = MAX(hp[j], gp[j]);
+    }
+    free(g);
+    free(h);
+    free(ninf);
+}
+
+// Grey-level dilation of a 1-channel image with a (2w+1)^2 square window,
+// clipped at the borders.
+// image im: 1-channel image.
+// int w: window radius.
+// returns: image where each pixel is the max of its window.
+image max_filter_image(image im, int w)
+{
+    image rows = make_image(im.w, im.h, 1);
+    image out = make_image(im.w, im.h, 1);
+    int y;
+    #pragma omp parallel
+    {
+        float *g = calloc(im.w + 2*w + 1, sizeof(float));
+        float *h = calloc(im.w + 2*w + 1, sizeof(float));
+        #pragma omp for schedule(static)
+        for(y = 0; y < im.h; ++y){
+            max_filter_row(im.data + y*im.w, rows.data + y*im.w, im.w, w, g, h);
+        }
+        free(g);
+        free(h);
+    }
+    max_filter_cols(rows.data, out.data, im.w, im.h, w);
+    free_image(rows);
+    return out;
+}
+
 // Perform non-max supression on an image of feature responses.
 // image im: 1-channel image of feature responses.
 // int w: distance to look for larger responses.
 // returns: image with only local-maxima responses within w pixels.
 image nms_image(image im, int w)
 {
-    image r = copy_image(im);
-    for (int h = 0; h < im.h; h++) {
-        for (int i = 0; i < im.w; i++) {
-            float v = get_pixel(im, i, h, 0);
+    image r = max_filter_image(im, w);
+    int i;
+    for(i = 0; i < im.w*im.h; ++i){
+        r.data[i] = im.data[i] >= r.data[i] ? im.data[i] : -99999;
+    }
+    return r;
+}
 
-            // neighbor range
-            for (int j = -w; j < w+1; j++) {
+// Finds the local maxima of a response map that are above a threshold.
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// float thresh: responses must be strictly greater than this.
+// int *n: filled in with the number of candidates.
+// returns: pixel indexes of the candidates, in row-major order.
+int *nms_candidates(image im, int w, float thresh, int *n)
+{
+    image d = max_filter_image(im, w);
+    int *idx = calloc(im.w*im.h + 1, sizeof(int));
+    int *counts = calloc(im.h, sizeof(int));
+    int y;
+    // Each row writes its candidates at the start of its own slot, then
+    // the rows are packed together in order.
+    #pragma omp parallel for schedule(static)
+    for(y = 0; y < im.h; ++y){
+        const float *v = im.data + y*im.w;
+        const float *m = d.data + y*im.w;
+        int *out = idx + y*im.w;
+        int x = 0, c = 0;
+#ifdef __AVX__
+        __m256 t = _mm256_set1_ps(thresh);
+        for(; x + 8 <= im.w; x += 8){
+            __m256 a = _mm256_loadu_ps(v + x);
+            __m256 keep = _mm256_and_ps(_mm256_cmp_ps(a, _mm256_loadu_ps(m + x), _CMP_GE_OQ),
+                    _mm256_cmp_ps(a, t, _CMP_GT_OQ));
+            int bits = _mm256_movemask_ps(keep);
+            while(bits){
+                int b = __builtin_ctz(bits);
+                out[c++] = y*im.w + x + b;
+                bits &= bits - 1;
+            }
+        }
+#elif defined(__SSE2__)
+        __m128 t = _mm_set1_ps(thresh);
+        for(; x + 4 <= im.w; x += 4){
+            __m128 a = _mm_loadu_ps(v + x);
+            __m128 keep = _mm_and_ps(_mm_cmpge_ps(a, _mm_loadu_ps(m + x)), _mm_cmpgt_ps(a, t));
+            int bits = _mm_movemask_ps(keep);
+            while(bits){
+                int b = __builtin_ctz(bits);
+                out[c++] = y*im.w + x + b;
+                bits &= bits - 1;
+            }
+        }
+#endif
+        for(; x < im.w; ++x){
+            if(v[x] >= m[x] && v[x] > thresh) out[c++] = y*im.w + x;
+        }
+        counts[y] = c;
+    }
+    int total = 0;
+    for(y = 0; y < im.h; ++y){
+        memmove(idx + total, idx + y*im.w, counts[y]*sizeof(int));
+        total += counts[y];
+    }
+    free(counts);
+    free_image(d);
+    *n = total;
+    return idx;
+}
 
-                // height
-                int y = fmin(im.h - 1, h+j);
-                y = fmax(0, y);
+/***************************** Strip-parallel Harris *********************
+  The detector splits the image into horizontal strips that each run the
+  cornerness and NMS on their own, computing nms extra rows on each side
+  so their NMS windows are complete. The structure matrix needs no extra
+  halo since structure_strip primes its ring from the rows around it.
+  Corners are kept only in the rows a strip owns and strips are joined
+  in order, so the result is exactly that of a single pass. ANMS needs
+  every corner so it runs on the joined list, then the descriptors are
+  extracted in parallel over corners.
+************************************************************************/
 
-                for (int k = -w; k < w+1; k++) {
+#define HARRIS_STRIP_MIN 32
 
-                    // width
-                    int x = fmin(im.w - 1, i+k);
-                    x = fmax(0, x);
+// Rows of one strip of the Harris detector.
+// int y0, y1: rows the strip owns.
+// int ya, yb: rows it computes, the owned rows plus a halo for NMS.
+// int *idx, n: corners found in the owned rows.
+typedef struct{
+    int y0, y1, ya, yb;
+    int *idx, n;
+} harris_strip;
 
-                    float v2 = get_pixel(im, x, y, 0);
-                    if (v2 > v) {
-                        set_pixel(r, i, h, 0,-99999);
-                    }
-                }
-            }
-        }
-	}
-    return r;
+// Runs cornerness and NMS for one strip. The halo rows of cornerness are
+// computed exactly like the owning strip does, so the NMS windows see the
+// same values they would in a single pass over the whole image.
+// image R: full size response map, owned rows are copied in for ANMS.
+static void run_harris_strip(image im, const float *k, int r, float thresh, int nms, harris_strip *s, image R)
+{
+    image local = make_image(im.w, s->yb - s->ya, 1);
+    structure_strip(im, k, r, s->ya, s->yb, local, s->ya, 1);
+    int count = 0;
+    int *idx = nms_candidates(local, nms, thresh, &count);
+    int lo = (s->y0 - s->ya)*im.w, hi = (s->y1 - s->ya)*im.w;
+    int i;
+    s->n = 0;
+    for(i = 0; i < count; ++i){
+        if(idx[i] >= lo && idx[i] < hi) idx[s->n++] = idx[i] + s->ya*im.w;
+    }
+    s->idx = idx;
+    memcpy(R.data + (size_t)s->y0*im.w, local.data + lo, (size_t)(hi - lo)*sizeof(float));
+    free_image(local);
 }
 
-// Perform harris corner detection and extract features from the corners.
+// Finds Harris corners without describing them.
 // image im: input image.
 // float sigma: std. dev for harris.
 // float thresh: threshold for cornerness.
 // int nms: distance to look for local-maxes in response map.
-// int *n: pointer to number of corners detected, should fill in.
-// returns: array of descriptors of the corners in the image.
-descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
+// int max_corners: most corners to return, picked by adaptive NMS, 0 for no limit.
+// int *n: filled in with the number of corners.
+// returns: pixel indexes of the corners in row-major order.
+int *harris_corner_indexes(image im, float sigma, float thresh, int nms, int max_corners, int *n)
 {
-    // Calculate structure matrix
-    image S = structure_matrix(im, sigma);
-
-    // Estimate cornerness
-    image R = cornerness_response(S);
-
-    // Run NMS on the responses
-    image Rnms = nms_image(R, nms);
-
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    // A few strips per thread keeps threads busy when strips are uneven.
+    int height = MAX(HARRIS_STRIP_MIN, (im.h + 4*threads - 1)/(4*threads));
+    int nstrips = (im.h + height - 1)/height;
+    harris_strip *strips = calloc(nstrips, sizeof(harris_strip));
+    image g = make_1d_gaussian(sigma);
+    image R = make_image(im.w, im.h, 1);
+    int s;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(s = 0; s < nstrips; ++s){
+        harris_strip *st = strips + s;
+        st->y0 = s*height;
+        st->y1 = MIN(im.h, st->y0 + height);
+        st->ya = MAX(0, st->y0 - nms);
+        st->yb = MIN(im.h, st->y1 + nms);
+        run_harris_strip(im, g.data, g.w/2, thresh, nms, st, R);
+    }
 
-    //TODO: count number of responses over threshold
     int count = 0;
-    for (int i = 0; i < Rnms.w*Rnms.h*Rnms.c; i++) {
-        if (thresh < Rnms.data[i]) {
-            count++;
-        }
+    for(s = 0; s < nstrips; ++s) count += strips[s].n;
+    int *idx = calloc(count + 1, sizeof(int));
+    count = 0;
+    for(s = 0; s < nstrips; ++s){
+        memcpy(idx + count, strips[s].idx, strips[s].n*sizeof(int));
+        count += strips[s].n;
+        free(strips[s].idx);
     }
+    free(strips);
+    free_image(g);
 
-
-    *n = count; // <- set *n equal to number of corners in image.
-    descriptor *d = calloc(count, sizeof(descriptor));
-    int x = 0;
-
-    for (int i = 0; i < im.w*im.h; i++) {
-        if (thresh < Rnms.data[i]) {
-            d[x++] = describe_index(im, i);
-        }
+    // Keep a well spread subset if there are too many
+    if(max_corners > 0 && count > max_corners){
+        int *kept = anms_select(R, idx, count, max_corners, &count);
+        free(idx);
+        idx = kept;
     }
-
-    free_image(S);
     free_image(R);
-    free_image(Rnms);
+    *n = count;
+    return idx;
+}
+
+// Perform harris corner detection and describe the corners into one block.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int max_corners: most corners to return, picked by adaptive NMS, 0 for no limit.
+// int normalize: scale descriptors to unit length.
+// returns: set of descriptors of the corners in the image.
+descriptor_set harris_corner_set(image im, float sigma, float thresh, int nms, int max_corners, int normalize)
+{
+    int count = 0;
+    int *idx = harris_corner_indexes(im, sigma, thresh, nms, max_corners, &count);
+    descriptor_set s = describe_corners(im, idx, count, normalize);
+    free(idx);
+    return s;
+}
+
+// Perform harris corner detection and extract features from the corners.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int max_corners: most corners to return, picked by adaptive NMS, 0 for no limit.
+// int *n: pointer to number of corners detected, should fill in.
+// returns: array of descriptors of the corners in the image.
+descriptor *harris_corner_detector_budget(image im, float sigma, float thresh, int nms, int max_corners, int *n)
+{
+    descriptor_set s = harris_corner_set(im, sigma, thresh, nms, max_corners, 0);
+    descriptor *d = set_to_descriptors(s);
+    *n = s.n;
+    free_descriptor_set(s);
     return d;
 }
 
+// Perform harris corner detection with no limit on the number of corners.
+descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
+{
+    return harris_corner_detector_budget(im, sigma, thresh, nms, 0, n);
+}
+
 // Find and draw corners on an image.
 // image im: input image.
 // float sigma: std. dev for harris.
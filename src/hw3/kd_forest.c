@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+/***************************** k-d forest *******************************
+  Approximate nearest neighbours for descriptor matching, after the
+  randomized k-d trees of Silpa-Anan and Hartley as used in FLANN. Each
+  tree splits its points at the mean of one dimension, picked at random
+  from the KD_RAND_DIMS dimensions with the largest variance, until at
+  most KD_LEAF points are left. The random choices make the trees
+  different, so a point that one tree puts on the wrong side of a split
+  is likely to be near the query in another.
+
+  A search goes down every tree to a leaf, then keeps a single priority
+  queue of the branches it skipped, ordered by an estimate of their L1
+  distance from the query (the sum of the distances to the splits that
+  were crossed). Branches are taken from the queue until checks points
+  have been compared, so checks trades accuracy for speed. A point is
+  only ever compared once, even if several trees reach it.
+************************************************************************/
+
+#define KD_LEAF 8
+#define KD_RAND_DIMS 5
+#define KD_SAMPLE 128
+
+// Small generator so building a forest doesn't touch rand().
+static unsigned int kd_random(unsigned long long *state)
+{
+    *state = *state*6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 33;
+}
+
+// Builds the node over index[start, end) and returns its number.
+static int kd_build(kd_forest *f, int t, int start, int end, unsigned long long *state)
+{
+    kd_node *nodes = f->node[t];
+    int *index = f->index[t];
+    int id = f->nodes[t]++;
+    int count = end - start;
+    int size = f->set.size;
+    int i, d;
+    if(count <= KD_LEAF){
+        nodes[id].dim = -1;
+        nodes[id].a = start;
+        nodes[id].b = end;
+        return id;
+    }
+
+    // Mean and variance of each dimension over the first points.
+    int sample = MIN(count, KD_SAMPLE);
+    double *mean = calloc(size, sizeof(double));
+    double *var = calloc(size, sizeof(double));
+    for(i = 0; i < sample; ++i){
+        const float *v = f->set.data + (size_t)index[start + i]*f->set.stride;
+        for(d = 0; d < size; ++d) mean[d] += v[d];
+    }
+    for(d = 0; d < size; ++d) mean[d] /= sample;
+    for(i = 0; i < sample; ++i){
+        const float *v = f->set.data + (size_t)index[start + i]*f->set.stride;
+        for(d = 0; d < size; ++d) var[d] += (v[d] - mean[d])*(v[d] - mean[d]);
+    }
+
+    // Pick one of the most varied dimensions at random.
+    int top[KD_RAND_DIMS];
+    int ntop = 0;
+    for(d = 0; d < size; ++d){
+        if(ntop < KD_RAND_DIMS) ++ntop;
+        else if(var[d] <= var[top[ntop-1]]) continue;
+        int j = ntop - 1;
+        while(j > 0 && var[top[j-1]] < var[d]){
+            top[j] = top[j-1];
+            --j;
+        }
+        top[j] = d;
+    }
+    int dim = top[kd_random(state)%ntop];
+    float split = mean[dim];
+    free(mean);
+    free(var);
+
+    // Partition around the split, halves if every value is on one side.
+    int lo = start, hi = end - 1;
+    while(lo <= hi){
+        if(f->set.data[(size_t)index[lo]*f->set.stride + dim] < split) ++lo;
+        else {
+            int s = index[lo]; index[lo] = index[hi]; index[hi] = s;
+            --hi;
+        }
+    }
+    int mid = lo;
+    if(mid == start || mid == end) mid = start + count/2;
+
+    nodes[id].dim = dim;
+    nodes[id].split = split;
+    nodes[id].a = kd_build(f, t, start, mid, state);
+    nodes[id].b = kd_build(f, t, mid, end, state);
+    return id;
+}
+
+// Builds a forest of randomized k-d trees over a descriptor set.
+// descriptor_set s: descriptors to index, must outlive the forest.
+// int trees: number of trees. Typical: 4-8
+// returns: the forest.
+kd_forest make_kd_forest(descriptor_set s, int trees)
+{
+    kd_forest f;
+    f.set = s;
+    f.trees = MAX(trees, 1);
+    f.index = calloc(f.trees, sizeof(int *));
+    f.node = calloc(f.trees, sizeof(kd_node *));
+    f.nodes = calloc(f.trees, sizeof(int));
+    unsigned long long state = 0x2545F4914F6CDD1DULL;
+    int t, i;
+    for(t = 0; t < f.trees; ++t){
+        f.index[t] = calloc(MAX(s.n, 1), sizeof(int));
+        f.node[t] = calloc(2*MAX(s.n, 1), sizeof(kd_node));
+        for(i = 0; i < s.n; ++i) f.index[t][i] = i;
+        kd_build(&f, t, 0, s.n, &state);
+    }
+    return f;
+}
+
+void free_kd_forest(kd_forest f)
+{
+    int t;
+    for(t = 0; t < f.trees; ++t){
+        free(f.index[t]);
+        free(f.node[t]);
+    }
+    free(f.index);
+    free(f.node);
+    free(f.nodes);
+}
+
+// A branch left for later, with the estimate of how far away it is.
+typedef struct{
+    float d;
+    int tree, node;
+} kd_branch;
+
+// Working memory for one search thread, reused between queries.
+typedef struct{
+    kd_branch *heap;
+    int size, cap;
+    int *stamp;
+    int epoch;
+    int checked;
+    float best;
+    int bind;
+} kd_search;
+
+static void kd_push(kd_search *s, float d, int tree, int node)
+{
+    if(s->size == s->cap){
+        s->cap = s->cap ? 2*s->cap : 256;
+        s->heap = realloc(s->heap, s->cap*sizeof(kd_branch));
+    }
+    int i = s->size++;
+    while(i > 0 && s->heap[(i-1)/2].d > d){
+        s->heap[i] = s->heap[(i-1)/2];
+        i = (i-1)/2;
+    }
+    s->heap[i].d = d;
+    s->heap[i].tree = tree;
+    s->heap[i].node = node;
+}
+
+static kd_branch kd_pop(kd_search *s)
+{
+    kd_branch top = s->heap[0];
+    kd_branch last = s->heap[--s->size];
+    int i = 0;
+    for(;;){
+        int c = 2*i + 1;
+        if(c >= s->size) break;
+        if(c + 1 < s->size && s->heap[c+1].d < s->heap[c].d) ++c;
+        if(s->heap[c].d >= last.d) break;
+        s->heap[i] = s->heap[c];
+        i = c;
+    }
+    if(s->size > 0) s->heap[i] = last;
+    return top;
+}
+
+// Goes down from a node to a leaf, queueing the other side of each split,
+// then compares the query with the points in the leaf.
+static void kd_descend(kd_forest f, kd_search *s, const float *q, int t, int node, float d, int checks)
+{
+    const kd_node *nodes = f.node[t];
+    while(nodes[node].dim >= 0){
+        const kd_node *n = nodes + node;
+        float diff = q[n->dim] - n->split;
+        int near = diff < 0 ? n->a : n->b;
+        int far = diff < 0 ? n->b : n->a;
+        float fd = d + fabsf(diff);
+        if(fd < s->best) kd_push(s, fd, t, far);
+        node = near;
+    }
+    int i;
+    for(i = nodes[node].a; i < nodes[node].b; ++i){
+        int p = f.index[t][i];
+        if(s->stamp[p] == s->epoch) continue;
+        if(s->checked >= checks) return;
+        s->stamp[p] = s->epoch;
+        ++s->checked;
+        float dist = l1_distance((float *)q, f.set.data + (size_t)p*f.set.stride, f.set.size);
+        if(dist < s->best || (dist == s->best && p < s->bind)){
+            s->best = dist;
+            s->bind = p;
+        }
+    }
+}
+
+// Finds the approximate nearest neighbour of one query.
+static int kd_nearest(kd_forest f, kd_search *s, const float *q, int checks, float *dist)
+{
+    ++s->epoch;
+    s->size = 0;
+    s->checked = 0;
+    s->best = INFINITY;
+    s->bind = 0;
+    int t;
+    for(t = 0; t < f.trees; ++t) kd_descend(f, s, q, t, 0, 0, checks);
+    while(s->size > 0 && s->checked < checks){
+        kd_branch br = kd_pop(s);
+        if(br.d >= s->best) break;
+        kd_descend(f, s, q, br.tree, br.node, br.d, checks);
+    }
+    *dist = s->best;
+    return s->bind;
+}
+
+// Finds matches for a set of descriptors in a forest, like
+// match_descriptors: each descriptor in a takes its (approximate) nearest
+// neighbour, then from the closest matches up every descriptor in the
+// forest is used only once.
+// kd_forest f: index over the descriptors of the other image.
+// descriptor_set a: descriptors to look up, same size as the forest's.
+// int checks: points to compare per query, 0 compares them all (exact).
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: matches sorted with match_compare.
+match *match_kd_forest(kd_forest f, descriptor_set a, int checks, int *mn)
+{
+    if(checks <= 0){
+        descriptor *ad = descriptor_set_view(a);
+        descriptor *bd = descriptor_set_view(f.set);
+        match *m = match_descriptors(ad, a.n, bd, f.set.n, mn);
+        free(ad);
+        free(bd);
+        return m;
+    }
+    match *m = calloc(MAX(a.n, 1), sizeof(match));
+    *mn = 0;
+    if(f.set.n == 0) return m;
+    assert(a.n == 0 || a.size == f.set.size);
+    int j;
+    #pragma omp parallel
+    {
+        kd_search s;
+        memset(&s, 0, sizeof(s));
+        s.stamp = calloc(f.set.n, sizeof(int));
+        #pragma omp for schedule(dynamic, 16)
+        for(j = 0; j < a.n; ++j){
+            float best = 0;
+            int bind = kd_nearest(f, &s, a.data + (size_t)j*a.stride, checks, &best);
+            m[j].ai = j;
+            m[j].bi = bind;
+            m[j].p = a.p[j];
+            m[j].q = f.set.p[bind];
+            m[j].distance = best;
+        }
+        free(s.stamp);
+        free(s.heap);
+    }
+    qsort(m, a.n, sizeof(match), match_compare);
+    char *seen = calloc(f.set.n, 1);
+    int count = 0;
+    for(j = 0; j < a.n; ++j){
+        if(seen[m[j].bi]) continue;
+        seen[m[j].bi] = 1;
+        m[count++] = m[j];
+    }
+    free(seen);
+    *mn = count;
+    return m;
+}
+
+// Matches descriptors through a k-d forest built over b, a drop-in for
+// match_descriptors when b is large.
+// int trees: number of trees. Typical: 4-8
+// int checks: points to compare per query, 0 compares them all. Typical: 32-256
+match *match_descriptors_ann(descriptor *a, int an, descriptor *b, int bn, int trees, int checks, int *mn)
+{
+    descriptor_set as = descriptors_to_set(a, an);
+    descriptor_set bs = descriptors_to_set(b, bn);
+    kd_forest f = make_kd_forest(bs, trees);
+    match *m = match_kd_forest(f, as, checks, mn);
+    free_kd_forest(f);
+    free_descriptor_set(as);
+    free_descriptor_set(bs);
+    return m;
+}
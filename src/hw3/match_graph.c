@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+/***************************** Match graph ******************************
+  Matches between every likely pair of a collection of images. Each image
+  is detected and described once. Every pair is then screened cheaply: a
+  sample of GRAPH_SAMPLE descriptors of each image is matched against all
+  of the other with a ratio test, and the matches that pass in both
+  directions are the score of the pair. Only pairs that score at least
+  GRAPH_MIN_SCORE, and that are among the best neighbours of one of their
+  images, are matched in full.
+
+  The work is one list of tasks per stage (images, then pairs, then
+  kept pairs) handed out to the OpenMP threads one task at a time, with
+  the largest tasks first, so a few big images don't leave the other
+  threads idle at the end. Matchers called from a task run on that task's
+  thread. Edges come out in pair order whatever the thread count.
+************************************************************************/
+
+#define GRAPH_SAMPLE 64
+#define GRAPH_RATIO .8
+#define GRAPH_MIN_SCORE 4
+
+// Orders tasks by cost, largest first, then by index.
+typedef struct{
+    double cost;
+    int index;
+} graph_task;
+
+static int graph_task_compare(const void *a, const void *b)
+{
+    const graph_task *ra = (const graph_task *)a;
+    const graph_task *rb = (const graph_task *)b;
+    if(ra->cost != rb->cost) return ra->cost > rb->cost ? -1 : 1;
+    return ra->index - rb->index;
+}
+
+// Ratio-test matches from an even sample of a into all of b.
+static int graph_screen(descriptor *a, int an, descriptor *b, int bn)
+{
+    int sn = MIN(an, GRAPH_SAMPLE);
+    descriptor *s = calloc(MAX(sn, 1), sizeof(descriptor));
+    int i, mn = 0;
+    for(i = 0; i < sn; ++i) s[i] = a[(long long)i*an/sn];
+    match *m = match_descriptors_filtered(s, sn, b, bn, GRAPH_RATIO, 0, &mn);
+    free(m);
+    free(s);
+    return mn;
+}
+
+// Detects and describes a set of images once, then matches the pairs
+// that are likely to overlap.
+// image *ims: images to match.
+// int n: number of images.
+// Detector parameters are the same as detect_corner_set.
+// float ratio: ratio test for matches, 0 to keep all. Typical: .7-.8
+// int mutual: flag to keep only mutual nearest neighbour matches.
+// int neighbours: pairs kept per image after screening, 0 for every pair
+//                 that scores. Typical: 2-8
+// returns: the graph, edges ordered by their image indexes.
+match_graph make_match_graph(image *ims, int n, DETECTOR det, float sigma, float thresh, int nms,
+        int max_corners, float ratio, int mutual, int neighbours)
+{
+    match_graph g;
+    g.images = n;
+    g.sets = calloc(MAX(n, 1), sizeof(descriptor_set));
+    g.edges = 0;
+    int pairs = n*(n - 1)/2;
+    g.edge = calloc(MAX(pairs, 1), sizeof(match_edge));
+    descriptor **views = calloc(MAX(n, 1), sizeof(descriptor *));
+    graph_task *task = calloc(MAX(pairs, n) + 1, sizeof(graph_task));
+    int i, j, k, t;
+
+    // Describe every image once, biggest first.
+    for(i = 0; i < n; ++i){
+        task[i].cost = (double)ims[i].w*ims[i].h;
+        task[i].index = i;
+    }
+    qsort(task, n, sizeof(graph_task), graph_task_compare);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(t = 0; t < n; ++t){
+        int im = task[t].index;
+        g.sets[im] = detect_corner_set(ims[im], det, sigma, thresh, nms, max_corners);
+        views[im] = descriptor_set_view(g.sets[im]);
+    }
+
+    // Screen every pair.
+    int *pa = calloc(MAX(pairs, 1), sizeof(int));
+    int *pb = calloc(MAX(pairs, 1), sizeof(int));
+    int *score = calloc(MAX(pairs, 1), sizeof(int));
+    k = 0;
+    for(i = 0; i < n; ++i){
+        for(j = i + 1; j < n; ++j, ++k){
+            pa[k] = i;
+            pb[k] = j;
+            task[k].cost = (double)g.sets[i].n + g.sets[j].n;
+            task[k].index = k;
+        }
+    }
+    qsort(task, pairs, sizeof(graph_task), graph_task_compare);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(t = 0; t < pairs; ++t){
+        int p = task[t].index;
+        int a = pa[p], b = pb[p];
+        score[p] = graph_screen(views[a], g.sets[a].n, views[b], g.sets[b].n) +
+            graph_screen(views[b], g.sets[b].n, views[a], g.sets[a].n);
+    }
+
+    // Keep the best scoring neighbours of each image.
+    char *keep = calloc(MAX(pairs, 1), 1);
+    int *order = calloc(MAX(n, 1), sizeof(int));
+    for(i = 0; i < n; ++i){
+        int count = 0;
+        for(k = 0; k < pairs; ++k){
+            if((pa[k] != i && pb[k] != i) || score[k] < GRAPH_MIN_SCORE) continue;
+            // Insert by score, earlier pairs first on ties.
+            int s = count++;
+            while(s > 0 && score[order[s-1]] < score[k]){
+                order[s] = order[s-1];
+                --s;
+            }
+            order[s] = k;
+        }
+        if(neighbours > 0) count = MIN(count, neighbours);
+        for(k = 0; k < count; ++k) keep[order[k]] = 1;
+    }
+    for(k = 0; k < pairs; ++k){
+        if(!keep[k]) continue;
+        match_edge *e = g.edge + g.edges++;
+        e->a = pa[k];
+        e->b = pb[k];
+        e->score = score[k];
+    }
+
+    // Match the kept pairs in full, costliest first.
+    for(k = 0; k < g.edges; ++k){
+        task[k].cost = (double)g.sets[g.edge[k].a].n*g.sets[g.edge[k].b].n;
+        task[k].index = k;
+    }
+    qsort(task, g.edges, sizeof(graph_task), graph_task_compare);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(t = 0; t < g.edges; ++t){
+        match_edge *e = g.edge + task[t].index;
+        e->m = match_descriptors_filtered(views[e->a], g.sets[e->a].n, views[e->b], g.sets[e->b].n, ratio, mutual, &e->n);
+    }
+
+    for(i = 0; i < n; ++i) free(views[i]);
+    free(views);
+    free(task);
+    free(order);
+    free(keep);
+    free(score);
+    free(pa);
+    free(pb);
+    return g;
+}
+
+void free_match_graph(match_graph g)
+{
+    int i;
+    for(i = 0; i < g.images; ++i) free_descriptor_set(g.sets[i]);
+    for(i = 0; i < g.edges; ++i) free(g.edge[i].m);
+    free(g.sets);
+    free(g.edge);
+}
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+/***************************** Motion models ****************************
+  Transforms simpler than a homography, all held as a homography with a
+  last row of 0 0 1 so count_inliers, warp_perspective and
+  combine_images take any of them:
+    TRANSLATION  x' = x + tx                         1 match
+    SIMILARITY   x' = s R x + t (rotation and scale) 2 matches
+    AFFINE       x' = A x + t                        3 matches
+    HOMOGRAPHY   see fit_homography                  4 matches
+  Each is fitted in closed form by least squares, about the centroids
+  of the two point sets.
+
+  Pairs of images that only pan (the field panorama after
+  cylindrical_project, say) are explained by a translation. RANSAC on a
+  homography spends 4-point samples and a full solve on them, where
+  1-point samples would find the shift almost at once. RANSAC_select
+  tries the models simplest first. A simpler model is kept when it has
+  more than cutoff inliers and at least a share explain of what a
+  homography can reach. That reach is a cheap estimate: a homography is
+  fitted to the matches near the simple model (within MOTION_GUIDE times
+  the threshold) and refitted MOTION_GUIDE_ROUNDS times.
+
+  The k iterations asked for are sized for 4-point samples. Fewer are
+  enough for smaller samples: each simpler model gets the iterations
+  that give an all-inlier sample with the same confidence at the same
+  inlier ratio. For k = 10000 that is 30, 213 and 1463.
+************************************************************************/
+
+#define MOTION_DEGENERATE 1e-3
+#define MOTION_GUIDE 3
+#define MOTION_GUIDE_ROUNDS 3
+#define MOTION_CONFIDENCE .99
+
+// Matches in a minimal sample of a model.
+int motion_sample(MOTION model)
+{
+    return model == TRANSLATION ? 1 : model == SIMILARITY ? 2 : model == AFFINE ? 3 : 4;
+}
+
+// Fits a model to matches by least squares.
+// match *m: matches to fit, at least motion_sample(model).
+// int n: number of matches.
+// MOTION model: transform to fit.
+// homography *H: filled with the transform.
+// returns: 1 on success, 0 if the matches don't pin the model down.
+int fit_motion(match *m, int n, MOTION model, homography *H)
+{
+    if(model == HOMOGRAPHY) return fit_homography(m, n, H);
+    if(n < motion_sample(model)) return 0;
+    double px = 0, py = 0, qx = 0, qy = 0;
+    int i;
+    for(i = 0; i < n; ++i){
+        px += m[i].p.x;
+        py += m[i].p.y;
+        qx += m[i].q.x;
+        qy += m[i].q.y;
+    }
+    px /= n; py /= n; qx /= n; qy /= n;
+    // Second moments of the centred points.
+    double xx = 0, xy = 0, yy = 0, xu = 0, xv = 0, yu = 0, yv = 0;
+    for(i = 0; i < n; ++i){
+        double x = m[i].p.x - px, y = m[i].p.y - py;
+        double u = m[i].q.x - qx, v = m[i].q.y - qy;
+        xx += x*x; xy += x*y; yy += y*y;
+        xu += x*u; xv += x*v; yu += y*u; yv += y*v;
+    }
+    double a = 1, b = 0, c = 0, d = 1;
+    if(model == SIMILARITY){
+        double s = xx + yy;
+        if(s < MOTION_DEGENERATE) return 0;
+        a = d = (xu + yv)/s;
+        c = (xv - yu)/s;
+        b = -c;
+    } else if(model == AFFINE){
+        // Collinear points leave the normal equations (nearly) singular.
+        double det = xx*yy - xy*xy;
+        if(det <= MOTION_DEGENERATE*(xx + yy)*(xx + yy) || det <= 0) return 0;
+        a = (xu*yy - yu*xy)/det;
+        b = (yu*xx - xu*xy)/det;
+        c = (xv*yy - yv*xy)/det;
+        d = (yv*xx - xv*xy)/det;
+    }
+    homography R = {{a, b, qx - a*px - b*py, c, d, qy - c*px - d*py, 0, 0, 1}};
+    *H = R;
+    return 1;
+}
+
+// Iterations for a model that give its samples the same confidence as k
+// gives 4-point samples.
+static int motion_iters(int k, MOTION model)
+{
+    int s = motion_sample(model);
+    if(s >= 4 || k <= 1) return k;
+    // Inlier ratio at which k 4-point samples reach MOTION_CONFIDENCE.
+    double w4 = 1 - pow(1 - MOTION_CONFIDENCE, 1.0/k);
+    double ws = pow(w4, s/4.0);
+    if(ws >= 1) return 1;
+    return MIN(k, (int)ceil(log(1 - MOTION_CONFIDENCE)/log(1 - ws)));
+}
+
+// Grows a homography from the matches near a simpler model.
+// returns: inliers of the homography at thresh.
+static int guided_homography(homography G, match *m, int n, float thresh)
+{
+    int r;
+    for(r = 0; r < MOTION_GUIDE_ROUNDS; ++r){
+        int e = homography_inliers(G, m, n, MOTION_GUIDE*thresh);
+        homography H;
+        if(!fit_homography(m, e, &H)) break;
+        G = H;
+    }
+    return homography_inliers(G, m, n, thresh);
+}
+
+// Picks the simplest model that explains the matches, see the notes above.
+// match *m: set of matches. Rearranged so the inliers come first.
+// int n: number of matches.
+// float thresh: inlier/outlier distance threshold.
+// int k: iterations for a homography, simpler models take fewer.
+// int cutoff: inlier cutoff to exit early, and least a simpler model needs.
+// float explain: share of a homography's inliers a simpler model needs.
+//                Typical: .9-.95
+// unsigned long long seed: picks the samples.
+// MOTION *model: if not 0, filled with the model picked.
+// returns: matrix representing the transform.
+matrix RANSAC_select(match *m, int n, float thresh, int k, int cutoff, float explain, unsigned long long seed, MOTION *model)
+{
+    MOTION t;
+    for(t = TRANSLATION; t < HOMOGRAPHY; ++t){
+        matrix R = RANSAC_motion(m, n, t, thresh, motion_iters(k, t), cutoff, seed + t);
+        homography H = matrix_to_homography(R);
+        free_matrix(R);
+        int e = homography_inliers(H, m, n, thresh);
+        if(e <= cutoff) continue;
+        if(e >= explain*guided_homography(H, m, n, thresh)){
+            homography_inliers(H, m, n, thresh);
+            if(model) *model = t;
+            return homography_to_matrix(H);
+        }
+    }
+    if(model) *model = HOMOGRAPHY;
+    return RANSAC_motion(m, n, HOMOGRAPHY, thresh, k, cutoff, seed + HOMOGRAPHY);
+}
@@ -5,6 +5,9 @@
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 // Comparator for matches
 // const void *a, *b: pointers to the matches to compare.
@@ -92,13 +95,14 @@ image draw_inliers(image a, image b, matrix H, match *m, int n, float thresh)
 // float sigma: gaussian for harris corner detector. Typical: 2
 // float thresh: threshold for corner/no corner. Typical: 1-5
 // int nms: window to perform nms on. Typical: 3
-image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms)
+// DETECTOR det: corner detector to use, HARRIS, FAST9 or FAST12.
+image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms, DETECTOR det)
 {
     int an = 0;
     int bn = 0;
     int mn = 0;
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
+    descriptor *ad = detect_corners(a, det, sigma, thresh, nms, 0, &an);
+    descriptor *bd = detect_corners(b, det, sigma, thresh, nms, 0, &bn);
     match *m = match_descriptors(ad, an, bd, bn, &mn);
 
     mark_corners(a, ad, an);
@@ -111,6 +115,153 @@ image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms
     return lines;
 }
 
+// L1 distances are summed in L1_LANES interleaved partial sums (element i
+// goes to lane i % L1_LANES), which are then added in a fixed tree. A
+// short last block is treated as if padded with zeros, which add nothing,
+// so zero padded descriptor_set rows give the same sums over their whole
+// stride. Every path below uses that order, so the SIMD and scalar builds
+// and l1_distance agree up to rounding.
+// Terms are never negative, so a partial sum never exceeds the final one
+// and candidates can be dropped as soon as their partial sum passes the
+// best distance so far, checked every L1_CHECK elements. Candidates are
+// compared L1_GROUP at a time out of a descriptor_set copy of b, so they
+// are read from one block of memory.
+#define L1_LANES 8
+#define L1_GROUP 4
+#define L1_CHECK 32
+
+// Adds the L1_LANES partial sums in the fixed order.
+static inline float l1_lanes(const float *l)
+{
+    return ((l[0] + l[1]) + (l[2] + l[3])) + ((l[4] + l[5]) + (l[6] + l[7]));
+}
+
+#if defined(__AVX__)
+// Adds the lanes of four accumulators in the fixed order, all at once.
+static inline __m128 l1_reduce(const __m256 *acc)
+{
+    __m256 h = _mm256_hadd_ps(_mm256_hadd_ps(acc[0], acc[1]), _mm256_hadd_ps(acc[2], acc[3]));
+    return _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+}
+#elif defined(__SSE2__)
+// Adds the lanes of four accumulators in the fixed order, all at once.
+static inline __m128 l1_reduce(const __m128 *lo, const __m128 *hi)
+{
+    __m128 a = lo[0], b = lo[1], c = lo[2], d = lo[3];
+    __m128 e = hi[0], f = hi[1], g = hi[2], h = hi[3];
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    _MM_TRANSPOSE4_PS(e, f, g, h);
+    return _mm_add_ps(_mm_add_ps(_mm_add_ps(a, b), _mm_add_ps(c, d)),
+            _mm_add_ps(_mm_add_ps(e, f), _mm_add_ps(g, h)));
+}
+#endif
+
+#if defined(__AVX__)
+// Adds |q - b[k]| of one block of L1_LANES values to each accumulator.
+static inline void l1_step(const float *q, const float *const *b, int o, int g, __m256 *acc)
+{
+    const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 vq = _mm256_loadu_ps(q);
+    int k;
+    for(k = 0; k < g; ++k){
+        __m256 d = _mm256_sub_ps(vq, _mm256_loadu_ps(b[k] + o));
+        acc[k] = _mm256_add_ps(acc[k], _mm256_and_ps(d, mask));
+    }
+}
+#elif defined(__SSE2__)
+// Adds |q - b[k]| of one block of L1_LANES values to each accumulator.
+static inline void l1_step(const float *q, const float *const *b, int o, int g, __m128 *lo, __m128 *hi)
+{
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 ql = _mm_loadu_ps(q), qh = _mm_loadu_ps(q + 4);
+    int k;
+    for(k = 0; k < g; ++k){
+        __m128 dl = _mm_sub_ps(ql, _mm_loadu_ps(b[k] + o));
+        __m128 dh = _mm_sub_ps(qh, _mm_loadu_ps(b[k] + o + 4));
+        lo[k] = _mm_add_ps(lo[k], _mm_and_ps(dl, mask));
+        hi[k] = _mm_add_ps(hi[k], _mm_and_ps(dh, mask));
+    }
+}
+#else
+// Adds |q - b[k]| of one block of L1_LANES values to each set of lanes.
+static inline void l1_step(const float *q, const float *const *b, int o, int g, float (*lanes)[L1_LANES])
+{
+    int k, l;
+    for(k = 0; k < g; ++k){
+        for(l = 0; l < L1_LANES; ++l) lanes[k][l] += fabsf(q[l] - b[k][o + l]);
+    }
+}
+#endif
+
+// Sums |q - b[k]| for g <= L1_GROUP candidates side by side.
+// const float *q: query values.
+// const float **b: candidate values.
+// int n: number of values in each.
+// float best: candidates are dropped once all partial sums pass this.
+// float *sum: filled in with the g distances.
+// returns: 0 if the candidates were dropped, 1 if sum was filled in.
+static inline int l1_group(const float *q, const float **b, int g, int n, float best, float *sum)
+{
+    int i = 0, k, l;
+    int full = n - n%L1_LANES;
+    int end = full < n ? full + L1_LANES : full;
+    // Zero padded copy of a short last block.
+    float qt[L1_LANES], bt[L1_GROUP][L1_LANES];
+    const float *bp[L1_GROUP];
+    if(full < n){
+        for(l = 0; l < L1_LANES; ++l) qt[l] = full + l < n ? q[full + l] : 0;
+        for(k = 0; k < g; ++k){
+            bp[k] = bt[k];
+            for(l = 0; l < L1_LANES; ++l) bt[k][l] = full + l < n ? b[k][full + l] : 0;
+        }
+    }
+    for(k = 0; k < g; ++k) sum[k] = 0;
+
+#if defined(__AVX__)
+    __m256 acc[L1_GROUP];
+    for(k = 0; k < L1_GROUP; ++k) acc[k] = _mm256_setzero_ps();
+#define L1_STEP(q, b, o) l1_step(q, b, o, g, acc)
+#elif defined(__SSE2__)
+    __m128 lo[L1_GROUP], hi[L1_GROUP];
+    for(k = 0; k < L1_GROUP; ++k) lo[k] = hi[k] = _mm_setzero_ps();
+#define L1_STEP(q, b, o) l1_step(q, b, o, g, lo, hi)
+#else
+    float lanes[L1_GROUP][L1_LANES] = {{0}};
+#define L1_STEP(q, b, o) l1_step(q, b, o, g, lanes)
+#endif
+    while(i < end){
+        int stop = MIN(end, i + L1_CHECK);
+        for(; i < MIN(stop, full); i += L1_LANES) L1_STEP(q + i, b, i);
+        if(i < stop){
+            L1_STEP(qt, bp, 0);
+            i += L1_LANES;
+        }
+#if defined(__AVX__) || defined(__SSE2__)
+#if defined(__AVX__)
+        __m128 s = l1_reduce(acc);
+#else
+        __m128 s = l1_reduce(lo, hi);
+#endif
+        int over = _mm_movemask_ps(_mm_cmpgt_ps(s, _mm_set1_ps(best)));
+        if((over & ((1 << g) - 1)) == (1 << g) - 1) return 0;
+        if(i >= end){
+            float out[L1_GROUP];
+            _mm_storeu_ps(out, s);
+            for(k = 0; k < g; ++k) sum[k] = out[k];
+        }
+#else
+        int drop = 1;
+        for(k = 0; k < g; ++k){
+            sum[k] = l1_lanes(lanes[k]);
+            drop &= sum[k] > best;
+        }
+        if(drop) return 0;
+#endif
+    }
+#undef L1_STEP
+    return 1;
+}
+
 // Calculates L1 distance between to floating point arrays.
 // float *a, *b: arrays to compare.
 // int n: number of values in each array.
@@ -118,87 +269,364 @@ image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms
 float l1_distance(float *a, float *b, int n)
 {
     float sum = 0;
-    for (int i = 0; i < n; i++) {
-        sum += fabsf(a[i]-b[i]);
-    }
+    const float *c = b;
+    l1_group(a, &c, 1, n, INFINITY, &sum);
     return sum;
 }
 
-// Finds best matches between descriptors of two images.
+// Finds the nearest descriptor in b by L1 distance, L1_GROUP candidates at
+// a time, the lowest index on ties.
+// float *second: if not NULL, filled in with the second smallest distance.
+//                Candidates can then only be dropped once past it.
+// returns: index in b, distance in *best.
+static int nearest_l1(const float *q, int n, descriptor_set b, float *best, float *second)
+{
+    int bind = 0, i, k;
+    float bdist = INFINITY, sdist = INFINITY;
+    float sum[L1_GROUP];
+    const float *c[L1_GROUP];
+    float limit = INFINITY;
+    for(i = 0; i < b.n; i += L1_GROUP){
+        // Full groups take the unrolled path, the last one may be short.
+        int g = b.n - i < L1_GROUP ? b.n - i : L1_GROUP;
+        for(k = 0; k < g; ++k) c[k] = b.data + (size_t)(i + k)*b.stride;
+        int done = g == L1_GROUP ? l1_group(q, c, L1_GROUP, n, limit, sum) : l1_group(q, c, g, n, limit, sum);
+        if(!done) continue;
+        for(k = 0; k < g; ++k){
+            if(sum[k] < bdist){
+                sdist = bdist;
+                bdist = sum[k];
+                bind = i + k;
+            } else if(sum[k] < sdist){
+                sdist = sum[k];
+            }
+        }
+        limit = second ? sdist : bdist;
+    }
+    *best = bdist;
+    if(second) *second = sdist;
+    return bind;
+}
+
+// Drops the matches that failed a filter, sorts the rest by distance
+// using match_compare and qsort, then keeps the first match of each
+// descriptor in b.
+// match *m: one match per descriptor in a, compacted in place.
+// char *keep: whether each match passed the filters.
+// int an, bn: number of descriptors in a and b.
+// returns: number of matches left.
+static int filter_matches(match *m, char *keep, int an, int bn)
+{
+    int i, count = 0;
+    for(i = 0; i < an; ++i){
+        if(keep[i]) m[count++] = m[i];
+    }
+    qsort(m, count, sizeof(match), match_compare);
+    unsigned long long *seen = calloc((bn + 63)/64, sizeof(unsigned long long));
+    int unique = 0;
+    for(i = 0; i < count; ++i){
+        int bi = m[i].bi;
+        if(seen[bi/64] >> (bi%64) & 1) continue;
+        seen[bi/64] |= 1ULL << (bi%64);
+        m[unique++] = m[i];
+    }
+    free(seen);
+    return unique;
+}
+
+// Finds best matches between descriptors of two images, keeping only the
+// distinctive ones.
 // descriptor *a, *b: array of descriptors for pixels in two images.
 // int an, bn: number of descriptors in arrays a and b.
+// float ratio: keep a match only if its distance is below ratio times the
+//              distance to the second nearest in b (Lowe's ratio test),
+//              0 to keep all. Typical: .7-.8
+// int mutual: keep a match only if the descriptor in a is also the nearest
+//             to its match in b.
 // int *mn: pointer to number of matches found, to be filled in by function.
-// returns: best matches found. each descriptor in a should match with at most
-//          one other descriptor in b.
-match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
+// returns: best matches found, sorted by distance. each descriptor in a
+//          matches with at most one other descriptor in b.
+match *match_descriptors_filtered(descriptor *a, int an, descriptor *b, int bn, float ratio, int mutual, int *mn)
 {
     int i,j;
 
-    // We will have at most an matches.
-    *mn = an;
-    match *m = calloc(an, sizeof(match));
+    match *m = calloc(MAX(an, 1), sizeof(match));
+    *mn = 0;
+    if(an == 0 || bn == 0) return m;
+    // Padded copies, so whole strides can be compared with no tail.
+    descriptor_set as = descriptors_to_set(a, an);
+    descriptor_set bs = descriptors_to_set(b, bn);
+    char *keep = calloc(an, 1);
+    #pragma omp parallel for schedule(static)
     for(j = 0; j < an; j++){
         // For every descriptor in a, find best match in b.
         // record ai as the index in *a and bi as the index in *b.
-        int bind = 0; // <- find the best match
-        float dist = 0;
-        float best = l1_distance(a[j].data,b[bn-1].data, b[bn-1].n);
-        for(i = 0; i < bn; i++){
-            dist = l1_distance(a[j].data, b[i].data, b[i].n);
-            if(best > dist) {
-                bind = i;
-                best = dist;
-            }
-        }
+        float best = 0, second = 0;
+        const float *q = as.data + (size_t)j*as.stride;
+        int bind = nearest_l1(q, as.stride, bs, &best, ratio > 0 ? &second : 0);
         m[j].ai = j;
         m[j].bi = bind; // <- should be index in b.
         m[j].p = a[j].p;
         m[j].q = b[bind].p;
         m[j].distance = best; // <- should be the smallest L1 distance!
+        keep[j] = ratio <= 0 || best < ratio*second;
     }
 
-    int b_match, count = 0;
-    int *seen = calloc(bn, sizeof(int));
-    int s;
-    // Sort matches based on distance using match_compare and qsort.
-    qsort(m, an, sizeof(match), match_compare);
-    for (i = 0; i < an; i++) {
-        s = 0;
-        b_match = m[i].bi;
-        for (j = 0; j < count; j++) {
-            if (seen[j] == b_match) {
-                s = 1;
-                break;
+    // Search back from the descriptors of b that were matched.
+    if(mutual){
+        unsigned long long *hit = calloc((bn + 63)/64, sizeof(unsigned long long));
+        for(j = 0; j < an; ++j) hit[m[j].bi/64] |= 1ULL << (m[j].bi%64);
+        int *back = calloc(bn, sizeof(int));
+        #pragma omp parallel for schedule(dynamic, 16)
+        for(i = 0; i < bn; ++i){
+            float best = 0;
+            const float *q = bs.data + (size_t)i*bs.stride;
+            if(hit[i/64] >> (i%64) & 1) back[i] = nearest_l1(q, bs.stride, as, &best, 0);
+        }
+        for(j = 0; j < an; ++j) keep[j] &= back[m[j].bi] == j;
+        free(back);
+        free(hit);
+    }
+    free_descriptor_set(as);
+    free_descriptor_set(bs);
+
+    *mn = filter_matches(m, keep, an, bn);
+    free(keep);
+    return m;
+}
+
+// Finds best matches between descriptors of two images.
+// descriptor *a, *b: array of descriptors for pixels in two images.
+// int an, bn: number of descriptors in arrays a and b.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: best matches found. each descriptor in a should match with at most
+//          one other descriptor in b.
+match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
+{
+    return match_descriptors_filtered(a, an, b, bn, 0, 0, mn);
+}
+
+/************************** Blocked matching ****************************
+  match_descriptors_blocked computes every distance between a and b, as in
+  a matrix product, instead of searching b once per query. a is split
+  into blocks of MATCH_BLOCK_A rows, one per task, and b into tiles of
+  MATCH_BLOCK_B rows that fit in L1 cache. Each tile is read from cache by
+  every pair of rows in the block. The inner kernel compares 2 rows of a
+  with 4 rows of b at once, so each load of a or b is used several times.
+  Sums use the same lane order as l1_group, so the distances are the
+  ones match_descriptors finds.
+
+  The best and second best of every row are kept while the tiles go by.
+  Because every distance is computed, the best row of a for each row of
+  b is kept too, so the mutual check needs no second search.
+************************************************************************/
+
+#define MATCH_BLOCK_A 64
+#define MATCH_BLOCK_B 64
+
+// L1 distances from 2 rows of a to 4 rows of b.
+// int n: values per row, a multiple of L1_LANES, rows are zero padded.
+// float *out: the 4 distances of a0 then the 4 of a1.
+static inline void l1_tile(const float *a0, const float *a1, const float **b, int n, float *out)
+{
+    int i = 0, k;
+#if defined(__AVX__)
+    const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 acc0[L1_GROUP], acc1[L1_GROUP];
+    for(k = 0; k < L1_GROUP; ++k) acc0[k] = acc1[k] = _mm256_setzero_ps();
+    for(; i < n; i += L1_LANES){
+        __m256 v0 = _mm256_loadu_ps(a0 + i), v1 = _mm256_loadu_ps(a1 + i);
+        for(k = 0; k < L1_GROUP; ++k){
+            __m256 vb = _mm256_loadu_ps(b[k] + i);
+            acc0[k] = _mm256_add_ps(acc0[k], _mm256_and_ps(_mm256_sub_ps(v0, vb), mask));
+            acc1[k] = _mm256_add_ps(acc1[k], _mm256_and_ps(_mm256_sub_ps(v1, vb), mask));
+        }
+    }
+    _mm_storeu_ps(out, l1_reduce(acc0));
+    _mm_storeu_ps(out + L1_GROUP, l1_reduce(acc1));
+#elif defined(__SSE2__)
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 lo0[L1_GROUP], hi0[L1_GROUP], lo1[L1_GROUP], hi1[L1_GROUP];
+    for(k = 0; k < L1_GROUP; ++k) lo0[k] = hi0[k] = lo1[k] = hi1[k] = _mm_setzero_ps();
+    for(; i < n; i += L1_LANES){
+        __m128 l0 = _mm_loadu_ps(a0 + i), h0 = _mm_loadu_ps(a0 + i + 4);
+        __m128 l1 = _mm_loadu_ps(a1 + i), h1 = _mm_loadu_ps(a1 + i + 4);
+        for(k = 0; k < L1_GROUP; ++k){
+            __m128 bl = _mm_loadu_ps(b[k] + i), bh = _mm_loadu_ps(b[k] + i + 4);
+            lo0[k] = _mm_add_ps(lo0[k], _mm_and_ps(_mm_sub_ps(l0, bl), mask));
+            hi0[k] = _mm_add_ps(hi0[k], _mm_and_ps(_mm_sub_ps(h0, bh), mask));
+            lo1[k] = _mm_add_ps(lo1[k], _mm_and_ps(_mm_sub_ps(l1, bl), mask));
+            hi1[k] = _mm_add_ps(hi1[k], _mm_and_ps(_mm_sub_ps(h1, bh), mask));
+        }
+    }
+    _mm_storeu_ps(out, l1_reduce(lo0, hi0));
+    _mm_storeu_ps(out + L1_GROUP, l1_reduce(lo1, hi1));
+#else
+    int l;
+    float lanes0[L1_GROUP][L1_LANES] = {{0}}, lanes1[L1_GROUP][L1_LANES] = {{0}};
+    for(; i < n; i += L1_LANES){
+        for(k = 0; k < L1_GROUP; ++k){
+            for(l = 0; l < L1_LANES; ++l){
+                lanes0[k][l] += fabsf(a0[i + l] - b[k][i + l]);
+                lanes1[k][l] += fabsf(a1[i + l] - b[k][i + l]);
             }
         }
-        if (!s) {
-            seen[count] = b_match;
-             *(m + count) = m[i];
-            count++;
+    }
+    for(k = 0; k < L1_GROUP; ++k){
+        out[k] = l1_lanes(lanes0[k]);
+        out[L1_GROUP + k] = l1_lanes(lanes1[k]);
+    }
+#endif
+}
+
+// Nearest rows found so far, for a row of a or of b.
+typedef struct{
+    float best, second;
+    int index;
+} match_best;
+
+// Takes distance d to row i into account, the lowest index on ties.
+static inline void update_best(match_best *r, float d, int i)
+{
+    if(d < r->best){
+        r->second = r->best;
+        r->best = d;
+        r->index = i;
+    } else if(d < r->second){
+        r->second = d;
+    }
+}
+
+// Finds best matches like match_descriptors_filtered, computing all
+// distances in cache sized blocks. Faster than the per-query search when
+// both images have many descriptors.
+// descriptor *a, *b: array of descriptors for pixels in two images.
+// int an, bn: number of descriptors in arrays a and b.
+// float ratio: ratio test threshold, 0 to keep all. Typical: .7-.8
+// int mutual: keep only mutual nearest neighbours.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: best matches found, sorted by distance.
+match *match_descriptors_blocked(descriptor *a, int an, descriptor *b, int bn, float ratio, int mutual, int *mn)
+{
+    match *m = calloc(MAX(an, 1), sizeof(match));
+    *mn = 0;
+    if(an == 0 || bn == 0) return m;
+    descriptor_set as = descriptors_to_set(a, an);
+    descriptor_set bs = descriptors_to_set(b, bn);
+    int n = as.stride;
+    int blocks = (an + MATCH_BLOCK_A - 1)/MATCH_BLOCK_A;
+    match_best *rows = calloc(an, sizeof(match_best));
+    // Nearest row of a for each row of b, separately for each block of a
+    // so blocks can run in parallel.
+    match_best *cols = mutual ? calloc((size_t)blocks*bn, sizeof(match_best)) : 0;
+    int blk;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(blk = 0; blk < blocks; ++blk){
+        int a0 = blk*MATCH_BLOCK_A, a1 = MIN(an, a0 + MATCH_BLOCK_A);
+        match_best *col = mutual ? cols + (size_t)blk*bn : 0;
+        int i, j, k, t;
+        for(i = a0; i < a1; ++i) rows[i].best = rows[i].second = INFINITY;
+        for(j = 0; mutual && j < bn; ++j) col[j].best = col[j].second = INFINITY;
+        for(t = 0; t < bn; t += MATCH_BLOCK_B){
+            int t1 = MIN(bn, t + MATCH_BLOCK_B);
+            for(i = a0; i < a1; i += 2){
+                const float *r0 = as.data + (size_t)i*as.stride;
+                const float *r1 = i + 1 < a1 ? r0 + as.stride : r0;
+                int pair = i + 1 < a1;
+                for(j = t; j < t1; j += L1_GROUP){
+                    int g = MIN(L1_GROUP, t1 - j);
+                    const float *c[L1_GROUP];
+                    float d[2*L1_GROUP];
+                    for(k = 0; k < L1_GROUP; ++k) c[k] = bs.data + (size_t)(j + MIN(k, g - 1))*bs.stride;
+                    l1_tile(r0, r1, c, n, d);
+                    for(k = 0; k < g; ++k){
+                        update_best(rows + i, d[k], j + k);
+                        if(mutual) update_best(col + j + k, d[k], i);
+                    }
+                    for(k = 0; pair && k < g; ++k){
+                        update_best(rows + i + 1, d[L1_GROUP + k], j + k);
+                        if(mutual) update_best(col + j + k, d[L1_GROUP + k], i + 1);
+                    }
+                }
+            }
         }
     }
-    *mn = count;
-    free(seen);
+
+    // Blocks in order, so ties still go to the lowest row of a.
+    int *back = 0;
+    if(mutual){
+        back = calloc(bn, sizeof(int));
+        int j;
+        for(j = 0; j < bn; ++j){
+            match_best r = cols[j];
+            for(blk = 1; blk < blocks; ++blk){
+                match_best o = cols[(size_t)blk*bn + j];
+                if(o.best < r.best) r = o;
+            }
+            back[j] = r.index;
+        }
+    }
+
+    char *keep = calloc(an, 1);
+    int i;
+    for(i = 0; i < an; ++i){
+        int bind = rows[i].index;
+        m[i].ai = i;
+        m[i].bi = bind;
+        m[i].p = a[i].p;
+        m[i].q = b[bind].p;
+        m[i].distance = rows[i].best;
+        keep[i] = ratio <= 0 || rows[i].best < ratio*rows[i].second;
+        if(mutual) keep[i] &= back[bind] == i;
+    }
+    *mn = filter_matches(m, keep, an, bn);
+
+    free(keep);
+    free(back);
+    free(cols);
+    free(rows);
+    free_descriptor_set(as);
+    free_descriptor_set(bs);
     return m;
 }
 
+// Copies a 3x3 matrix into a homography.
+homography matrix_to_homography(matrix H)
+{
+    assert(H.rows == 3 && H.cols == 3);
+    homography h;
+    int i;
+    for(i = 0; i < 9; ++i) h.h[i] = H.data[i/3][i%3];
+    return h;
+}
+
+// Copies a homography into a new 3x3 matrix.
+matrix homography_to_matrix(homography h)
+{
+    matrix H = make_matrix(3, 3);
+    int i;
+    for(i = 0; i < 9; ++i) H.data[i/3][i%3] = h.h[i];
+    return H;
+}
+
+// Apply a projective transformation to a point.
+// homography H: homography to project point.
+// point p: point to project.
+// returns: point projected using the homography.
+point homography_project(homography H, point p)
+{
+    const double *h = H.h;
+    double w = h[6]*p.x + h[7]*p.y + h[8];
+    return make_point((h[0]*p.x + h[1]*p.y + h[2])/w, (h[3]*p.x + h[4]*p.y + h[5])/w);
+}
+
 // Apply a projective transformation to a point.
 // matrix H: homography to project point.
 // point p: point to project.
 // returns: point projected using the homography.
 point project_point(matrix H, point p)
 {
-    matrix c = make_matrix(3, 1);
-    c.data[0][0] = p.x;
-    c.data[1][0] = p.y;
-    c.data[2][0] = 1;
-
-    // project point p with homography H.
-    c = matrix_mult_matrix(H, c);
-
-    // Have to divide by.... something...
-    point q = make_point(c.data[0][0]/c.data[2][0], c.data[1][0]/c.data[2][0]);
-    return q;
+    return homography_project(matrix_to_homography(H), p);
 }
 
 // Calculate L2 distance between two points.
@@ -210,6 +638,97 @@ float point_distance(point p, point q)
     //return sqrtf(((p.x*p.x)-(p.y*p.y)))+sqrtf(((q.x*q.x)-(q.y*q.y)));
 }
 
+// Inlier test without a division or a square root: with H*p = (x, y, w),
+// |(x, y)/w - q| < t is |(x, y) - q*w|^2 < t^2*w^2, which also fails for
+// points H sends to infinity.
+static inline int is_inlier(const float *h, float px, float py, float qx, float qy, float t2)
+{
+    float x = h[0]*px + h[1]*py + h[2];
+    float y = h[3]*px + h[4]*py + h[5];
+    float w = h[6]*px + h[7]*py + h[8];
+    float dx = x - qx*w, dy = y - qy*w;
+    return dx*dx + dy*dy < t2*w*w;
+}
+
+// Splits the points of matches into coordinate arrays.
+// match *m: matches.
+// int n: number of matches.
+// returns: the points, in the same order as m.
+match_points make_match_points(match *m, int n)
+{
+    match_points s;
+    int pad = (n + 7)/8*8 + 8;
+    s.n = n;
+    s.px = aligned_alloc(32, 4*pad*sizeof(float));
+    memset(s.px, 0, 4*pad*sizeof(float));
+    s.py = s.px + pad;
+    s.qx = s.py + pad;
+    s.qy = s.qx + pad;
+    int i;
+    for(i = 0; i < n; ++i){
+        s.px[i] = m[i].p.x;
+        s.py[i] = m[i].p.y;
+        s.qx[i] = m[i].q.x;
+        s.qy[i] = m[i].q.y;
+    }
+    return s;
+}
+
+void free_match_points(match_points s)
+{
+    free(s.px);
+}
+
+// Counts inliers like model_inliers without moving anything, a vector of
+// matches at a time.
+// homography H: homography from p to q.
+// match_points s: points of the matches.
+// float thresh: threshold to be an inlier.
+// returns: number of inliers.
+int count_inliers(homography H, match_points s, float thresh)
+{
+    float h[9];
+    int i, count = 0;
+    for(i = 0; i < 9; ++i) h[i] = H.h[i];
+    float t2 = thresh*thresh;
+    i = 0;
+#ifdef __AVX__
+    __m256 h0 = _mm256_set1_ps(h[0]), h1 = _mm256_set1_ps(h[1]), h2 = _mm256_set1_ps(h[2]);
+    __m256 h3 = _mm256_set1_ps(h[3]), h4 = _mm256_set1_ps(h[4]), h5 = _mm256_set1_ps(h[5]);
+    __m256 h6 = _mm256_set1_ps(h[6]), h7 = _mm256_set1_ps(h[7]), h8 = _mm256_set1_ps(h[8]);
+    __m256 vt = _mm256_set1_ps(t2);
+    for(; i + 8 <= s.n; i += 8){
+        __m256 px = _mm256_load_ps(s.px + i), py = _mm256_load_ps(s.py + i);
+        __m256 x = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h0, px), _mm256_mul_ps(h1, py)), h2);
+        __m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h3, px), _mm256_mul_ps(h4, py)), h5);
+        __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h6, px), _mm256_mul_ps(h7, py)), h8);
+        __m256 dx = _mm256_sub_ps(x, _mm256_mul_ps(_mm256_load_ps(s.qx + i), w));
+        __m256 dy = _mm256_sub_ps(y, _mm256_mul_ps(_mm256_load_ps(s.qy + i), w));
+        __m256 d = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 lim = _mm256_mul_ps(_mm256_mul_ps(vt, w), w);
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(d, lim, _CMP_LT_OQ)));
+    }
+#elif defined(__SSE2__)
+    __m128 h0 = _mm_set1_ps(h[0]), h1 = _mm_set1_ps(h[1]), h2 = _mm_set1_ps(h[2]);
+    __m128 h3 = _mm_set1_ps(h[3]), h4 = _mm_set1_ps(h[4]), h5 = _mm_set1_ps(h[5]);
+    __m128 h6 = _mm_set1_ps(h[6]), h7 = _mm_set1_ps(h[7]), h8 = _mm_set1_ps(h[8]);
+    __m128 vt = _mm_set1_ps(t2);
+    for(; i + 4 <= s.n; i += 4){
+        __m128 px = _mm_load_ps(s.px + i), py = _mm_load_ps(s.py + i);
+        __m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(h0, px), _mm_mul_ps(h1, py)), h2);
+        __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(h3, px), _mm_mul_ps(h4, py)), h5);
+        __m128 w = _mm_add_ps(_mm_add_ps(_mm_mul_ps(h6, px), _mm_mul_ps(h7, py)), h8);
+        __m128 dx = _mm_sub_ps(x, _mm_mul_ps(_mm_load_ps(s.qx + i), w));
+        __m128 dy = _mm_sub_ps(y, _mm_mul_ps(_mm_load_ps(s.qy + i), w));
+        __m128 d = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        __m128 lim = _mm_mul_ps(_mm_mul_ps(vt, w), w);
+        count += __builtin_popcount(_mm_movemask_ps(_mm_cmplt_ps(d, lim)));
+    }
+#endif
+    for(; i < s.n; ++i) count += is_inlier(h, s.px[i], s.py[i], s.qx[i], s.qy[i], t2);
+    return count;
+}
+
 // Count number of inliers in a set of matches. Should also bring inliers
 // to the front of the array.
 // matrix H: homography between coordinate systems.
@@ -220,14 +739,23 @@ float point_distance(point p, point q)
 //          their match in the other image. Should also rearrange matches
 //          so that the inliers are first in the array. For drawing.
 int model_inliers(matrix H, match *m, int n, float thresh)
+{
+    return homography_inliers(matrix_to_homography(H), m, n, thresh);
+}
+
+// Same as model_inliers for a homography held by value.
+int homography_inliers(homography H, match *m, int n, float thresh)
 {
     int i;
     int count = 0;
+    float h[9];
+    for(i = 0; i < 9; ++i) h[i] = H.h[i];
+    float t2 = thresh*thresh;
     // TODO: count number of matches that are inliers
     // i.e. distance(H*p, q) < thresh
     // Also, sort the matches m so the inliers are the first 'count' elements.
     for(i = n-1; i >= count; --i){
-        if (point_distance(project_point(H, m[i].p), m[i].q) < thresh){
+        if (is_inlier(h, m[i].p.x, m[i].p.y, m[i].q.x, m[i].q.y, t2)){
             match x = m[count];
             m[count] = m[i];
             m[i] = x;
@@ -252,63 +780,201 @@ void randomize_matches(match *m, int n)
     // TODO: implement Fisher-Yates to shuffle the array.
 }
 
+// Homographies are solved in normalised coordinates (Hartley): each
+// image's points are moved so their centroid is the origin and their
+// mean distance from it is sqrt(2), which keeps the equations well
+// conditioned whatever the image size. With h33 = 1 each match gives two
+// linear equations in the other eight entries. Four matches are solved
+// exactly by elimination on the stack, after checking that no three of
+// them are (nearly) collinear in either image, since those give a
+// singular or wildly unstable H. More matches are fitted in the least
+// squares sense with a Householder QR of the equations, which avoids
+// squaring their condition number as the normal equations would.
+#define HOMOGRAPHY_DEGENERATE 1e-3
+
+// Normalising similarity of the p (q = 0) or q (q = 1) points of matches.
+// double *t: filled with scale, x and y of the centroid.
+static void normalize_points(const match *m, int n, int q, double *t)
+{
+    double cx = 0, cy = 0, d = 0;
+    int i;
+    for(i = 0; i < n; ++i){
+        point p = q ? m[i].q : m[i].p;
+        cx += p.x;
+        cy += p.y;
+    }
+    cx /= n;
+    cy /= n;
+    for(i = 0; i < n; ++i){
+        point p = q ? m[i].q : m[i].p;
+        d += sqrt((p.x - cx)*(p.x - cx) + (p.y - cy)*(p.y - cy));
+    }
+    d /= n;
+    t[0] = d > 0 ? sqrt(2)/d : 1;
+    t[1] = cx;
+    t[2] = cy;
+}
+
+// The two equations of one match, eight coefficients and the right side.
+static void homography_rows(const match *m, const double *tp, const double *tq, double *r0, double *r1)
+{
+    double x = (m->p.x - tp[1])*tp[0], y = (m->p.y - tp[2])*tp[0];
+    double xp = (m->q.x - tq[1])*tq[0], yp = (m->q.y - tq[2])*tq[0];
+    double a[9] = {x, y, 1, 0, 0, 0, -xp*x, -xp*y, xp};
+    double b[9] = {0, 0, 0, x, y, 1, -yp*x, -yp*y, yp};
+    memcpy(r0, a, sizeof(a));
+    memcpy(r1, b, sizeof(b));
+}
+
+// Takes a solution in normalised coordinates back to pixels, H = Tq^-1 G Tp.
+// returns: 1 if h33 isn't 0.
+static int denormalize_homography(const double *g, const double *tp, const double *tq, homography *H)
+{
+    double G[9] = {g[0], g[1], g[2], g[3], g[4], g[5], g[6], g[7], 1};
+    double Tp[9] = {tp[0], 0, -tp[0]*tp[1], 0, tp[0], -tp[0]*tp[2], 0, 0, 1};
+    double Tq[9] = {1/tq[0], 0, tq[1], 0, 1/tq[0], tq[2], 0, 0, 1};
+    double A[9], B[9];
+    int i, j, k;
+    for(i = 0; i < 3; ++i){
+        for(j = 0; j < 3; ++j){
+            A[3*i + j] = 0;
+            for(k = 0; k < 3; ++k) A[3*i + j] += G[3*i + k]*Tp[3*k + j];
+        }
+    }
+    for(i = 0; i < 3; ++i){
+        for(j = 0; j < 3; ++j){
+            B[3*i + j] = 0;
+            for(k = 0; k < 3; ++k) B[3*i + j] += Tq[3*i + k]*A[3*k + j];
+        }
+    }
+    if(fabs(B[8]) < 1e-12) return 0;
+    for(i = 0; i < 9; ++i) H->h[i] = B[i]/B[8];
+    return 1;
+}
+
+// Whether any three of four normalised points are nearly on a line.
+static int degenerate_sample(const double *x, const double *y)
+{
+    int i;
+    for(i = 0; i < 4; ++i){
+        int a = (i + 1)%4, b = (i + 2)%4, c = (i + 3)%4;
+        double cross = (x[b] - x[a])*(y[c] - y[a]) - (y[b] - y[a])*(x[c] - x[a]);
+        if(fabs(cross) < HOMOGRAPHY_DEGENERATE) return 1;
+    }
+    return 0;
+}
+
+// Exact homography through four matches.
+static int solve_homography4(const match *m, homography *H)
+{
+    double tp[3], tq[3];
+    double A[8][9];
+    double px[4], py[4], qx[4], qy[4];
+    int i, j, k;
+    normalize_points(m, 4, 0, tp);
+    normalize_points(m, 4, 1, tq);
+    for(i = 0; i < 4; ++i){
+        homography_rows(m + i, tp, tq, A[2*i], A[2*i + 1]);
+        px[i] = A[2*i][0];
+        py[i] = A[2*i][1];
+        qx[i] = A[2*i][8];
+        qy[i] = A[2*i + 1][8];
+    }
+    if(degenerate_sample(px, py) || degenerate_sample(qx, qy)) return 0;
+
+    // Gaussian elimination with partial pivoting.
+    for(k = 0; k < 8; ++k){
+        int p = k;
+        for(i = k + 1; i < 8; ++i) if(fabs(A[i][k]) > fabs(A[p][k])) p = i;
+        if(fabs(A[p][k]) < 1e-10) return 0;
+        if(p != k){
+            for(j = k; j < 9; ++j){
+                double t = A[k][j]; A[k][j] = A[p][j]; A[p][j] = t;
+            }
+        }
+        for(i = k + 1; i < 8; ++i){
+            double f = A[i][k]/A[k][k];
+            for(j = k; j < 9; ++j) A[i][j] -= f*A[k][j];
+        }
+    }
+    double g[8];
+    for(k = 7; k >= 0; --k){
+        double v = A[k][8];
+        for(j = k + 1; j < 8; ++j) v -= A[k][j]*g[j];
+        g[k] = v/A[k][k];
+    }
+    return denormalize_homography(g, tp, tq, H);
+}
+
+// Least squares homography through n > 4 matches.
+static int solve_homography_qr(const match *m, int n, homography *H)
+{
+    double tp[3], tq[3];
+    int rows = 2*n;
+    double *A = malloc(rows*9*sizeof(double));
+    int i, j, k;
+    normalize_points(m, n, 0, tp);
+    normalize_points(m, n, 1, tq);
+    for(i = 0; i < n; ++i) homography_rows(m + i, tp, tq, A + 18*i, A + 18*i + 9);
+
+    // Householder reflections zero each column below the diagonal, and
+    // are applied to the right side (column 8) along the way.
+    double scale = 0;
+    for(k = 0; k < 8; ++k){
+        double norm = 0;
+        for(i = k; i < rows; ++i) norm += A[i*9 + k]*A[i*9 + k];
+        norm = sqrt(norm);
+        scale = MAX(scale, norm);
+        if(norm <= 1e-10*scale){
+            free(A);
+            return 0;
+        }
+        double alpha = A[k*9 + k] > 0 ? -norm : norm;
+        // v = x - alpha*e1, kept in place of the column.
+        A[k*9 + k] -= alpha;
+        double vv = 0;
+        for(i = k; i < rows; ++i) vv += A[i*9 + k]*A[i*9 + k];
+        for(j = k + 1; j < 9; ++j){
+            double d = 0;
+            for(i = k; i < rows; ++i) d += A[i*9 + k]*A[i*9 + j];
+            d = 2*d/vv;
+            for(i = k; i < rows; ++i) A[i*9 + j] -= d*A[i*9 + k];
+        }
+        A[k*9 + k] = alpha;
+    }
+    double g[8];
+    for(k = 7; k >= 0; --k){
+        double v = A[k*9 + 8];
+        for(j = k + 1; j < 8; ++j) v -= A[k*9 + j]*g[j];
+        g[k] = v/A[k*9 + k];
+    }
+    free(A);
+    return denormalize_homography(g, tp, tq, H);
+}
+
+// Fits a homography to matches: exactly through 4, least squares for more.
+// match *m: matches, p in the source image and q in the destination.
+// int n: number of matches, at least 4.
+// homography *H: filled in with the homography from p to q.
+// returns: 1 on success, 0 if the matches are degenerate.
+int fit_homography(match *m, int n, homography *H)
+{
+    if(n < 4) return 0;
+    if(n == 4) return solve_homography4(m, H);
+    return solve_homography_qr(m, n, H);
+}
+
 // Computes homography between two images given matching pixels.
 // match *matches: matching points between images.
 // int n: number of matches to use in calculating homography.
 // returns: matrix representing homography H that maps image a to image b.
 matrix compute_homography(match *matches, int n)
 {
-    matrix M = make_matrix(n*2, 8);
-    matrix b = make_matrix(n*2, 1);
-
-    int i,j=0;
-    for(i = 0; i < n; i++){
-        double x  = matches[i].p.x;
-        double xp = matches[i].q.x;
-        double y  = matches[i].p.y;
-        double yp = matches[i].q.y;
-        M.data[j][0]=x;
-        M.data[j][1]=y;
-        M.data[j][2]=1;
-        M.data[j][3]=0;
-        M.data[j][4]=0;
-        M.data[j][5]=0;
-        M.data[j][6]=-xp*x;
-        M.data[j][7]=-xp*y;
-        b.data[j][0] = xp;
-        j++;
-        M.data[j][0]=0;
-        M.data[j][1]=0;
-        M.data[j][2]=0;
-        M.data[j][3]=x;
-        M.data[j][4]=y;
-        M.data[j][5]=1;
-        M.data[j][6]=-yp*x;
-        M.data[j][7]=-yp*y;
-        b.data[j][0] = yp;
-        j++;
-    }
-    matrix a = solve_system(M, b);
-    free_matrix(M); free_matrix(b);
-
     // If a solution can't be found, return empty matrix;
     matrix none = {0};
-    if(!a.data) return none;
-
-    matrix H = make_matrix(3, 3);
-    H.data[0][0] = a.data[0][0];
-    H.data[0][1] = a.data[1][0];
-    H.data[0][2] = a.data[2][0];
-    H.data[1][0] = a.data[3][0];
-    H.data[1][1] = a.data[4][0];
-    H.data[1][2] = a.data[5][0];
-    H.data[2][0] = a.data[6][0];
-    H.data[2][1] = a.data[7][0];
-    H.data[2][2] = 1;
-
-
-    free_matrix(a);
-    return H;
+    homography H;
+    if(!fit_homography(matches, n, &H)) return none;
+    return homography_to_matrix(H);
 }
 
 // Perform RANdom SAmple Consensus to calculate homography for noisy matches.
@@ -322,41 +988,46 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 {
     int e;
     int best = 0;
-    matrix Hb = make_translation_homography(256, 0);
+    homography Hb = {{1, 0, 256, 0, 1, 0, 0, 0, 1}};
+    if (n < 4) return homography_to_matrix(Hb);
+    match_points s = make_match_points(m, n);
     for (int i = 0; i < k; i++) {
         // shuffle the matches
         randomize_matches(m, n);
 
         // compute a homography with a few matches
-        matrix H = compute_homography(m, 4);
-
-        if (!H.data) {
+        homography H;
+        if (!fit_homography(m, 4, &H)) {
             continue;
         }
 
-        // if new homography is better than old
-        e = model_inliers(H, m, n, thresh);
+        // if new homography is better than old, counting on the packed
+        // points first and only moving the inliers to the front for a
+        // new best
+        e = count_inliers(H, s, thresh);
         if (best < e) {
-            if (Hb.data) free_matrix(Hb);
+            e = homography_inliers(H, m, n, thresh);
             // compute updated homography using all inliers
-            Hb = compute_homography(m, e);
-            if (!Hb.data) {
+            homography Hr;
+            if (!fit_homography(m, e, &Hr)) {
                 continue;
             }
-
-            best = model_inliers(Hb, m, n, thresh);
+            Hb = Hr;
+            best = homography_inliers(Hb, m, n, thresh);
 
             if (best > cutoff) {
-                return Hb;
+                break;
             }
         }
     }
-    return Hb;
+    free_match_points(s);
+    return homography_to_matrix(Hb);
 }
 
 // Stitches two images together using a projective transformation.
 // image a, b: images to stitch.
-// matrix H: homography from image a coordinates to image b coordinates.
+// matrix H: homography from image a coordinates to image b coordinates,
+//           or any of the simpler MOTION models as a 3x3 matrix.
 // returns: combined image stitched together.
 image combine_images(image a, image b, matrix H)
 {
@@ -385,35 +1056,32 @@ image combine_images(image a, image b, matrix H)
     // Usually this means there was an error in calculating H.
     if(w > 7000 || h > 7000){
         fprintf(stderr, "output too big, stopping\n");
+        free_matrix(Hinv);
         return copy_image(a);
     }
 
-    int i,j,k;
+    int j,k;
     image c = make_image(w, h, a.c);
 
     // Paste image a into the new image offset by dx and dy.
     for(k = 0; k < a.c; ++k){
         for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                set_pixel(c, i-dx, j-dy, k, get_pixel(a, i, j, k));
-            }
+            memcpy(c.data + k*w*h + (j-dy)*w - dx, a.data + k*a.w*a.h + j*a.w, a.w*sizeof(float));
         }
     }
 
-    for(j = topleft.y; j < botright.y; ++j){
-        for(i = topleft.x; i < botright.x; ++i){
-            point p = project_point(H, make_point(i, j));
-            if(p.x >= 0 && p.y >= 0 && p.x < b.w && p.y < b.h){
-                for(k = 0; k < c.c; ++k){
-                    set_pixel(c, i-dx, j-dy, k, bilinear_interpolate(b, p.x, p.y, k));
-                }
-            }
-        }
-    }
+    // Warp image b over the part of the canvas it can land on.
+    int x0 = topleft.x;
+    int y0 = topleft.y;
+    warp_perspective(b, H, c, dx, dy, x0 - dx, y0 - dy, (int)ceilf(botright.x) - dx, (int)ceilf(botright.y) - dy);
+    free_matrix(Hinv);
 
     return c;
 }
 
+// Seed for panorama_image's RANSAC, fixed so stitches are repeatable.
+#define PANORAMA_SEED 10
+
 // Create a panoramam between two images.
 // image a, b: images to stitch together.
 // float sigma: gaussian for harris corner detector. Typical: 2
@@ -423,22 +1091,36 @@ image combine_images(image a, image b, matrix H)
 // int iters: number of RANSAC iterations. Typical: 1,000-50,000
 // int cutoff: RANSAC inlier cutoff. Typical: 10-100
 // int draw: flag to draw inliers.
-image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, int draw)
+// int max_corners: corner budget per image, 0 for no limit. Typical: 500-2000
+// DETECTOR det: corner detector to use, HARRIS, FAST9 or FAST12.
+// float ratio: ratio test for matches, 0 to keep all. Typical: .7-.8
+// int mutual: flag to keep only mutual nearest neighbour matches.
+// float confidence: if above 0, use PROSAC and stop once this sure of the
+//                   homography, cutoff is then unused. 0 keeps RANSAC.
+//                   Typical: .99
+// float explain: if above 0, try a translation, similarity and affine
+//                transform before a homography and keep the first that
+//                explains this share of the matches a homography would,
+//                see RANSAC_select. Overrides confidence. Typical: .9-.95
+image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, int draw, int max_corners, DETECTOR det, float ratio, int mutual, float confidence, float explain)
 {
-    srand(10);
     int an = 0;
     int bn = 0;
     int mn = 0;
 
     // Calculate corners and descriptors
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
+    descriptor *ad = detect_corners(a, det, sigma, thresh, nms, max_corners, &an);
+    descriptor *bd = detect_corners(b, det, sigma, thresh, nms, max_corners, &bn);
 
     // Find matches
-    match *m = match_descriptors(ad, an, bd, bn, &mn);
+    match *m = match_descriptors_filtered(ad, an, bd, bn, ratio, mutual, &mn);
 
-    // Run RANSAC to find the homography
-    matrix H = RANSAC(m, mn, inlier_thresh, iters, cutoff);
+    // Run RANSAC to find the transform, PROSAC makes use of the matches
+    // coming sorted best first
+    matrix H;
+    if(explain > 0) H = RANSAC_select(m, mn, inlier_thresh, iters, cutoff, explain, PANORAMA_SEED, 0);
+    else if(confidence > 0) H = PROSAC(m, mn, inlier_thresh, iters, confidence, 0);
+    else H = RANSAC_parallel(m, mn, inlier_thresh, iters, cutoff, PANORAMA_SEED);
 
     if(draw){
         // Mark corners and matches between images
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+/*************************** Parallel RANSAC ****************************
+  RANSAC over the OpenMP threads that gives the same homography on every
+  run with the same seed, whatever the thread count or timing. rand() is
+  one hidden stream shared by every caller, so RANSAC_parallel draws from
+  a counter-based generator instead: sample i is a pure function of the
+  seed and i, whichever thread happens to draw it.
+
+  Iterations are scored on the inliers of their sample's model, and the
+  winner is the one with the most inliers, the earliest on ties, so the
+  order they finish in doesn't matter. Two values are shared between the
+  threads through atomics. The first is the best count so far: a model is
+  counted a block at a time and dropped once it can't reach that count,
+  which can't change the winner (nor hide a count past the cutoff). The
+  second is the first iteration that beat the cutoff. Iterations after
+  it are skipped, but all of them before it still run, so the early exit
+  stops at the same place on every run.
+  Only the winner is refit on its inliers, once, at the end.
+
+  RANSAC_motion runs the same search for any of the motion models,
+  RANSAC_parallel is the homography case.
+************************************************************************/
+
+// Largest sample, a homography's.
+#define RANSAC_SAMPLE 4
+#define RANSAC_BLOCK 64
+
+// Hashes a 64 bit counter (splitmix64's finaliser).
+static unsigned long long ransac_mix(unsigned long long x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27))*0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Draws size distinct indexes below n for iteration i.
+static void ransac_sample(int *idx, int size, int n, unsigned long long seed, int i)
+{
+    unsigned long long key = ransac_mix(seed ^ ransac_mix(i));
+    unsigned long long draw = 0;
+    int j, l;
+    for(j = 0; j < size; ++j){
+        int again = 1;
+        while(again){
+            idx[j] = ransac_mix(key + draw++)%n;
+            again = 0;
+            for(l = 0; l < j; ++l) again |= idx[l] == idx[j];
+        }
+    }
+}
+
+static int atomic_load_int(int *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void atomic_max_int(int *p, int v)
+{
+    int old = atomic_load_int(p);
+    while(old < v && !__atomic_compare_exchange_n(p, &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void atomic_min_int(int *p, int v)
+{
+    int old = atomic_load_int(p);
+    while(old > v && !__atomic_compare_exchange_n(p, &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Counts inliers a block at a time, giving up once fewer than the best
+// so far are possible.
+// int *best: best count so far, shared between the threads.
+// int cap: most that can be asked for, so every count past the cutoff is
+//          finished.
+// int *need: filled with the count it gave up short of.
+// returns: the inliers, or -1 if the count was abandoned.
+static int ransac_inliers(homography H, match_points s, float thresh, int *best, int cap, int *need)
+{
+    int count = 0, i;
+    for(i = 0; i < s.n; i += RANSAC_BLOCK){
+        int b = MIN(atomic_load_int(best), cap);
+        if(count + s.n - i < b){
+            *need = b;
+            return -1;
+        }
+        match_points v = s;
+        v.n = MIN(RANSAC_BLOCK, s.n - i);
+        v.px += i;
+        v.py += i;
+        v.qx += i;
+        v.qy += i;
+        count += count_inliers(H, v, thresh);
+    }
+    return count;
+}
+
+// Fits the model of iteration i.
+static int ransac_model(match *m, int n, MOTION model, unsigned long long seed, int i, homography *H)
+{
+    int idx[RANSAC_SAMPLE], j;
+    match sample[RANSAC_SAMPLE];
+    int size = motion_sample(model);
+    ransac_sample(idx, size, n, seed, i);
+    for(j = 0; j < size; ++j) sample[j] = m[idx[j]];
+    return fit_motion(sample, size, model, H);
+}
+
+// RANSAC spread over the OpenMP threads, see the notes above.
+// match *m: set of matches. Rearranged so the inliers come first.
+// int n: number of matches.
+// MOTION model: transform to fit.
+// float thresh: inlier/outlier distance threshold.
+// int k: number of iterations to run.
+// int cutoff: inlier cutoff to exit early.
+// unsigned long long seed: picks the samples, the same seed gives the
+//                          same transform.
+// returns: matrix representing the transform with the most inliers.
+matrix RANSAC_motion(match *m, int n, MOTION model, float thresh, int k, int cutoff, unsigned long long seed)
+{
+    homography Hb = {{1, 0, 256, 0, 1, 0, 0, 0, 1}};
+    if(n < motion_sample(model) || k <= 0) return homography_to_matrix(Hb);
+    match_points s = make_match_points(m, n);
+    // Inliers of each iteration, -1 if its count was abandoned short of
+    // need, -2 if its sample was degenerate.
+    int *count = calloc(k, sizeof(int));
+    int *need = calloc(k, sizeof(int));
+    int best = 0;
+    int stop = k - 1;
+    int i;
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(i = 0; i < k; ++i){
+        if(i > atomic_load_int(&stop)) continue;
+        homography H;
+        if(!ransac_model(m, n, model, seed, i, &H)){
+            count[i] = -2;
+            continue;
+        }
+        int e = ransac_inliers(H, s, thresh, &best, cutoff + 1, need + i);
+        count[i] = e;
+        if(e < 0) continue;
+        atomic_max_int(&best, e);
+        if(e > cutoff) atomic_min_int(&stop, i);
+    }
+
+    // Iterations after stop may have run and raised best, so counts that
+    // were abandoned short of more than the winner has are redone.
+    int win = -1, e = 0;
+    for(i = 0; i <= stop; ++i){
+        if(count[i] > e){
+            e = count[i];
+            win = i;
+        }
+    }
+    for(i = 0; i <= stop; ++i){
+        if(count[i] != -1 || need[i] <= e) continue;
+        homography H;
+        int b = e + (i > win);
+        ransac_model(m, n, model, seed, i, &H);
+        int c = ransac_inliers(H, s, thresh, &b, b, need + i);
+        if(c > e || (c == e && i < win)){
+            e = c;
+            win = i;
+        }
+    }
+    free(count);
+    free(need);
+    free_match_points(s);
+    if(win < 0) return homography_to_matrix(Hb);
+
+    // Refit the winner on all of its inliers, keep whichever has more.
+    homography Hw;
+    ransac_model(m, n, model, seed, win, &Hw);
+    e = homography_inliers(Hw, m, n, thresh);
+    homography Hr;
+    if(fit_motion(m, e, model, &Hr) && homography_inliers(Hr, m, n, thresh) >= e) Hw = Hr;
+    homography_inliers(Hw, m, n, thresh);
+    return homography_to_matrix(Hw);
+}
+
+// RANSAC_motion for a homography.
+matrix RANSAC_parallel(match *m, int n, float thresh, int k, int cutoff, unsigned long long seed)
+{
+    return RANSAC_motion(m, n, HOMOGRAPHY, thresh, k, cutoff, seed);
+}
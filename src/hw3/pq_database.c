@@ -0,0 +1,606 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/***************************** PQ database ******************************
+  Descriptors from many images, compressed with product quantisation
+  (Jegou et al.) so a whole collection fits in memory. A descriptor is cut
+  into m subspaces and each piece is replaced by the nearest of PQ_K
+  centroids trained for that subspace, a 4-bit code. A 75-float
+  descriptor with m = 24 takes 12 bytes instead of 300.
+
+  Everything else stored per descriptor is kept as small: its keypoint
+  is two 16-bit pixel coordinates, and image ids are stored once per
+  run of slots from the same image, which within a list are together.
+  A slot then costs m/2 + 4 bytes, so once the lists are long enough for
+  the fixed tables and the padding of their last blocks not to matter,
+  the whole database is 16x smaller than the floats with m = 24 and 25x
+  with m = 16.
+
+  The search is sublinear through an inverted file: the descriptors are
+  split into lists around coarse centres and a query only scans the
+  probes lists whose centres are closest. Distances are asymmetric: the
+  query stays in floats and a table of its L1 distance to every centroid
+  of every subspace turns a code into a distance with m lookups.
+
+  Lists are stored in blocks of PQ_BLOCK descriptors with the codes of
+  two subspaces packed into one byte per descriptor, so one 32-byte load
+  holds a subspace pair for the whole block. A copy of the table rounded
+  down to bytes fits in a register per subspace and pshufb looks up all
+  32 descriptors at once (the fast-scan layout of Andre et al.). The byte
+  sums are a lower bound on the real distance, so only descriptors that
+  could beat the current second best are rescored with the float table
+  and the result is the same as scoring every code in floats.
+
+  The database is one block laid out like its file, a header and then
+  aligned arrays, so saving writes the block out and loading maps the
+  file without reading or copying it.
+************************************************************************/
+
+#define PQ_MAGIC 0x50514442
+#define PQ_VERSION 2
+#define PQ_K 16
+#define PQ_BLOCK 32
+#define PQ_ALIGN 64
+#define PQ_MAX_M 64
+#define PQ_TRAIN 16384
+#define PQ_ITERS 12
+
+typedef struct{
+    int magic, version;
+    int n, size, m, lists, blocks, images, runs;
+} pq_header;
+
+static unsigned int pq_random(unsigned long long *state)
+{
+    *state = *state*6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 33;
+}
+
+static size_t pq_align(size_t x)
+{
+    return (x + PQ_ALIGN - 1)/PQ_ALIGN*PQ_ALIGN;
+}
+
+// Offsets of the arrays in a database block.
+// returns: size of the block.
+static size_t pq_layout(const pq_header *h, size_t *off)
+{
+    size_t o = pq_align(sizeof(pq_header));
+    off[0] = o; o = pq_align(o + (size_t)h->lists*h->size*sizeof(float));
+    off[1] = o; o = pq_align(o + (size_t)PQ_K*h->size*sizeof(float));
+    off[2] = o; o = pq_align(o + (size_t)(h->lists + 1)*sizeof(int));
+    off[3] = o; o = pq_align(o + (size_t)h->lists*sizeof(int));
+    off[4] = o; o = pq_align(o + (size_t)h->runs*sizeof(int));
+    off[5] = o; o = pq_align(o + (size_t)h->runs*sizeof(int));
+    off[6] = o; o = pq_align(o + (size_t)h->blocks*PQ_BLOCK*2*sizeof(unsigned short));
+    off[7] = o; o = pq_align(o + (size_t)h->blocks*PQ_BLOCK*(h->m/2));
+    return o;
+}
+
+// Points a database into its block, checking everything a search uses.
+// returns: 1 if the block holds a valid database.
+static int pq_attach(pq_database *db, void *base, size_t bytes)
+{
+    pq_header h;
+    size_t off[8];
+    if(bytes < sizeof(h)) return 0;
+    memcpy(&h, base, sizeof(h));
+    if(h.magic != PQ_MAGIC || h.version != PQ_VERSION || h.n < 0 || h.size <= 0 ||
+            h.m < 2 || h.m > PQ_MAX_M || h.m%2 || h.lists < 1 || h.blocks < 0 || h.images < 0 ||
+            h.runs < 0) return 0;
+    if(pq_layout(&h, off) > bytes) return 0;
+    char *b = base;
+    db->n = h.n;
+    db->size = h.size;
+    db->m = h.m;
+    db->lists = h.lists;
+    db->images = h.images;
+    db->coarse = (const float *)(b + off[0]);
+    db->centroids = (const float *)(b + off[1]);
+    db->start = (const int *)(b + off[2]);
+    db->end = (const int *)(b + off[3]);
+    db->runs = h.runs;
+    db->run_slot = (const int *)(b + off[4]);
+    db->run_image = (const int *)(b + off[5]);
+    db->blocks = h.blocks;
+    db->xy = (const unsigned short *)(b + off[6]);
+    db->codes = (const unsigned char *)(b + off[7]);
+    db->base = base;
+    db->bytes = bytes;
+    int i, n = 0;
+    if(db->start[0] != 0 || db->start[h.lists] != h.blocks) return 0;
+    for(i = 0; i < h.lists; ++i){
+        if(db->start[i] > db->start[i+1]) return 0;
+        // A list's blocks are all used, its last one at least in part.
+        if(db->end[i] <= (db->start[i+1] - 1)*PQ_BLOCK && db->start[i] < db->start[i+1]) return 0;
+        if(db->end[i] < db->start[i]*PQ_BLOCK || db->end[i] > db->start[i+1]*PQ_BLOCK) return 0;
+        n += db->end[i] - db->start[i]*PQ_BLOCK;
+    }
+    if(n != h.n) return 0;
+    for(i = 0; i < h.runs; ++i){
+        if(db->run_slot[i] < 0 || db->run_slot[i] >= h.blocks*PQ_BLOCK) return 0;
+        if(i > 0 && db->run_slot[i] <= db->run_slot[i-1]) return 0;
+        if(db->run_image[i] < 0 || db->run_image[i] >= h.images) return 0;
+    }
+    return 1;
+}
+
+// First dimension of subspace j.
+static int pq_sub(int size, int m, int j)
+{
+    return (int)((long long)j*size/m);
+}
+
+static inline float pq_l1(const float *a, const float *b, int n)
+{
+    float d = 0;
+    int i;
+    for(i = 0; i < n; ++i) d += fabsf(a[i] - b[i]);
+    return d;
+}
+
+// Nearest of k centres by L1, the lowest index on ties.
+static int pq_nearest(const float *v, const float *c, int k, int dim)
+{
+    int best = 0, j;
+    float bd = INFINITY;
+    for(j = 0; j < k; ++j){
+        float d = dim > 16 ? l1_distance((float *)v, (float *)c + (size_t)j*dim, dim) : pq_l1(v, c + (size_t)j*dim, dim);
+        if(d < bd){
+            bd = d;
+            best = j;
+        }
+    }
+    return best;
+}
+
+// Lloyd's iterations with L1 assignment and mean centres. Centres start
+// at random points and a centre that loses all its points moves to one.
+// const float *x: n points of dim floats, ld floats apart.
+// float *c: k*dim centres, filled in.
+static void pq_kmeans(const float *x, int n, int dim, int ld, int k, float *c, unsigned long long *state)
+{
+    int *assign = calloc(MAX(n, 1), sizeof(int));
+    int *count = calloc(k, sizeof(int));
+    int i, j, d, it;
+    for(j = 0; j < k; ++j){
+        const float *s = n ? x + (size_t)(pq_random(state)%n)*ld : 0;
+        for(d = 0; d < dim; ++d) c[j*dim + d] = s ? s[d] : 0;
+    }
+    for(it = 0; it < PQ_ITERS && n > 0; ++it){
+        #pragma omp parallel for schedule(static)
+        for(i = 0; i < n; ++i) assign[i] = pq_nearest(x + (size_t)i*ld, c, k, dim);
+        memset(c, 0, (size_t)k*dim*sizeof(float));
+        memset(count, 0, k*sizeof(int));
+        for(i = 0; i < n; ++i){
+            float *ci = c + assign[i]*dim;
+            const float *xi = x + (size_t)i*ld;
+            ++count[assign[i]];
+            for(d = 0; d < dim; ++d) ci[d] += xi[d];
+        }
+        for(j = 0; j < k; ++j){
+            const float *s = x + (size_t)(pq_random(state)%n)*ld;
+            for(d = 0; d < dim; ++d) c[j*dim + d] = count[j] ? c[j*dim + d]/count[j] : s[d];
+        }
+    }
+    free(assign);
+    free(count);
+}
+
+// Builds a database over the descriptors of several images.
+// descriptor_set *sets: one set per image, all of the same size.
+// int count: number of images.
+// int m: subspaces, rounded down to an even number of at most 64. Typical: 16-24
+// int lists: coarse cells. Typical: about sqrt of the number of descriptors
+// returns: the database.
+pq_database make_pq_database(descriptor_set *sets, int count, int m, int lists)
+{
+    int size = count ? sets[0].size : 0;
+    int n = 0, s, i, j;
+    for(s = 0; s < count; ++s){
+        assert(sets[s].n == 0 || sets[s].size == size);
+        n += sets[s].n;
+    }
+    size = MAX(size, 1);
+    m = MIN(MAX(m, 2), PQ_MAX_M) & ~1;
+    lists = MAX(1, MIN(lists, n));
+
+    // Descriptors in one array, in image order.
+    float *x = malloc((size_t)MAX(n, 1)*size*sizeof(float));
+    int *owner = calloc(MAX(n, 1), sizeof(int));
+    point *pts = calloc(MAX(n, 1), sizeof(point));
+    int k = 0;
+    for(s = 0; s < count; ++s){
+        for(i = 0; i < sets[s].n; ++i, ++k){
+            memcpy(x + (size_t)k*size, sets[s].data + (size_t)i*sets[s].stride, size*sizeof(float));
+            owner[k] = s;
+            pts[k] = sets[s].p[i];
+        }
+    }
+
+    // Train on an even spread of at most PQ_TRAIN descriptors.
+    int t = MIN(n, PQ_TRAIN);
+    float *train = malloc((size_t)MAX(t, 1)*size*sizeof(float));
+    for(i = 0; i < t; ++i){
+        memcpy(train + (size_t)i*size, x + (size_t)((long long)i*n/t)*size, size*sizeof(float));
+    }
+    unsigned long long state = 0x853C49E6748FEA9BULL;
+    float *coarse = calloc((size_t)lists*size, sizeof(float));
+    float *centroids = calloc((size_t)PQ_K*size, sizeof(float));
+    pq_kmeans(train, t, size, size, lists, coarse, &state);
+    for(j = 0; j < m; ++j){
+        int lo = pq_sub(size, m, j), hi = pq_sub(size, m, j + 1);
+        pq_kmeans(train + lo, t, hi - lo, size, PQ_K, centroids + PQ_K*lo, &state);
+    }
+    free(train);
+
+    // Cell and codes of every descriptor.
+    int *cell = calloc(MAX(n, 1), sizeof(int));
+    unsigned char *code = calloc((size_t)MAX(n, 1)*m, 1);
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < n; ++i){
+        const float *v = x + (size_t)i*size;
+        int q;
+        cell[i] = pq_nearest(v, coarse, lists, size);
+        for(q = 0; q < m; ++q){
+            int lo = pq_sub(size, m, q), hi = pq_sub(size, m, q + 1);
+            code[(size_t)i*m + q] = pq_nearest(v + lo, centroids + PQ_K*lo, PQ_K, hi - lo);
+        }
+    }
+
+    // Slots of every descriptor. Descriptors are in image order, so the
+    // slots of one image in a list are together and a new run starts at
+    // the first slot of a list and wherever the image changes.
+    pq_header h = {PQ_MAGIC, PQ_VERSION, n, size, m, lists, 0, count, 0};
+    int *fill = calloc(lists + 1, sizeof(int));
+    int *first = calloc(lists + 1, sizeof(int));
+    int *last = calloc(lists + 1, sizeof(int));
+    int *slot = calloc(MAX(n, 1), sizeof(int));
+    for(i = 0; i < n; ++i) ++fill[cell[i]];
+    for(i = 0; i < lists; ++i){
+        first[i+1] = first[i] + (fill[i] + PQ_BLOCK - 1)/PQ_BLOCK;
+        fill[i] = first[i]*PQ_BLOCK;
+        last[i] = -1;
+    }
+    h.blocks = first[lists];
+    for(i = 0; i < n; ++i){
+        slot[i] = fill[cell[i]]++;
+        h.runs += last[cell[i]] < 0 || owner[last[cell[i]]] != owner[i];
+        last[cell[i]] = i;
+    }
+
+    // Lay out the block.
+    size_t off[8];
+    size_t bytes = pq_layout(&h, off);
+    char *base = aligned_alloc(PQ_ALIGN, bytes);
+    memset(base, 0, bytes);
+    memcpy(base, &h, sizeof(h));
+    memcpy(base + off[0], coarse, (size_t)lists*size*sizeof(float));
+    memcpy(base + off[1], centroids, (size_t)PQ_K*size*sizeof(float));
+    memcpy(base + off[2], first, (lists + 1)*sizeof(int));
+    memcpy(base + off[3], fill, lists*sizeof(int));
+    int *run_slot = (int *)(base + off[4]);
+    int *run_image = (int *)(base + off[5]);
+    unsigned short *xy = (unsigned short *)(base + off[6]);
+    unsigned char *codes = (unsigned char *)(base + off[7]);
+    // Runs, going through the slots in order.
+    int *at = calloc((size_t)MAX(h.blocks, 1)*PQ_BLOCK, sizeof(int));
+    int r = 0, l;
+    for(i = 0; i < n; ++i) at[slot[i]] = i;
+    for(l = 0; l < lists; ++l){
+        for(k = first[l]*PQ_BLOCK; k < fill[l]; ++k){
+            if(k > first[l]*PQ_BLOCK && owner[at[k]] == owner[at[k-1]]) continue;
+            run_slot[r] = k;
+            run_image[r++] = owner[at[k]];
+        }
+    }
+    assert(r == h.runs);
+    free(at);
+    for(i = 0; i < n; ++i){
+        int block = slot[i]/PQ_BLOCK, v = slot[i]%PQ_BLOCK;
+        xy[2*slot[i]] = MIN(MAX((int)pts[i].x, 0), 65535);
+        xy[2*slot[i] + 1] = MIN(MAX((int)pts[i].y, 0), 65535);
+        for(j = 0; j < m/2; ++j){
+            codes[((size_t)block*(m/2) + j)*PQ_BLOCK + v] = code[(size_t)i*m + 2*j] | code[(size_t)i*m + 2*j + 1] << 4;
+        }
+    }
+    free(fill);
+    free(first);
+    free(last);
+    free(slot);
+    free(cell);
+    free(code);
+    free(coarse);
+    free(centroids);
+    free(x);
+    free(owner);
+    free(pts);
+
+    pq_database db;
+    memset(&db, 0, sizeof(db));
+    int ok = pq_attach(&db, base, bytes);
+    assert(ok);
+    (void)ok;
+    return db;
+}
+
+void free_pq_database(pq_database db)
+{
+    if(db.mapped) munmap(db.base, db.bytes);
+    else free(db.base);
+}
+
+// Writes a database to a file, which load_pq_database maps back in.
+void save_pq_database(pq_database db, const char *fname)
+{
+    FILE *fp = fopen(fname, "wb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return;
+    }
+    if(db.base && fwrite(db.base, 1, db.bytes, fp) != db.bytes){
+        fprintf(stderr, "Couldn't write file %s\n", fname);
+    }
+    fclose(fp);
+}
+
+// Maps a file written by save_pq_database read-only into memory, so only
+// the pages a search touches are ever read.
+// returns: the database, empty if the file can't be used.
+pq_database load_pq_database(const char *fname)
+{
+    pq_database db;
+    memset(&db, 0, sizeof(db));
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return db;
+    }
+    struct stat st;
+    void *base = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size > 0){
+        base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(base == MAP_FAILED || !pq_attach(&db, base, st.st_size)){
+        fprintf(stderr, "Bad PQ database file %s\n", fname);
+        if(base != MAP_FAILED) munmap(base, st.st_size);
+        memset(&db, 0, sizeof(db));
+        return db;
+    }
+    db.mapped = 1;
+    return db;
+}
+
+// Image a slot's descriptor came from.
+// returns: the image, -1 for a slot that isn't in any run.
+int pq_database_image(pq_database db, int slot)
+{
+    int lo = 0, hi = db.runs;
+    // Last run starting at or before slot.
+    while(lo < hi){
+        int mid = (lo + hi)/2;
+        if(db.run_slot[mid] <= slot) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo > 0 ? db.run_image[lo - 1] : -1;
+}
+
+// Keypoint of a slot's descriptor.
+point pq_database_point(pq_database db, int slot)
+{
+    return make_point(db.xy[2*slot], db.xy[2*slot + 1]);
+}
+
+// Finds which descriptors of a block could be closer than limit.
+// const unsigned char *qlut: byte table, PQ_K entries per subspace.
+// int limit: largest byte sum worth rescoring.
+// returns: bit v set for each such slot v.
+static unsigned int pq_block_candidates(const unsigned char *code, const unsigned char *qlut, int half, int limit)
+{
+#ifdef __AVX2__
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    const __m256i even = _mm256_set1_epi16(0x00FF);
+    __m256i se = _mm256_setzero_si256(), so = _mm256_setzero_si256();
+    int j;
+    for(j = 0; j < half; ++j){
+        __m256i c = _mm256_load_si256((const __m256i *)(code + j*PQ_BLOCK));
+        __m256i t0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(qlut + 2*j*PQ_K)));
+        __m256i t1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(qlut + (2*j + 1)*PQ_K)));
+        __m256i lo = _mm256_shuffle_epi8(t0, _mm256_and_si256(c, low));
+        __m256i hi = _mm256_shuffle_epi8(t1, _mm256_and_si256(_mm256_srli_epi16(c, 4), low));
+        // Even slots in the low byte of each 16-bit lane, odd in the high.
+        se = _mm256_add_epi16(se, _mm256_add_epi16(_mm256_and_si256(lo, even), _mm256_and_si256(hi, even)));
+        so = _mm256_add_epi16(so, _mm256_add_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+    }
+    __m256i l = _mm256_set1_epi16(limit);
+    unsigned int me = ~_mm256_movemask_epi8(_mm256_cmpgt_epi16(se, l)) & 0x55555555u;
+    unsigned int mo = ~_mm256_movemask_epi8(_mm256_cmpgt_epi16(so, l)) & 0x55555555u;
+    return me | mo << 1;
+#elif defined(__SSSE3__)
+    const __m128i low = _mm_set1_epi8(0x0F);
+    const __m128i even = _mm_set1_epi16(0x00FF);
+    __m128i l = _mm_set1_epi16(limit);
+    unsigned int mask = 0;
+    int h, j;
+    for(h = 0; h < 2; ++h){
+        __m128i se = _mm_setzero_si128(), so = _mm_setzero_si128();
+        for(j = 0; j < half; ++j){
+            __m128i c = _mm_load_si128((const __m128i *)(code + j*PQ_BLOCK + 16*h));
+            __m128i t0 = _mm_loadu_si128((const __m128i *)(qlut + 2*j*PQ_K));
+            __m128i t1 = _mm_loadu_si128((const __m128i *)(qlut + (2*j + 1)*PQ_K));
+            __m128i lo = _mm_shuffle_epi8(t0, _mm_and_si128(c, low));
+            __m128i hi = _mm_shuffle_epi8(t1, _mm_and_si128(_mm_srli_epi16(c, 4), low));
+            se = _mm_add_epi16(se, _mm_add_epi16(_mm_and_si128(lo, even), _mm_and_si128(hi, even)));
+            so = _mm_add_epi16(so, _mm_add_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+        }
+        unsigned int me = ~_mm_movemask_epi8(_mm_cmpgt_epi16(se, l)) & 0x5555u;
+        unsigned int mo = ~_mm_movemask_epi8(_mm_cmpgt_epi16(so, l)) & 0x5555u;
+        mask |= (me | mo << 1) << 16*h;
+    }
+    return mask;
+#else
+    // Byte sums cost as much as float ones without pshufb, so every slot
+    // goes straight to the float table.
+    (void)code; (void)qlut; (void)half; (void)limit;
+    return 0xFFFFFFFFu;
+#endif
+}
+
+// Distance of slot v of a block from the float table.
+static float pq_score(const float *lut, const unsigned char *code, int v, int half)
+{
+    float d = 0;
+    int j;
+    for(j = 0; j < half; ++j){
+        unsigned char c = code[j*PQ_BLOCK + v];
+        d += lut[2*j*PQ_K + (c & 15)] + lut[(2*j + 1)*PQ_K + (c >> 4)];
+    }
+    return d;
+}
+
+// Finds the nearest and second nearest codes to a query in the probes
+// closest lists, the lowest slot on ties.
+// float *cell, int *order: scratch, db.lists each.
+// returns: slot of the nearest, -1 if the lists are empty.
+static int pq_query(pq_database db, const float *q, int probes, float *cell, int *order, float *best, float *second)
+{
+    float lut[PQ_MAX_M*PQ_K];
+    unsigned char qlut[PQ_MAX_M*PQ_K];
+    int half = db.m/2;
+    int i, j, k;
+
+    // Closest cells, by partial selection.
+    for(i = 0; i < db.lists; ++i){
+        cell[i] = l1_distance((float *)q, (float *)db.coarse + (size_t)i*db.size, db.size);
+        order[i] = i;
+    }
+    probes = MIN(MAX(probes, 1), db.lists);
+    for(i = 0; i < probes; ++i){
+        int b = i;
+        for(j = i + 1; j < db.lists; ++j){
+            if(cell[order[j]] < cell[order[b]] || (cell[order[j]] == cell[order[b]] && order[j] < order[b])) b = j;
+        }
+        int s = order[i]; order[i] = order[b]; order[b] = s;
+    }
+
+    // Float table, then bytes: each subspace shifted down to its minimum
+    // and all scaled alike so byte sums never overestimate a distance.
+    float base = 0, range = 0;
+    for(j = 0; j < db.m; ++j){
+        int lo = pq_sub(db.size, db.m, j), hi = pq_sub(db.size, db.m, j + 1);
+        const float *c = db.centroids + PQ_K*lo;
+        float mn = INFINITY, mx = 0;
+        for(k = 0; k < PQ_K; ++k){
+            float d = pq_l1(q + lo, c + k*(hi - lo), hi - lo);
+            lut[j*PQ_K + k] = d;
+            mn = MIN(mn, d);
+            mx = MAX(mx, d);
+        }
+        base += mn;
+        range = MAX(range, mx - mn);
+    }
+    float inv = range > 0 ? 255/range : 0;
+    for(j = 0; j < db.m; ++j){
+        float mn = INFINITY;
+        for(k = 0; k < PQ_K; ++k) mn = MIN(mn, lut[j*PQ_K + k]);
+        for(k = 0; k < PQ_K; ++k) qlut[j*PQ_K + k] = MIN((int)((lut[j*PQ_K + k] - mn)*inv), 255);
+    }
+
+    float b = INFINITY, s = INFINITY;
+    int bi = -1;
+    for(i = 0; i < probes; ++i){
+        int l = order[i], blk;
+        for(blk = db.start[l]; blk < db.start[l+1]; ++blk){
+            const unsigned char *code = db.codes + (size_t)blk*half*PQ_BLOCK;
+            // One step of slack keeps rounding from dropping a tie.
+            int limit = 32767;
+            if(s < INFINITY && range > 0) limit = (int)MIN((s - base)*inv, 32766) + 1;
+            unsigned int cand = pq_block_candidates(code, qlut, half, limit);
+            // Slots past the end of the list are padding.
+            int used = db.end[l] - blk*PQ_BLOCK;
+            if(used < PQ_BLOCK) cand &= (1u << used) - 1;
+            while(cand){
+                int v = __builtin_ctz(cand);
+                cand &= cand - 1;
+                int slot = blk*PQ_BLOCK + v;
+                float d = pq_score(lut, code, v, half);
+                if(d < b || (d == b && slot < bi)){
+                    s = b;
+                    b = d;
+                    bi = slot;
+                } else if(d < s){
+                    s = d;
+                }
+            }
+        }
+    }
+    *best = b;
+    *second = s;
+    return bi;
+}
+
+// Finds matches for a set of descriptors in a database, like
+// match_descriptors: each descriptor in a takes its nearest code, then
+// from the closest matches up every database descriptor is used only
+// once. bi of a match is a slot of the database and
+// pq_database_image(db, bi) is the image the descriptor came from.
+// pq_database db: database, same descriptor size as a.
+// descriptor_set a: descriptors to look up.
+// int probes: lists to scan per query. Typical: 4-16
+// float ratio: keep a match only if best < ratio*second, 0 to keep all.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: matches sorted with match_compare, distances to the codes.
+match *match_pq_database(pq_database db, descriptor_set a, int probes, float ratio, int *mn)
+{
+    match *m = calloc(MAX(a.n, 1), sizeof(match));
+    *mn = 0;
+    if(db.n == 0) return m;
+    assert(a.n == 0 || a.size == db.size);
+    char *keep = calloc(MAX(a.n, 1), 1);
+    int j;
+    #pragma omp parallel
+    {
+        float *cell = calloc(db.lists, sizeof(float));
+        int *order = calloc(db.lists, sizeof(int));
+        #pragma omp for schedule(dynamic, 16)
+        for(j = 0; j < a.n; ++j){
+            float best = 0, second = 0;
+            int bi = pq_query(db, a.data + (size_t)j*a.stride, probes, cell, order, &best, &second);
+            if(bi < 0 || (ratio > 0 && !(best < ratio*second))) continue;
+            keep[j] = 1;
+            m[j].ai = j;
+            m[j].bi = bi;
+            m[j].p = a.p[j];
+            m[j].q = pq_database_point(db, bi);
+            m[j].distance = best;
+        }
+        free(cell);
+        free(order);
+    }
+    int count = 0;
+    for(j = 0; j < a.n; ++j) if(keep[j]) m[count++] = m[j];
+    free(keep);
+    qsort(m, count, sizeof(match), match_compare);
+    char *seen = calloc((size_t)db.blocks*PQ_BLOCK, 1);
+    int n = 0;
+    for(j = 0; j < count; ++j){
+        if(seen[m[j].bi]) continue;
+        seen[m[j].bi] = 1;
+        m[n++] = m[j];
+    }
+    free(seen);
+    *mn = n;
+    return m;
+}
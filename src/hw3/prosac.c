@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <limits.h>
+#include "image.h"
+
+/***************************** PROSAC ***********************************
+  RANSAC for matches sorted best first, as match_descriptors returns
+  them. PROSAC (Chum and Matas) draws its first samples from the top few
+  matches and lets the pool grow towards all n at the rate that, after
+  PROSAC_GROWTH of the k draws, gives the same samples on average as
+  plain RANSAC would. Each sample takes the pool's newest match while the
+  pool is on schedule; the draws left once it holds all n are plain
+  RANSAC, so a poor ordering costs at most the growth. With a good
+  ordering the first samples are nearly all inliers, so a model is
+  usually found in a handful of draws.
+
+  Models are checked with Wald's sequential probability ratio test
+  (Matas and Chum): matches are tested SPRT_BLOCK at a time in a fixed
+  random order and the likelihood ratio of "bad model" to "good model" is
+  updated after each block, so a bad model is dropped after a block or
+  two instead of testing all n matches. The test needs the inlier ratio
+  of a good model (epsilon, the best model's so far) and of a bad one
+  (delta, the inlier ratio seen while rejecting), and its threshold trades
+  the chance of dropping a good model against the time saved.
+
+  The run stops once a sample of all inliers would have been drawn with
+  the given confidence, after log(1 - confidence)/log(1 - w^4) draws for
+  an inlier ratio w, or after k draws. As in PROSAC, w is taken over the
+  top n* matches that give the earliest stop, so a good ordering also
+  stops early. n* must hold more inliers than a wrong model would pick up
+  by chance, which keeps a small lucky prefix from ending the run.
+************************************************************************/
+
+#define PROSAC_SAMPLE 4
+#define PROSAC_SEED 0xDA3E39CB94B95BDBULL
+#define SPRT_BLOCK 64
+#define SPRT_MODEL_COST 200
+#define SPRT_EPSILON .1
+#define SPRT_DELTA .01
+#define PROSAC_CHANCE 1.645
+// Share of the k draws the pool takes to grow to all n.
+#define PROSAC_GROWTH .5
+
+static unsigned int prosac_random(unsigned long long *state)
+{
+    *state = *state*6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 33;
+}
+
+// Draws count distinct indexes below n into idx.
+static void draw_sample(int *idx, int count, int n, unsigned long long *state)
+{
+    int i, j;
+    for(i = 0; i < count; ++i){
+        int again = 1;
+        while(again){
+            idx[i] = prosac_random(state)%n;
+            again = 0;
+            for(j = 0; j < i; ++j) again |= idx[j] == idx[i];
+        }
+    }
+}
+
+// State of the SPRT: log likelihood ratio steps and the threshold.
+typedef struct{
+    double epsilon, delta;
+    double in, out;
+    double log_a;
+} sprt;
+
+// Sets the test up for new estimates of epsilon and delta. The threshold
+// A is the fixed point of A = K/C + 1 + log(A), where K is the cost of a
+// model in match tests and C the expected information in one test.
+static void sprt_update(sprt *t, double epsilon, double delta)
+{
+    t->epsilon = MIN(epsilon, .999);
+    t->delta = MIN(delta, .9*t->epsilon);
+    double e = t->epsilon, d = t->delta;
+    t->in = log(d/e);
+    t->out = log((1 - d)/(1 - e));
+    double c = (1 - d)*log((1 - d)/(1 - e)) + d*log(d/e);
+    double k = SPRT_MODEL_COST/c + 1;
+    double a = k;
+    int i;
+    for(i = 0; i < 10; ++i) a = k + log(a);
+    t->log_a = log(a);
+}
+
+// Counts inliers a block at a time until the test rejects the model.
+// int *inliers, *checked: filled with the inliers and matches seen.
+// returns: 1 if the model was tested on every match.
+static int sprt_inliers(homography H, match_points s, float thresh, const sprt *t, int *inliers, int *checked)
+{
+    double lambda = 0;
+    int count = 0, i;
+    for(i = 0; i < s.n; i += SPRT_BLOCK){
+        match_points b = s;
+        b.n = MIN(SPRT_BLOCK, s.n - i);
+        b.px += i;
+        b.py += i;
+        b.qx += i;
+        b.qy += i;
+        int c = count_inliers(H, b, thresh);
+        count += c;
+        lambda += c*t->in + (b.n - c)*t->out;
+        if(lambda > t->log_a){
+            *inliers = count;
+            *checked = i + b.n;
+            return 0;
+        }
+    }
+    *inliers = count;
+    *checked = s.n;
+    return 1;
+}
+
+// Draws needed for an all-inlier sample with the given confidence.
+static long long prosac_bound(double w, float confidence)
+{
+    double p = pow(w, PROSAC_SAMPLE);
+    if(p >= 1) return 1;
+    if(p <= 0) return LLONG_MAX;
+    return (long long)ceil(log(1 - confidence)/log(1 - p));
+}
+
+// Finds the earliest stop over the top n' matches for every n' that has
+// more inliers than chance. delta is the chance a match fits a wrong model.
+static long long prosac_stop(homography H, match *m, int n, float thresh, double delta, float confidence)
+{
+    long long best = prosac_bound(0, confidence);
+    int count = 0, i;
+    for(i = 0; i < n; ++i){
+        point p = homography_project(H, m[i].p);
+        float dx = p.x - m[i].q.x, dy = p.y - m[i].q.y;
+        count += dx*dx + dy*dy < thresh*thresh;
+        if(i + 1 <= PROSAC_SAMPLE) continue;
+        // Inliers a wrong model gets: the sample plus a binomial share of the rest.
+        double r = i + 1 - PROSAC_SAMPLE;
+        double chance = PROSAC_SAMPLE + r*delta + PROSAC_CHANCE*sqrt(r*delta*(1 - delta));
+        if(count > chance) best = MIN(best, prosac_bound((double)count/(i + 1), confidence));
+    }
+    return best;
+}
+
+// Finds a homography for matches sorted best first, see the notes above.
+// match *m: matches, best first. Rearranged so the inliers come first.
+// int n: number of matches.
+// float thresh: inlier/outlier distance threshold.
+// int k: most samples to draw.
+// float confidence: stop once an all-inlier sample would have been drawn
+//                   with this probability, 0 to draw all k. Typical: .99
+// int *iters: if not 0, filled with the number of samples drawn.
+// returns: matrix representing the homography with the most inliers.
+matrix PROSAC(match *m, int n, float thresh, int k, float confidence, int *iters)
+{
+    homography Hb = {{1, 0, 256, 0, 1, 0, 0, 0, 1}};
+    if(iters) *iters = 0;
+    if(n < PROSAC_SAMPLE) return homography_to_matrix(Hb);
+    unsigned long long state = PROSAC_SEED;
+    int i;
+
+    // Verify in a random order so blocks of the SPRT are fair samples.
+    match *work = calloc(n, sizeof(match));
+    memcpy(work, m, n*sizeof(match));
+    for(i = n - 1; i > 0; --i){
+        int j = prosac_random(&state)%(i + 1);
+        match x = work[i]; work[i] = work[j]; work[j] = x;
+    }
+    match_points s = make_match_points(work, n);
+
+    sprt t;
+    sprt_update(&t, SPRT_EPSILON, SPRT_DELTA);
+    double rejected_in = 0, rejected_seen = 0;
+    int best = 0;
+
+    // Pool of the top matches samples come from, grown on schedule.
+    int pool = PROSAC_SAMPLE;
+    double tn = PROSAC_GROWTH*k;
+    for(i = 0; i < PROSAC_SAMPLE; ++i) tn *= (double)(pool - i)/(n - i);
+    int tn_prime = 1;
+    long long limit = k;
+    int it;
+    for(it = 1; it <= limit; ++it){
+        if(it > tn_prime && pool < n){
+            double next = tn*(pool + 1)/(pool + 1 - PROSAC_SAMPLE);
+            tn_prime += (int)ceil(next - tn);
+            tn = next;
+            ++pool;
+        }
+        // While the pool is on schedule, samples always take its newest
+        // match. Once it has taken in all n they come from all of it.
+        int idx[PROSAC_SAMPLE];
+        match sample[PROSAC_SAMPLE];
+        if(it <= tn_prime){
+            draw_sample(idx, PROSAC_SAMPLE - 1, pool - 1, &state);
+            idx[PROSAC_SAMPLE - 1] = pool - 1;
+        } else {
+            draw_sample(idx, PROSAC_SAMPLE, pool, &state);
+        }
+        for(i = 0; i < PROSAC_SAMPLE; ++i) sample[i] = m[idx[i]];
+        homography H;
+        if(!fit_homography(sample, PROSAC_SAMPLE, &H)) continue;
+
+        int e = 0, seen = 0;
+        if(!sprt_inliers(H, s, thresh, &t, &e, &seen)){
+            rejected_in += e;
+            rejected_seen += seen;
+            sprt_update(&t, t.epsilon, MAX(rejected_in/rejected_seen, SPRT_DELTA/10));
+            continue;
+        }
+        if(e <= best) continue;
+
+        // Refit on all the inliers, keep whichever has more.
+        int ei = homography_inliers(H, work, n, thresh);
+        homography Hr;
+        if(fit_homography(work, ei, &Hr)){
+            int er = count_inliers(Hr, s, thresh);
+            if(er >= e){
+                H = Hr;
+                e = er;
+            }
+        }
+        Hb = H;
+        best = e;
+        double w = (double)best/n;
+        if(w > t.epsilon) sprt_update(&t, w, t.delta);
+        if(confidence > 0) limit = MIN(limit, MAX(it, prosac_stop(H, m, n, thresh, t.delta, confidence)));
+    }
+    if(iters) *iters = MIN(it, limit);
+    homography_inliers(Hb, m, n, thresh);
+    free_match_points(s);
+    free(work);
+    return homography_to_matrix(Hb);
+}
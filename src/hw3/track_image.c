@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <time.h>
+#include "image.h"
+
+/***************************** Corner tracking **************************
+  A corner_tracker keeps the corners of the last frame so a video does
+  not need a full detection every frame. The frame is split into cells
+  and a cell counts as changed when the mean difference of its gradient
+  magnitude from the previous frame is above a threshold. Corners in
+  unchanged cells stay where they are. Corners in changed cells are
+  moved to the best match of their 7x7 grey patch within a small search
+  radius, or dropped if nothing is close enough or an earlier corner
+  already sits within nms of where they land. The detector is then run
+  only over runs of changed cells (plus a halo for its windows) to pick
+  up new corners, skipping any within nms of a kept corner. Both checks
+  go through a list of the kept corners in each cell. When that
+  leaves more than max_corners, the strongest by detector response are
+  kept, each response taken from a small crop around its corner. Every
+  refresh frames a full detection resets the tracker, so drift and lost
+  corners don't accumulate.
+************************************************************************/
+
+#define TRACK_CELL 32
+#define TRACK_PATCH 3
+#define TRACK_MAX_ERROR .08
+
+// Makes a tracker. Detector parameters are the same as detect_corner_set.
+// int refresh: run a full detection every refresh frames, 0 for only the first.
+// float change: mean gradient change that marks a cell as changed. Typical: .01-.05
+// int radius: how far a corner may move between frames. Typical: 4-16
+corner_tracker make_corner_tracker(DETECTOR det, float sigma, float thresh, int nms, int max_corners,
+        int refresh, float change, int radius)
+{
+    corner_tracker t;
+    memset(&t, 0, sizeof(t));
+    t.det = det;
+    t.sigma = sigma;
+    t.thresh = thresh;
+    t.nms = nms;
+    t.max_corners = max_corners;
+    t.refresh = refresh;
+    t.change = change;
+    t.radius = radius;
+    t.corners = make_descriptor_set(0, 0);
+    return t;
+}
+
+void free_corner_tracker(corner_tracker t)
+{
+    free_image(t.prev);
+    free_image(t.prev_grad);
+    free_descriptor_set(t.corners);
+}
+
+// Grey version of a frame, or a copy of its first channel.
+static image track_grey(image im)
+{
+    if(im.c == 3) return rgb_to_grayscale(im);
+    image g = make_image(im.w, im.h, 1);
+    memcpy(g.data, im.data, im.w*im.h*sizeof(float));
+    return g;
+}
+
+// |dx| + |dy| with central differences, 0 on the border.
+static image gradient_energy(image g)
+{
+    image e = make_image(g.w, g.h, 1);
+    int y;
+    #pragma omp parallel for schedule(static)
+    for(y = 1; y < g.h - 1; ++y){
+        const float *r = g.data + y*g.w;
+        float *o = e.data + y*g.w;
+        int x;
+        for(x = 1; x < g.w - 1; ++x){
+            o[x] = fabsf(r[x + 1] - r[x - 1]) + fabsf(r[x + g.w] - r[x - g.w]);
+        }
+    }
+    return e;
+}
+
+// Copies a rectangle of an image.
+static image crop_image(image im, int x0, int y0, int w, int h)
+{
+    image c = make_image(w, h, im.c);
+    int k, y;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < h; ++y){
+            memcpy(c.data + ((size_t)k*h + y)*w, im.data + ((size_t)k*im.h + y0 + y)*im.w + x0, w*sizeof(float));
+        }
+    }
+    return c;
+}
+
+// Moves a corner to where its patch from prev matches best in cur.
+// returns: new pixel index, or -1 if nothing within radius is close enough.
+static int track_point(image prev, image cur, int x, int y, int radius)
+{
+    int r = TRACK_PATCH;
+    if(x < r || y < r || x >= prev.w - r || y >= prev.h - r) return -1;
+    float best = INFINITY;
+    int bx = -1, by = -1;
+    int dx, dy, i, j;
+    for(dy = -radius; dy <= radius; ++dy){
+        int cy = y + dy;
+        if(cy < r || cy >= cur.h - r) continue;
+        for(dx = -radius; dx <= radius; ++dx){
+            int cx = x + dx;
+            if(cx < r || cx >= cur.w - r) continue;
+            float sad = 0;
+            for(j = -r; j <= r && sad <= best; ++j){
+                const float *a = prev.data + (y + j)*prev.w + x;
+                const float *b = cur.data + (cy + j)*cur.w + cx;
+                for(i = -r; i <= r; ++i) sad += fabsf(a[i] - b[i]);
+            }
+            // Prefer the smallest move on ties.
+            if(sad < best || (sad == best && abs(dx) + abs(dy) < abs(bx - x) + abs(by - y))){
+                best = sad;
+                bx = cx;
+                by = cy;
+            }
+        }
+    }
+    if(bx < 0 || best/((2*r + 1)*(2*r + 1)) > TRACK_MAX_ERROR) return -1;
+    return by*cur.w + bx;
+}
+
+// Detector response at one corner, from a crop just big enough for the
+// detector's windows.
+static float track_response(const corner_tracker *t, image frame, int x, int y)
+{
+    int r = t->det == HARRIS ? (int)ceilf(3*t->sigma) + 2 : 4;
+    int x0 = MAX(0, x - r), y0 = MAX(0, y - r);
+    int x1 = MIN(frame.w, x + r + 1), y1 = MIN(frame.h, y + r + 1);
+    image crop = crop_image(frame, x0, y0, x1 - x0, y1 - y0);
+    image R = t->det == HARRIS ? harris_response(crop, t->sigma) :
+        fast_score(crop, t->thresh/255, t->det == FAST9 ? 9 : 12);
+    float v = R.data[(y - y0)*R.w + x - x0];
+    free_image(R);
+    free_image(crop);
+    return v;
+}
+
+// Orders corners by response, strongest first, then by index.
+typedef struct{
+    float response;
+    int index;
+} track_rank;
+
+static int track_rank_compare(const void *a, const void *b)
+{
+    const track_rank *ra = (const track_rank *)a;
+    const track_rank *rb = (const track_rank *)b;
+    if(ra->response != rb->response) return ra->response > rb->response ? -1 : 1;
+    return ra->index - rb->index;
+}
+
+static int int_compare(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Keeps the t->max_corners strongest corners of idx, in their order.
+// returns: number kept.
+static int track_budget(const corner_tracker *t, image frame, int *idx, int n)
+{
+    track_rank *rank = calloc(n, sizeof(track_rank));
+    int i;
+    for(i = 0; i < n; ++i){
+        rank[i].response = track_response(t, frame, idx[i]%frame.w, idx[i]/frame.w);
+        rank[i].index = i;
+    }
+    qsort(rank, n, sizeof(track_rank), track_rank_compare);
+    int k = t->max_corners;
+    int *keep = calloc(k, sizeof(int));
+    for(i = 0; i < k; ++i) keep[i] = rank[i].index;
+    qsort(keep, k, sizeof(int), int_compare);
+    for(i = 0; i < k; ++i) idx[i] = idx[keep[i]];
+    free(keep);
+    free(rank);
+    return k;
+}
+
+// Finds whether a pixel is within nms of a kept corner.
+// int *first: first of each cell's corners in kept.
+// int *last: one past the last of each cell's corners in kept.
+// int *kept: pixel indexes of the kept corners, by cell.
+static int track_taken(const int *first, const int *last, const int *kept, int gw, int gh, int w,
+        int x, int y, int nms)
+{
+    int r = (nms + TRACK_CELL - 1)/TRACK_CELL;
+    int cx = x/TRACK_CELL, cy = y/TRACK_CELL;
+    int gx, gy, j;
+    for(gy = MAX(0, cy - r); gy <= MIN(gh - 1, cy + r); ++gy){
+        for(gx = MAX(0, cx - r); gx <= MIN(gw - 1, cx + r); ++gx){
+            int c = gy*gw + gx;
+            for(j = first[c]; j < last[c]; ++j){
+                if(abs(kept[j]%w - x) <= nms && abs(kept[j]/w - y) <= nms) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Runs a full detection and resets the tracker to this frame.
+static void track_reset(corner_tracker *t, image frame, int *idx, int n)
+{
+    free_descriptor_set(t->corners);
+    t->corners = describe_corners(frame, idx, n, 0);
+}
+
+// Updates the tracked corners with the next frame of a video.
+// corner_tracker *t: tracker, t->corners holds the corners of this frame after.
+// image frame: the new frame.
+// returns: number of cells that were re-detected.
+int track_corners(corner_tracker *t, image frame)
+{
+    image grey = track_grey(frame);
+    image grad = gradient_energy(grey);
+    int gw = (frame.w + TRACK_CELL - 1)/TRACK_CELL;
+    int gh = (frame.h + TRACK_CELL - 1)/TRACK_CELL;
+    int full = !t->prev.data || t->prev.w != frame.w || t->prev.h != frame.h ||
+        (t->refresh > 0 && t->frame % t->refresh == 0);
+    ++t->frame;
+
+    if(full){
+        int n = 0;
+        int *idx = detect_corner_indexes(frame, t->det, t->sigma, t->thresh, t->nms, t->max_corners, &n);
+        track_reset(t, frame, idx, n);
+        free(idx);
+        free_image(t->prev);
+        free_image(t->prev_grad);
+        t->prev = grey;
+        t->prev_grad = grad;
+        return gw*gh;
+    }
+
+    // Mark cells whose gradients changed.
+    char *changed = calloc(gw*gh, 1);
+    int c;
+    #pragma omp parallel for schedule(static)
+    for(c = 0; c < gw*gh; ++c){
+        int x0 = (c%gw)*TRACK_CELL, y0 = (c/gw)*TRACK_CELL;
+        int x1 = MIN(x0 + TRACK_CELL, frame.w), y1 = MIN(y0 + TRACK_CELL, frame.h);
+        float sum = 0;
+        int x, y;
+        for(y = y0; y < y1; ++y){
+            const float *a = grad.data + y*frame.w;
+            const float *b = t->prev_grad.data + y*frame.w;
+            for(x = x0; x < x1; ++x) sum += fabsf(a[x] - b[x]);
+        }
+        changed[c] = sum/((x1 - x0)*(y1 - y0)) > t->change;
+    }
+
+    // Keep or move the old corners.
+    descriptor_set old = t->corners;
+    int *idx = calloc(old.n + 1, sizeof(int));
+    int n = 0, i;
+    for(i = 0; i < old.n; ++i){
+        int x = old.p[i].x, y = old.p[i].y;
+        int cell = (y/TRACK_CELL)*gw + x/TRACK_CELL;
+        idx[i] = changed[cell] ? track_point(t->prev, grey, x, y, t->radius) : y*frame.w + x;
+    }
+
+    // Kept corners by cell, room made for every corner that survived. A
+    // corner within nms of an earlier one (two that moved onto the same
+    // feature, say) is a duplicate, and so is a new one later.
+    int *first = calloc(gw*gh + 1, sizeof(int));
+    int *last = calloc(gw*gh, sizeof(int));
+    int *kept = calloc(old.n + 1, sizeof(int));
+    for(i = 0; i < old.n; ++i){
+        if(idx[i] >= 0) ++first[(idx[i]/frame.w/TRACK_CELL)*gw + idx[i]%frame.w/TRACK_CELL + 1];
+    }
+    for(c = 0; c < gw*gh; ++c) first[c + 1] += first[c];
+    memcpy(last, first, gw*gh*sizeof(int));
+    for(i = 0; i < old.n; ++i){
+        if(idx[i] < 0) continue;
+        int x = idx[i]%frame.w, y = idx[i]/frame.w;
+        if(track_taken(first, last, kept, gw, gh, frame.w, x, y, t->nms)) continue;
+        kept[last[(y/TRACK_CELL)*gw + x/TRACK_CELL]++] = idx[i];
+        idx[n++] = idx[i];
+    }
+
+    // Detect again over runs of changed cells in each row of cells.
+    int halo = (int)ceilf(3*t->sigma) + t->nms + 4;
+    int cells = 0, gy;
+    for(gy = 0; gy < gh; ++gy){
+        int gx = 0;
+        while(gx < gw){
+            if(!changed[gy*gw + gx]){ ++gx; continue; }
+            int start = gx;
+            while(gx < gw && changed[gy*gw + gx]) ++gx;
+            cells += gx - start;
+            int cx0 = start*TRACK_CELL, cy0 = gy*TRACK_CELL;
+            int cx1 = MIN(gx*TRACK_CELL, frame.w), cy1 = MIN(cy0 + TRACK_CELL, frame.h);
+            int x0 = MAX(0, cx0 - halo), y0 = MAX(0, cy0 - halo);
+            int x1 = MIN(frame.w, cx1 + halo), y1 = MIN(frame.h, cy1 + halo);
+            image crop = crop_image(frame, x0, y0, x1 - x0, y1 - y0);
+            int cn = 0, k;
+            int *cidx = detect_corner_indexes(crop, t->det, t->sigma, t->thresh, t->nms, 0, &cn);
+            idx = realloc(idx, (n + cn + 1)*sizeof(int));
+            for(k = 0; k < cn; ++k){
+                int x = x0 + cidx[k]%crop.w, y = y0 + cidx[k]/crop.w;
+                if(x < cx0 || x >= cx1 || y < cy0 || y >= cy1) continue;
+                if(track_taken(first, last, kept, gw, gh, frame.w, x, y, t->nms)) continue;
+                idx[n++] = y*frame.w + x;
+            }
+            free(cidx);
+            free_image(crop);
+        }
+    }
+    if(t->max_corners > 0 && n > t->max_corners) n = track_budget(t, frame, idx, n);
+
+    track_reset(t, frame, idx, n);
+    free(idx);
+    free(first);
+    free(last);
+    free(kept);
+    free(changed);
+    free_image(t->prev);
+    free_image(t->prev_grad);
+    t->prev = grey;
+    t->prev_grad = grad;
+    return cells;
+}
+
+#ifdef OPENCV
+// Tracks corners through a video file and prints how much work each
+// frame needed.
+// char *file: video to read.
+// int show: draw the corners in a window as well.
+void track_corners_video(const char *file, DETECTOR det, float sigma, float thresh, int nms,
+        int max_corners, int refresh, float change, int radius, int show)
+{
+    void *cap = open_video_stream(file, 0, 0, 0, 0);
+    if(!cap){
+        fprintf(stderr, "Couldn't open video %s\n", file);
+        return;
+    }
+    corner_tracker t = make_corner_tracker(det, sigma, thresh, nms, max_corners, refresh, change, radius);
+    if(show) make_window("Tracking", 1280, 720, 0);
+    int f;
+    for(f = 0; ; ++f){
+        image im = get_image_from_stream(cap);
+        if(!im.data) break;
+        clock_t start = clock();
+        int cells = track_corners(&t, im);
+        double sec = (double)(clock() - start)/CLOCKS_PER_SEC;
+        printf("frame %d: %d corners, %d cells re-detected, %f seconds\n", f, t.corners.n, cells, sec);
+        if(show){
+            descriptor *d = descriptor_set_view(t.corners);
+            mark_corners(im, d, t.corners.n);
+            free(d);
+            show_image(im, "Tracking", 1);
+        }
+        free_image(im);
+    }
+    free_corner_tracker(t);
+}
+#endif
@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/***************************** Perspective warp *************************
+  Every canvas pixel (u, v) looks up H*(u+dx, v+dy) in the source image.
+  Along a scanline the homogeneous coordinates X, Y, W are affine in u,
+  so a row only needs its starting point and the first column of H as a
+  step. With AVX2, 8 pixels are projected at once, the bilinear taps and
+  weights are computed once per pixel, and every channel reuses them
+  through masked gathers. Rows are independent and run in parallel.
+************************************************************************/
+
+// Scalar bilinear sample of every channel at (x, y), clamped at borders.
+static inline void warp_pixel(image src, image dst, int o, float x, float y)
+{
+    int x0 = (int)x, y0 = (int)y;
+    int x1 = MIN(x0 + 1, src.w - 1);
+    int y1 = MIN(y0 + 1, src.h - 1);
+    float fx = x - x0, fy = y - y0;
+    float w00 = (1 - fx)*(1 - fy), w01 = fx*(1 - fy);
+    float w10 = (1 - fx)*fy, w11 = fx*fy;
+    int i00 = y0*src.w + x0, i01 = y0*src.w + x1;
+    int i10 = y1*src.w + x0, i11 = y1*src.w + x1;
+    int k;
+    for(k = 0; k < dst.c; ++k){
+        float *s = src.data + MIN(k, src.c - 1)*src.w*src.h;
+        dst.data[k*dst.w*dst.h + o] = w00*s[i00] + w01*s[i01] + w10*s[i10] + w11*s[i11];
+    }
+}
+
+// Warps a source image into part of a destination image.
+// image src: image to sample from.
+// matrix H: 3x3 homography from canvas coordinates (offset by dx, dy)
+//           to source coordinates.
+// image dst: canvas to write into, pixels that map outside src are left alone.
+// int dx, dy: offset of the canvas origin in H's input coordinates.
+// int x0, y0, x1, y1: canvas rectangle to fill, clipped to dst.
+void warp_perspective(image src, matrix H, image dst, int dx, int dy, int x0, int y0, int x1, int y1)
+{
+    assert(H.rows == 3 && H.cols == 3);
+    double h[9];
+    int i;
+    for(i = 0; i < 9; ++i) h[i] = H.data[i/3][i%3];
+    x0 = MAX(x0, 0);
+    y0 = MAX(y0, 0);
+    x1 = MIN(x1, dst.w);
+    y1 = MIN(y1, dst.h);
+    float bw = src.w, bh = src.h;
+
+    int v;
+    #pragma omp parallel for schedule(dynamic, 8)
+    for(v = y0; v < y1; ++v){
+        double Y = v + dy;
+        double rx = h[1]*Y + h[2];
+        double ry = h[4]*Y + h[5];
+        double rw = h[7]*Y + h[8];
+        int u = x0;
+#ifdef __AVX2__
+        __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256 sx = _mm256_set1_ps(h[0]);
+        __m256 sy = _mm256_set1_ps(h[3]);
+        __m256 sw = _mm256_set1_ps(h[6]);
+        __m256 zero = _mm256_setzero_ps();
+        __m256 one = _mm256_set1_ps(1);
+        __m256 vbw = _mm256_set1_ps(bw);
+        __m256 vbh = _mm256_set1_ps(bh);
+        __m256i maxx = _mm256_set1_epi32(src.w - 1);
+        __m256i maxy = _mm256_set1_epi32(src.h - 1);
+        __m256i stride = _mm256_set1_epi32(src.w);
+        __m256i ione = _mm256_set1_epi32(1);
+        for(; u + 8 <= x1; u += 8){
+            double X = u + dx;
+            __m256 px = _mm256_add_ps(_mm256_set1_ps(h[0]*X + rx), _mm256_mul_ps(sx, lane));
+            __m256 py = _mm256_add_ps(_mm256_set1_ps(h[3]*X + ry), _mm256_mul_ps(sy, lane));
+            __m256 pw = _mm256_add_ps(_mm256_set1_ps(h[6]*X + rw), _mm256_mul_ps(sw, lane));
+            px = _mm256_div_ps(px, pw);
+            py = _mm256_div_ps(py, pw);
+            __m256 m = _mm256_and_ps(_mm256_cmp_ps(px, zero, _CMP_GE_OQ), _mm256_cmp_ps(py, zero, _CMP_GE_OQ));
+            m = _mm256_and_ps(m, _mm256_cmp_ps(px, vbw, _CMP_LT_OQ));
+            m = _mm256_and_ps(m, _mm256_cmp_ps(py, vbh, _CMP_LT_OQ));
+            if(_mm256_testz_ps(m, m)) continue;
+            // Keep masked-off lanes at a safe coordinate before converting.
+            px = _mm256_and_ps(px, m);
+            py = _mm256_and_ps(py, m);
+            __m256 fx0 = _mm256_floor_ps(px);
+            __m256 fy0 = _mm256_floor_ps(py);
+            __m256 fx = _mm256_sub_ps(px, fx0);
+            __m256 fy = _mm256_sub_ps(py, fy0);
+            __m256i ix0 = _mm256_cvttps_epi32(fx0);
+            __m256i iy0 = _mm256_cvttps_epi32(fy0);
+            __m256i ix1 = _mm256_min_epi32(_mm256_add_epi32(ix0, ione), maxx);
+            __m256i iy1 = _mm256_min_epi32(_mm256_add_epi32(iy0, ione), maxy);
+            __m256i r0 = _mm256_mullo_epi32(iy0, stride);
+            __m256i r1 = _mm256_mullo_epi32(iy1, stride);
+            __m256i i00 = _mm256_add_epi32(r0, ix0), i01 = _mm256_add_epi32(r0, ix1);
+            __m256i i10 = _mm256_add_epi32(r1, ix0), i11 = _mm256_add_epi32(r1, ix1);
+            __m256 gx = _mm256_sub_ps(one, fx), gy = _mm256_sub_ps(one, fy);
+            __m256 w00 = _mm256_mul_ps(gx, gy), w01 = _mm256_mul_ps(fx, gy);
+            __m256 w10 = _mm256_mul_ps(gx, fy), w11 = _mm256_mul_ps(fx, fy);
+            __m256i mi = _mm256_castps_si256(m);
+            int k;
+            for(k = 0; k < dst.c; ++k){
+                float *s = src.data + MIN(k, src.c - 1)*src.w*src.h;
+                __m256 val = _mm256_mul_ps(w00, _mm256_i32gather_ps(s, i00, 4));
+                val = _mm256_add_ps(val, _mm256_mul_ps(w01, _mm256_i32gather_ps(s, i01, 4)));
+                val = _mm256_add_ps(val, _mm256_mul_ps(w10, _mm256_i32gather_ps(s, i10, 4)));
+                val = _mm256_add_ps(val, _mm256_mul_ps(w11, _mm256_i32gather_ps(s, i11, 4)));
+                _mm256_maskstore_ps(dst.data + k*dst.w*dst.h + v*dst.w + u, mi, val);
+            }
+        }
+#endif
+        for(; u < x1; ++u){
+            double X = u + dx;
+            double w = h[6]*X + rw;
+            float px = (h[0]*X + rx)/w;
+            float py = (h[3]*X + ry)/w;
+            if(px >= 0 && py >= 0 && px < bw && py < bh){
+                warp_pixel(src, dst, v*dst.w + u, px, py);
+            }
+        }
+    }
+}
@@ -19,6 +19,18 @@ typedef struct{
     float *data;
 } image;
 
+// An 8-bit image, same layout as image.
+typedef struct{
+    int w,h,c;
+    unsigned char *data;
+} image_u8;
+
+// A lookup table from 8-bit values to floats.
+// float v[256]: output for each input value.
+typedef struct{
+    float v[256];
+} lut;
+
 // A 2d point.
 // float x, y: the coordinates of the point.
 typedef struct{
@@ -45,6 +57,141 @@ typedef struct{
     float distance;
 } match;
 
+// A 3x3 homography held by value.
+// double h[9]: entries in row major order, h[3*row + col].
+typedef struct{
+    double h[9];
+} homography;
+
+// Transforms between images, simplest first, see fit_motion.
+typedef enum{TRANSLATION, SIMILARITY, AFFINE, HOMOGRAPHY} MOTION;
+
+// Points of a list of matches split into one array per coordinate.
+// int n: number of matches.
+// float *px, *py, *qx, *qy: coordinates of p and q, 32-byte aligned,
+//                           all in one block that starts at px.
+typedef struct{
+    int n;
+    float *px, *py, *qx, *qy;
+} match_points;
+
+// Descriptors of one image stored together in a single aligned block.
+// int n: number of descriptors.
+// int size: floats per descriptor.
+// int stride: floats from one row to the next, rows are zero padded.
+// point *p: keypoint of each row.
+// float *data: n*stride floats, row i starts at data + i*stride.
+typedef struct{
+    int n, size, stride;
+    point *p;
+    float *data;
+} descriptor_set;
+
+#define BINARY_BITS 256
+#define BINARY_WORDS (BINARY_BITS/64)
+
+// Binary descriptors of one image, BINARY_BITS bits each.
+// int n: number of descriptors.
+// point *p: keypoint of each descriptor.
+// unsigned long long *bits: BINARY_WORDS words per descriptor, 32-byte aligned.
+typedef struct{
+    int n;
+    point *p;
+    unsigned long long *bits;
+} binary_set;
+
+// Corner detectors for panorama_image and find_and_draw_matches.
+typedef enum{HARRIS, FAST9, FAST12} DETECTOR;
+
+// Node of a k-d tree: splits on dim at split into children a and b, or
+// for a leaf (dim < 0) holds the points in index[a, b).
+typedef struct{
+    int dim;
+    float split;
+    int a, b;
+} kd_node;
+
+// Randomized k-d trees over a descriptor set, see make_kd_forest.
+// descriptor_set set: indexed descriptors, not owned by the forest.
+// int **index: order of the points in each tree.
+// kd_node **node: nodes of each tree, the root first.
+// int *nodes: number of nodes in each tree.
+typedef struct{
+    descriptor_set set;
+    int trees;
+    int **index;
+    kd_node **node;
+    int *nodes;
+} kd_forest;
+
+// Corners followed from frame to frame of a video, see track_corners.
+typedef struct{
+    DETECTOR det;
+    float sigma, thresh;
+    int nms, max_corners;
+    int refresh;
+    float change;
+    int radius;
+    int frame;
+    image prev, prev_grad;
+    descriptor_set corners;
+} corner_tracker;
+
+// Product-quantised descriptors of many images, see make_pq_database.
+// int n: number of descriptors.
+// int size: floats per original descriptor.
+// int m: subspaces, 4 bits each, so a descriptor takes m/2 bytes.
+// int lists: number of coarse cells, one inverted list each.
+// int images: number of images the descriptors came from.
+// int blocks: lists are stored in blocks of 32 slots.
+// int runs: number of runs of slots from one image.
+// const float *coarse: lists*size cell centres.
+// const float *centroids: 16 centroids per subspace, 16*size floats.
+// const int *start: first block of each list, lists+1 entries.
+// const int *end: one past the last filled slot of each list.
+// const int *run_slot, *run_image: first slot and image of each run.
+// const unsigned short *xy: pixel x and y of the keypoint in each slot.
+// const unsigned char *codes: m/2 bytes per slot, by subspace pair then slot.
+// void *base: block all of the above point into, allocated or mapped.
+typedef struct{
+    int n, size, m, lists, images, blocks, runs;
+    const float *coarse;
+    const float *centroids;
+    const int *start;
+    const int *end;
+    const int *run_slot;
+    const int *run_image;
+    const unsigned short *xy;
+    const unsigned char *codes;
+    void *base;
+    size_t bytes;
+    int mapped;
+} pq_database;
+
+// Matches from image a to image b of a match_graph.
+// int a, b: image indexes, a < b.
+// int score: screening matches that got the pair kept.
+// int n: number of matches.
+// match *m: matches, p in image a and q in image b.
+typedef struct{
+    int a, b;
+    int score;
+    int n;
+    match *m;
+} match_edge;
+
+// Matches between the likely pairs of a set of images, see make_match_graph.
+// int images: number of images.
+// descriptor_set *sets: descriptors of each image.
+// int edges: number of pairs that were matched.
+// match_edge *edge: the matched pairs.
+typedef struct{
+    int images;
+    descriptor_set *sets;
+    int edges;
+    match_edge *edge;
+} match_graph;
+
 // Basic operations
 float get_pixel(image im, int x, int y, int c);
 void set_pixel(image im, int x, int y, int c, float v);
@@ -61,6 +208,34 @@ int same_image(image a, image b, float eps);
 image sub_image(image a, image b);
 image add_image(image a, image b);
 
+// Point-operation pipelines
+typedef enum{OP_SHIFT, OP_SCALE, OP_CLAMP, OP_FEATURE_NORMALIZE, OP_L1_NORMALIZE} POINTOP;
+
+// A single recorded point operation.
+// POINTOP op: which operation.
+// int c: channel it applies to, -1 for every channel.
+// float v: amount to shift or scale by.
+typedef struct{
+    POINTOP op;
+    int c;
+    float v;
+} pointop;
+
+// A chain of point operations, executed together by run_pointop_pipeline.
+typedef struct{
+    int n;
+    pointop *ops;
+} pointop_pipeline;
+
+pointop_pipeline make_pointop_pipeline();
+void pipeline_shift(pointop_pipeline *p, int c, float v);
+void pipeline_scale(pointop_pipeline *p, int c, float v);
+void pipeline_clamp(pointop_pipeline *p);
+void pipeline_feature_normalize(pointop_pipeline *p);
+void pipeline_l1_normalize(pointop_pipeline *p);
+void run_pointop_pipeline(pointop_pipeline p, image im);
+void free_pointop_pipeline(pointop_pipeline p);
+
 // Loading and saving
 image make_image(int w, int h, int c);
 image load_image(char *filename);
@@ -69,6 +244,21 @@ void save_image_binary(image im, const char *fname);
 image load_image_binary(const char *fname);
 void save_png(image im, const char *name);
 void free_image(image im);
+image_u8 make_image_u8(int w, int h, int c);
+image_u8 load_image_u8(char *filename);
+image_u8 image_to_u8(image im);
+void free_image_u8(image_u8 im);
+
+// Lookup tables
+lut make_lut(float (*f)(float v, void *p), void *p);
+lut make_identity_lut();
+lut make_gamma_lut(float gamma);
+lut make_threshold_lut(float thresh);
+lut make_contrast_lut(float gain, float mid);
+image apply_lut(image_u8 im, lut l);
+image apply_channel_luts(image_u8 im, lut *l);
+void apply_lut_u8(image_u8 im, lut l);
+image lut_grayscale(image_u8 im, float r, float g, float b);
 
 // Resizing
 float nn_interpolate(image im, float x, float y, int c);
@@ -92,26 +282,91 @@ image colorize_sobel(image im);
 image smooth_image(image im, float sigma);
 image apply_median_filter(image im, int kernel_size);
 image apply_bilateral_filter(image im, float sigma1, float sigma2);
+image apply_bilateral_filter_exact(image im, float sigma1, float sigma2);
 
 // Harris and Stitching
 image structure_matrix(image im, float sigma);
 image cornerness_response(image S);
+image harris_response(image im, float sigma);
+image max_filter_image(image im, int w);
+image nms_image(image im, int w);
+int *nms_candidates(image im, int w, float thresh, int *n);
 point make_point(float x, float y);
 descriptor make_descriptor(image im, int i);
+descriptor describe_index(image im, int i);
 point project_point(matrix H, point p);
+homography matrix_to_homography(matrix H);
+matrix homography_to_matrix(homography h);
+point homography_project(homography H, point p);
+match_points make_match_points(match *m, int n);
+void free_match_points(match_points s);
+int count_inliers(homography H, match_points s, float thresh);
+int homography_inliers(homography H, match *m, int n, float thresh);
+int fit_homography(match *m, int n, homography *H);
 matrix compute_homography(match *matches, int n);
 int model_inliers(matrix H, match *m, int n, float thresh);
 image combine_images(image a, image b, matrix H);
+void warp_perspective(image src, matrix H, image dst, int dx, int dy, int x0, int y0, int x1, int y1);
+float l1_distance(float *a, float *b, int n);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
+match *match_descriptors_filtered(descriptor *a, int an, descriptor *b, int bn, float ratio, int mutual, int *mn);
+match *match_descriptors_blocked(descriptor *a, int an, descriptor *b, int bn, float ratio, int mutual, int *mn);
+kd_forest make_kd_forest(descriptor_set s, int trees);
+void free_kd_forest(kd_forest f);
+match *match_kd_forest(kd_forest f, descriptor_set a, int checks, int *mn);
+match *match_descriptors_ann(descriptor *a, int an, descriptor *b, int bn, int trees, int checks, int *mn);
+pq_database make_pq_database(descriptor_set *sets, int count, int m, int lists);
+void free_pq_database(pq_database db);
+void save_pq_database(pq_database db, const char *fname);
+pq_database load_pq_database(const char *fname);
+int pq_database_image(pq_database db, int slot);
+point pq_database_point(pq_database db, int slot);
+match *match_pq_database(pq_database db, descriptor_set a, int probes, float ratio, int *mn);
+match_graph make_match_graph(image *ims, int n, DETECTOR det, float sigma, float thresh, int nms, int max_corners, float ratio, int mutual, int neighbours);
+void free_match_graph(match_graph g);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
-image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, int draw);
+descriptor *harris_corner_detector_budget(image im, float sigma, float thresh, int nms, int max_corners, int *n);
+int *anms_select(image R, int *idx, int n, int k, int *kept);
+image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, int draw, int max_corners, DETECTOR det, float ratio, int mutual, float confidence, float explain);
 void free_descriptors(descriptor *d, int n);
+descriptor_set make_descriptor_set(int n, int size);
+void free_descriptor_set(descriptor_set s);
+descriptor_set descriptors_to_set(descriptor *d, int n);
+descriptor *descriptor_set_view(descriptor_set s);
+descriptor *set_to_descriptors(descriptor_set s);
+void save_descriptor_set(descriptor_set s, const char *fname);
+descriptor_set load_descriptor_set(const char *fname);
+descriptor_set describe_corners(image im, int *idx, int n, int normalize);
+int *harris_corner_indexes(image im, float sigma, float thresh, int nms, int max_corners, int *n);
+descriptor_set harris_corner_set(image im, float sigma, float thresh, int nms, int max_corners, int normalize);
+image fast_score(image im, float thresh, int arc);
+int *fast_corner_indexes(image im, float thresh, int arc, int nms, int max_corners, int *n);
+descriptor_set fast_corner_set(image im, float thresh, int arc, int nms, int max_corners, int normalize);
+descriptor *fast_corner_detector(image im, float thresh, int arc, int nms, int *n);
+int *detect_corner_indexes(image im, DETECTOR det, float sigma, float thresh, int nms, int max_corners, int *n);
+descriptor_set detect_corner_set(image im, DETECTOR det, float sigma, float thresh, int nms, int max_corners);
+descriptor *detect_corners(image im, DETECTOR det, float sigma, float thresh, int nms, int max_corners, int *n);
+binary_set make_binary_set(int n);
+void free_binary_set(binary_set s);
+binary_set describe_binary(image im, int *idx, int n);
+binary_set detect_binary_set(image im, DETECTOR det, float sigma, float thresh, int nms, int max_corners);
+match *match_binary(binary_set a, binary_set b, int *mn);
+corner_tracker make_corner_tracker(DETECTOR det, float sigma, float thresh, int nms, int max_corners, int refresh, float change, int radius);
+void free_corner_tracker(corner_tracker t);
+int track_corners(corner_tracker *t, image frame);
 image cylindrical_project(image im, float f);
 void mark_corners(image im, descriptor *d, int n);
 void find_and_mark_corners(image im, float sigma, float thresh, int nms);
 image mark_matches(image a, image b, match *matches, int n, int inliers);
 image find_and_mark_matches(image a, image b, float sigma, float thresh, int nms);
+image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms, DETECTOR det);
 matrix RANSAC(match *m, int n, float thresh, int k, int cutoff);
+matrix PROSAC(match *m, int n, float thresh, int k, float confidence, int *iters);
+matrix RANSAC_parallel(match *m, int n, float thresh, int k, int cutoff, unsigned long long seed);
+matrix RANSAC_motion(match *m, int n, MOTION model, float thresh, int k, int cutoff, unsigned long long seed);
+matrix RANSAC_select(match *m, int n, float thresh, int k, int cutoff, float explain, unsigned long long seed, MOTION *model);
+int motion_sample(MOTION model);
+int fit_motion(match *m, int n, MOTION model, homography *H);
 int model_inliers(matrix H, match *m, int n, float thresh);
 image combine_images(image a, image b, matrix H);
 int match_compare(const void *a, const void *b);
@@ -130,6 +385,7 @@ void *open_video_stream(const char *f, int c, int w, int h, int fps);
 image get_image_from_stream(void *p);
 void make_window(char *name, int w, int h, int fullscreen);
 int show_image(image im, const char *name, int ms);
+void track_corners_video(const char *file, DETECTOR det, float sigma, float thresh, int nms, int max_corners, int refresh, float change, int radius, int show);
 #endif
 
 // Machine Learning
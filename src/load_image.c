@@ -96,6 +96,56 @@ image load_image(char *filename)
     return out;
 }
 
+image_u8 make_image_u8(int w, int h, int c)
+{
+    image_u8 out;
+    out.w = w;
+    out.h = h;
+    out.c = c;
+    out.data = calloc(h*w*c, sizeof(unsigned char));
+    return out;
+}
+
+// Load an image keeping the raw 8-bit values, laid out like a float image.
+image_u8 load_image_u8(char *filename)
+{
+    int w, h, c;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        exit(0);
+    }
+    int i,k;
+    int oc = c == 4 ? 3 : c;
+    image_u8 im = make_image_u8(w, h, oc);
+    for(k = 0; k < oc; ++k){
+        for(i = 0; i < w*h; ++i){
+            im.data[i + w*h*k] = data[k + c*i];
+        }
+    }
+    free(data);
+    return im;
+}
+
+// Quantize a float image to 8 bits, the same way save_image does.
+image_u8 image_to_u8(image im)
+{
+    image_u8 out = make_image_u8(im.w, im.h, im.c);
+    int i;
+    for(i = 0; i < im.w*im.h*im.c; ++i){
+        float v = im.data[i];
+        v = v < 0 ? 0 : (v > 1 ? 1 : v);
+        out.data[i] = (unsigned char) roundf(255*v);
+    }
+    return out;
+}
+
+void free_image_u8(image_u8 im)
+{
+    free(im.data);
+}
+
 void save_image_binary(image im, const char *fname)
 {
     FILE *fp = fopen(fname, "wb");
@@ -6,6 +6,9 @@
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 float avg_diff(image a, image b)
@@ -285,6 +288,64 @@ void test_multiple_resize()
     free_image(gt);
 }
 
+void test_pointop_pipeline()
+{
+    image im = load_image("data/dog.jpg");
+    image c = copy_image(im);
+    shift_image(im, 0, .2);
+    scale_image(im, 1, 1.7);
+    scale_image(im, 2, -.5);
+    clamp_image(im);
+    feature_normalize(im);
+    l1_normalize(im);
+
+    pointop_pipeline p = make_pointop_pipeline();
+    pipeline_shift(&p, 0, .2);
+    pipeline_clamp(&p);
+    pipeline_scale(&p, 1, 1.7);
+    pipeline_scale(&p, 2, -.5);
+    pipeline_clamp(&p);
+    pipeline_feature_normalize(&p);
+    pipeline_l1_normalize(&p);
+    run_pointop_pipeline(p, c);
+    TEST(same_image(c, im, EPS));
+    free_pointop_pipeline(p);
+    free_image(im);
+    free_image(c);
+}
+
+void test_lut()
+{
+    image im = load_image("data/dog.jpg");
+    image_u8 im8 = load_image_u8("data/dog.jpg");
+
+    image gamma = apply_lut(im8, make_gamma_lut(2.2));
+    image gt = copy_image(im);
+    int i;
+    for(i = 0; i < gt.w*gt.h*gt.c; ++i) gt.data[i] = powf(gt.data[i], 2.2);
+    TEST(same_image(gamma, gt, EPS));
+
+    image gray = lut_grayscale(im8, 0.299, 0.587, .114);
+    image gray_gt = rgb_to_grayscale(im);
+    TEST(same_image(gray, gray_gt, EPS));
+
+    // Same binarisation as filter_noise.
+    apply_lut_u8(im8, make_threshold_lut(.3));
+    for(i = 0; i < im.w*im.h*im.c; ++i){
+        if(im.data[i] > .3) im.data[i] = 1;
+    }
+    image bw = apply_lut(im8, make_identity_lut());
+    TEST(same_image(bw, im, EPS));
+
+    free_image(im);
+    free_image_u8(im8);
+    free_image(gamma);
+    free_image(gt);
+    free_image(gray);
+    free_image(gray_gt);
+    free_image(bw);
+}
+
 void test_hw1()
 {
     test_nn_interpolate();
@@ -292,6 +353,8 @@ void test_hw1()
     test_bl_interpolate();
     test_bl_resize();
     test_multiple_resize();
+    test_pointop_pipeline();
+    test_lut();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
@@ -467,6 +530,78 @@ void test_sobel(){
     free(res);
 }
 
+int float_compare(const void *a, const void *b)
+{
+    float fa = *(float *)a;
+    float fb = *(float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+image median_reference(image im, int r)
+{
+    image out = make_image(im.w, im.h, im.c);
+    float *win = calloc((2*r+1)*(2*r+1), sizeof(float));
+    int i, j, k, dx, dy;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < im.h; ++j){
+            for(i = 0; i < im.w; ++i){
+                int n = 0;
+                for(dy = -r; dy <= r; ++dy){
+                    for(dx = -r; dx <= r; ++dx){
+                        win[n++] = get_pixel(im, i+dx, j+dy, k);
+                    }
+                }
+                qsort(win, n, sizeof(float), float_compare);
+                set_pixel(out, i, j, k, win[n/2]);
+            }
+        }
+    }
+    free(win);
+    return out;
+}
+
+void test_median_filter()
+{
+    image im = load_image("data/dog.jpg");
+    image small = nn_resize(im, 141, 263);
+    // Quantise so the histogram path is exact too.
+    image_u8 q = image_to_u8(small);
+    image qim = apply_lut(q, make_identity_lut());
+    int sizes[] = {3, 5, 9, 15};
+    int i;
+    for(i = 0; i < 4; ++i){
+        image med = apply_median_filter(qim, sizes[i]);
+        image gt = median_reference(qim, sizes[i]/2);
+        TEST(same_image(med, gt, EPS));
+        free_image(med);
+        free_image(gt);
+    }
+    free_image(im);
+    free_image(small);
+    free_image_u8(q);
+    free_image(qim);
+}
+
+void test_bilateral_filter()
+{
+    image im = load_image("data/dog.jpg");
+    image small = nn_resize(im, 192, 144);
+    image fast = apply_bilateral_filter(small, 3, .1);
+    image exact = apply_bilateral_filter_exact(small, 3, .1);
+    float err = 0, smoothing = 0;
+    int i;
+    for(i = 0; i < small.w*small.h*small.c; ++i){
+        err += fabsf(fast.data[i] - exact.data[i]);
+        smoothing += fabsf(small.data[i] - exact.data[i]);
+    }
+    TEST(err < .01*small.w*small.h*small.c);
+    TEST(err < .5*smoothing);
+    free_image(im);
+    free_image(small);
+    free_image(fast);
+    free_image(exact);
+}
+
 void test_hw2()
 {
     test_gaussian_filter();
@@ -478,6 +613,8 @@ void test_hw2()
     test_hybrid_image();
     test_frequency_image();
     test_sobel();
+    test_median_filter();
+    test_bilateral_filter();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
@@ -531,6 +668,277 @@ void test_projection()
     free_matrix(H);
 }
 
+void test_fit_homography()
+{
+    homography H = {{.95, .04, 1200, -.03, 1.05, -300, 2e-5, -1e-5, 1}};
+    homography G;
+    int i, j;
+    srand(19);
+
+    // Three points on a line can't fix a homography.
+    match m[64];
+    for(i = 0; i < 4; ++i){
+        m[i].p = make_point(100*i, 50*i + 7);
+        m[i].q = homography_project(H, m[i].p);
+    }
+    m[3].p = make_point(900, 20);
+    m[3].q = homography_project(H, m[3].p);
+    TEST(!fit_homography(m, 4, &G));
+    matrix none = compute_homography(m, 4);
+    TEST(!none.data);
+
+    // Exact matches far from the origin are reproduced exactly, noisy
+    // ones closely, by the least squares fit.
+    int ok = 1;
+    for(i = 0; i < 64; ++i){
+        m[i].p = make_point(3000 + rand()%4000, 2000 + rand()%3000);
+        m[i].q = homography_project(H, m[i].p);
+    }
+    TEST(fit_homography(m, 4, &G));
+    for(i = 0; i < 64; ++i){
+        point r = homography_project(G, m[i].p);
+        ok &= fabsf(r.x - m[i].q.x) < .01 && fabsf(r.y - m[i].q.y) < .01;
+    }
+    TEST(ok);
+    for(i = 0; i < 64; ++i){
+        m[i].q.x += (float)rand()/RAND_MAX - .5;
+        m[i].q.y += (float)rand()/RAND_MAX - .5;
+    }
+    TEST(fit_homography(m, 64, &G));
+    ok = 1;
+    for(j = 0; j < 64; ++j){
+        point p = make_point(3000 + rand()%4000, 2000 + rand()%3000);
+        point a = homography_project(G, p), b = homography_project(H, p);
+        ok &= fabsf(a.x - b.x) < 1 && fabsf(a.y - b.y) < 1;
+    }
+    TEST(ok);
+}
+
+void test_prosac()
+{
+    // 300 matches, 40% of them on a homography, the rest random. Sorted
+    // like real matches, most of the inliers come first.
+    homography H = {{.97, .02, 240, -.01, 1.01, 12, 1e-5, 2e-5, 1}};
+    int n = 300, i, pass;
+    srand(21);
+    match *m = calloc(n, sizeof(match));
+    for(i = 0; i < n; ++i){
+        int inlier = i < 80 ? i%8 != 0 : i%5 == 0;
+        m[i].p = make_point(rand()%640, rand()%480);
+        m[i].q = inlier ? homography_project(H, m[i].p) : make_point(rand()%900, rand()%500);
+        m[i].q.x += .5*((float)rand()/RAND_MAX - .5);
+        m[i].distance = i;
+    }
+    int expect = 0;
+    for(i = 0; i < n; ++i) expect += i < 80 ? i%8 != 0 : i%5 == 0;
+    for(pass = 0; pass < 2; ++pass){
+        // Second time the order carries no information.
+        if(pass == 1){
+            for(i = n - 1; i > 0; --i){
+                int j = rand()%(i + 1);
+                match x = m[i]; m[i] = m[j]; m[j] = x;
+            }
+        }
+        int iters = 0;
+        matrix G = PROSAC(m, n, 2, 10000, .99, &iters);
+        int inliers = model_inliers(G, m, n, 2);
+        int ok = 1;
+        for(i = 0; i < 20; ++i){
+            point p = make_point(rand()%640, rand()%480);
+            point a = project_point(G, p), b = homography_project(H, p);
+            ok &= fabsf(a.x - b.x) < 1 && fabsf(a.y - b.y) < 1;
+        }
+        TEST(ok && inliers >= expect - 2);
+        TEST(pass == 0 ? iters < 50 : iters < 1000);
+        free_matrix(G);
+    }
+    free(m);
+
+    // Few matches, so the pool takes in all of them long before k runs
+    // out. The ranking is bad: the top three quarters and the very last
+    // match are outliers, so once the pool holds every match its samples
+    // must stop taking the newest one.
+    n = 40;
+    m = calloc(n, sizeof(match));
+    for(i = 0; i < n; ++i){
+        int inlier = i >= 3*n/4 && i < n - 1;
+        m[i].p = make_point(rand()%640, rand()%480);
+        m[i].q = inlier ? homography_project(H, m[i].p) : make_point(rand()%900, rand()%500);
+        m[i].distance = i;
+    }
+    int iters = 0;
+    matrix G = PROSAC(m, n, 2, 2000, 0, &iters);
+    TEST(iters == 2000);
+    TEST(model_inliers(G, m, n, 2) == n/4 - 1);
+    free_matrix(G);
+    free(m);
+}
+
+void test_ransac_parallel()
+{
+    // Half the matches on a homography, the rest random.
+    homography H = {{1.02, -.03, 180, .02, .98, -20, 2e-5, -1e-5, 1}};
+    int n = 400, i, j;
+    srand(5);
+    match *m = calloc(n, sizeof(match));
+    for(i = 0; i < n; ++i){
+        m[i].p = make_point(rand()%640, rand()%480);
+        m[i].q = i%2 ? homography_project(H, m[i].p) : make_point(rand()%900, rand()%500);
+        m[i].q.y += .5*((float)rand()/RAND_MAX - .5);
+        m[i].ai = i;
+    }
+    match *c = calloc(n, sizeof(match));
+    // Same seed, same homography and order, with one thread or many and
+    // with or without the cutoff.
+#ifdef _OPENMP
+    int threads = omp_get_max_threads();
+#endif
+    int cutoff[2] = {n, 50};
+    for(j = 0; j < 2; ++j){
+        matrix R[2];
+        match *o[2];
+        int t;
+        for(t = 0; t < 2; ++t){
+#ifdef _OPENMP
+            omp_set_num_threads(t ? MAX(threads, 4) : 1);
+#endif
+            o[t] = calloc(n, sizeof(match));
+            memcpy(o[t], m, n*sizeof(match));
+            R[t] = RANSAC_parallel(o[t], n, 2, 2000, cutoff[j], 42);
+        }
+        int same = 1;
+        for(i = 0; i < 9; ++i) same &= R[0].data[i/3][i%3] == R[1].data[i/3][i%3];
+        for(i = 0; i < n; ++i) same &= o[0][i].ai == o[1][i].ai;
+        TEST(same);
+        int inliers = model_inliers(R[0], o[0], n, 2);
+        int front = 1;
+        for(i = 0; i < inliers; ++i) front &= o[0][i].ai%2 == 1;
+        TEST(inliers >= n/2 - 2 && front);
+        free_matrix(R[0]);
+        free_matrix(R[1]);
+        free(o[0]);
+        free(o[1]);
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    // Another seed still finds it.
+    memcpy(c, m, n*sizeof(match));
+    matrix G = RANSAC_parallel(c, n, 2, 2000, n, 7);
+    TEST(model_inliers(G, c, n, 2) >= n/2 - 2);
+    free_matrix(G);
+    free(c);
+    free(m);
+}
+
+void test_motion_models()
+{
+    // Exact fits of each model from its own kind of transform.
+    homography T[4] = {
+        {{1, 0, 31.5, 0, 1, -7.25, 0, 0, 1}},
+        {{.95, -.12, 14, .12, .95, 3, 0, 0, 1}},
+        {{1.1, .05, -9, -.08, .93, 22, 0, 0, 1}},
+        {{1.02, -.03, 180, .02, .98, -20, 2e-5, -1e-5, 1}},
+    };
+    int n = 300, i, t;
+    srand(8);
+    match *m = calloc(n, sizeof(match));
+    for(t = TRANSLATION; t <= HOMOGRAPHY; ++t){
+        for(i = 0; i < n; ++i){
+            m[i].p = make_point(rand()%640, rand()%480);
+            m[i].q = homography_project(T[t], m[i].p);
+        }
+        homography H;
+        TEST(fit_motion(m, motion_sample(t), t, &H));
+        int same = 1;
+        for(i = 0; i < 9; ++i) same &= fabs(H.h[i] - T[t].h[i]) < 1e-3*MAX(1, fabs(T[t].h[i]));
+        TEST(same);
+    }
+    // Collinear points don't pin down an affine transform.
+    for(i = 0; i < 3; ++i){
+        m[i].p = make_point(10*i, 5*i);
+        m[i].q = m[i].p;
+    }
+    homography H;
+    TEST(!fit_motion(m, 3, AFFINE, &H));
+
+    // Each kind of transform with 40% outliers picks its own model, and
+    // only 1% off a homography's inliers with a translation (the field
+    // panorama) stays a translation.
+    for(t = TRANSLATION; t <= HOMOGRAPHY; ++t){
+        for(i = 0; i < n; ++i){
+            m[i].p = make_point(rand()%640, rand()%480);
+            m[i].q = i%5 < 3 ? homography_project(T[t], m[i].p) : make_point(rand()%900, rand()%500);
+            m[i].q.x += .5*((float)rand()/RAND_MAX - .5);
+            m[i].ai = i;
+        }
+        MOTION model;
+        matrix R = RANSAC_select(m, n, 2, 10000, 30, .95, 3, &model);
+        TEST(model == t);
+        int inliers = model_inliers(R, m, n, 2);
+        int front = 1;
+        for(i = 0; i < inliers; ++i) front &= m[i].ai%5 < 3;
+        TEST(inliers >= 3*n/5 - 2 && front);
+        free_matrix(R);
+    }
+
+    // combine_images takes a translation as well: b is a shifted 40
+    // pixels left in a, so the canvas grows to end with b's last column.
+    image a = load_image("data/dog.jpg");
+    image b = make_image(a.w, a.h, a.c);
+    int x, y, k;
+    for(k = 0; k < a.c; ++k) for(y = 0; y < a.h; ++y) for(x = 0; x < a.w - 40; ++x){
+        set_pixel(b, x, y, k, get_pixel(a, x + 40, y, k));
+    }
+    homography S = {{1, 0, -40, 0, 1, 0, 0, 0, 1}};
+    matrix M = homography_to_matrix(S);
+    image c = combine_images(a, b, M);
+    TEST(c.w == a.w + 39 && c.h == a.h);
+    TEST(within_eps(get_pixel(c, c.w - 1, 10, 1), get_pixel(b, b.w - 1, 10, 1), EPS));
+    free_matrix(M);
+    free_image(a);
+    free_image(b);
+    free_image(c);
+    free(m);
+}
+
+void test_count_inliers()
+{
+    // Points moved by a known homography, every third one pushed well
+    // outside the threshold. Lengths cover the vector blocks and the tail.
+    homography H = {{1.02, .03, 15, -.02, .98, -7, 1e-4, -5e-5, 1}};
+    matrix Hm = homography_to_matrix(H);
+    int sizes[3] = {3, 8, 101};
+    int t, i;
+    srand(17);
+    for(t = 0; t < 3; ++t){
+        int n = sizes[t], expect = 0;
+        match *m = calloc(n, sizeof(match));
+        for(i = 0; i < n; ++i){
+            m[i].p = make_point(rand()%640, rand()%480);
+            m[i].q = homography_project(H, m[i].p);
+            m[i].q.x += (float)rand()/RAND_MAX - .5;
+            if(i%3 == 0) m[i].q.y += 5 + rand()%20;
+            else ++expect;
+        }
+        match_points s = make_match_points(m, n);
+        TEST(count_inliers(H, s, 2) == expect);
+        TEST(model_inliers(Hm, m, n, 2) == expect);
+        int ok = 1;
+        for(i = 0; i < n; ++i){
+            point r = project_point(Hm, m[i].p);
+            float d = sqrtf((r.x - m[i].q.x)*(r.x - m[i].q.x) + (r.y - m[i].q.y)*(r.y - m[i].q.y));
+            ok &= i < expect ? d < 2 : d >= 2;
+        }
+        TEST(ok);
+        free_match_points(s);
+        free(m);
+    }
+    point p = make_point(3.14, 1.59);
+    TEST(same_point(project_point(Hm, p), homography_project(H, p), EPS));
+    free_matrix(Hm);
+}
+
 void test_compute_homography()
 {
     match *m = calloc(4, sizeof(match));
@@ -566,12 +974,998 @@ void test_compute_homography()
     free_matrix(Hp);
 }
 
+image nms_reference(image im, int w)
+{
+    image r = copy_image(im);
+    int i, j, dx, dy;
+    for(j = 0; j < im.h; ++j){
+        for(i = 0; i < im.w; ++i){
+            float v = get_pixel(im, i, j, 0);
+            for(dy = -w; dy <= w; ++dy){
+                for(dx = -w; dx <= w; ++dx){
+                    if(get_pixel(im, i+dx, j+dy, 0) > v) set_pixel(r, i, j, 0, -99999);
+                }
+            }
+        }
+    }
+    return r;
+}
+
+void test_nms()
+{
+    srand(1);
+    image im = make_image(97, 61, 1);
+    int i, w;
+    // Few distinct values so there are plenty of ties.
+    for(i = 0; i < im.w*im.h; ++i) im.data[i] = rand()%7;
+    for(w = 0; w < 6; w += 2){
+        image r = nms_image(im, w);
+        image gt = nms_reference(im, w);
+        // Exact compare, same_image's relative eps blows up on -99999.
+        int diff = 0;
+        for(i = 0; i < im.w*im.h; ++i) diff += r.data[i] != gt.data[i];
+        TEST(diff == 0);
+
+        int n = 0, count = 0, ok = 1;
+        int *idx = nms_candidates(im, w, 3, &n);
+        for(i = 0; i < im.w*im.h; ++i){
+            if(gt.data[i] > 3){
+                if(count >= n || idx[count] != i) ok = 0;
+                ++count;
+            }
+        }
+        TEST(ok && count == n);
+        free(idx);
+        free_image(r);
+        free_image(gt);
+    }
+    free_image(im);
+}
+
+void test_warp_perspective()
+{
+    image im = load_image("data/dog.jpg");
+    matrix H = make_identity_homography();
+    H.data[0][0] = .9;   H.data[0][1] = .05; H.data[0][2] = -30;
+    H.data[1][0] = -.04; H.data[1][1] = 1.1; H.data[1][2] = 12;
+    H.data[2][0] = 1e-4; H.data[2][1] = -5e-5;
+    image c = make_image(900, 700, 3);
+    warp_perspective(im, H, c, -20, -10, 0, 0, c.w, c.h);
+    int i, j, k, bad = 0;
+    for(j = 0; j < c.h; ++j){
+        for(i = 0; i < c.w; ++i){
+            double x = i - 20, y = j - 10;
+            double w = H.data[2][0]*x + H.data[2][1]*y + H.data[2][2];
+            double px = (H.data[0][0]*x + H.data[0][1]*y + H.data[0][2])/w;
+            double py = (H.data[1][0]*x + H.data[1][1]*y + H.data[1][2])/w;
+            // Skip pixels too close to the edge to call in or out.
+            if(fabs(px) < 1e-3 || fabs(py) < 1e-3 || fabs(px - im.w) < 1e-3 || fabs(py - im.h) < 1e-3) continue;
+            int inside = px >= 0 && py >= 0 && px < im.w && py < im.h;
+            for(k = 0; k < c.c; ++k){
+                float v = 0;
+                if(inside){
+                    int x0 = floor(px), y0 = floor(py);
+                    float fx = px - x0, fy = py - y0;
+                    v = (1-fx)*(1-fy)*get_pixel(im, x0, y0, k) + fx*(1-fy)*get_pixel(im, x0+1, y0, k)
+                        + (1-fx)*fy*get_pixel(im, x0, y0+1, k) + fx*fy*get_pixel(im, x0+1, y0+1, k);
+                }
+                if(!within_eps(v, get_pixel(c, i, j, k), EPS)) ++bad;
+            }
+        }
+    }
+    TEST(bad == 0);
+    free_matrix(H);
+    free_image(im);
+    free_image(c);
+}
+
+// Largest difference between two images relative to b's largest magnitude.
+float max_rel_diff(image a, image b)
+{
+    float diff = 0, mag = 0;
+    int i;
+    for(i = 0; i < a.w*a.h*a.c; ++i){
+        diff = MAX(diff, fabsf(a.data[i] - b.data[i]));
+        mag = MAX(mag, fabsf(b.data[i]));
+    }
+    return mag > 0 ? diff/mag : diff;
+}
+
+void test_structure_fused()
+{
+    image dog = load_image("data/dog.jpg");
+    image im = nn_resize(dog, 173, 119);
+    image gxf = make_gx_filter();
+    image gyf = make_gy_filter();
+    image gx = convolve_image(im, gxf, 0);
+    image gy = convolve_image(im, gyf, 0);
+    image prod = make_image(im.w, im.h, 3);
+    int i, n = im.w*im.h;
+    for(i = 0; i < n; ++i){
+        prod.data[i] = gx.data[i]*gx.data[i];
+        prod.data[n + i] = gy.data[i]*gy.data[i];
+        prod.data[2*n + i] = gx.data[i]*gy.data[i];
+    }
+    float sigmas[] = {.5, 2, 5};
+    int t;
+    for(t = 0; t < 3; ++t){
+        image gt = smooth_image(prod, sigmas[t]);
+        image s = structure_matrix(im, sigmas[t]);
+        TEST(max_rel_diff(s, gt) < 1e-5);
+        image rgt = cornerness_response(gt);
+        image r = harris_response(im, sigmas[t]);
+        TEST(max_rel_diff(r, rgt) < 1e-4);
+        free_image(gt);
+        free_image(s);
+        free_image(rgt);
+        free_image(r);
+    }
+    free_image(dog);
+    free_image(im);
+    free_image(gxf);
+    free_image(gyf);
+    free_image(gx);
+    free_image(gy);
+    free_image(prod);
+}
+
+// Checks that descriptors match a set row by row, including zero padding.
+int same_descriptors(descriptor *d, int n, descriptor_set s)
+{
+    int i, j;
+    if(s.n != n) return 0;
+    for(i = 0; i < n; ++i){
+        const float *row = s.data + (size_t)i*s.stride;
+        if(d[i].n != s.size || d[i].p.x != s.p[i].x || d[i].p.y != s.p[i].y) return 0;
+        if(memcmp(d[i].data, row, s.size*sizeof(float))) return 0;
+        for(j = s.size; j < s.stride; ++j) if(row[j] != 0) return 0;
+    }
+    return 1;
+}
+
+void test_descriptor_set()
+{
+    image im = load_image("data/dog.jpg");
+    int n = 0;
+    descriptor *d = harris_corner_detector(im, 2, 1, 3, &n);
+    descriptor_set s = descriptors_to_set(d, n);
+    TEST(n > 0 && s.stride % 8 == 0 && s.stride >= s.size && ((size_t)s.data & 31) == 0);
+    TEST(same_descriptors(d, n, s));
+
+    descriptor *v = descriptor_set_view(s);
+    TEST(n > 1 && v[1].data == s.data + s.stride && v[n-1].p.x == d[n-1].p.x);
+    free(v);
+
+    descriptor *c = set_to_descriptors(s);
+    TEST(same_descriptors(c, n, s));
+    free_descriptors(c, n);
+
+    save_descriptor_set(s, "data/descriptor_set.bin");
+    descriptor_set l = load_descriptor_set("data/descriptor_set.bin");
+    remove("data/descriptor_set.bin");
+    TEST(l.size == s.size && l.stride == s.stride && same_descriptors(d, n, l));
+
+    free_descriptor_set(l);
+    free_descriptor_set(s);
+    free_descriptors(d, n);
+    free_image(im);
+}
+
+void test_describe_corners()
+{
+    image dog = load_image("data/dog.jpg");
+    image im = nn_resize(dog, 37, 23);
+    int n = im.w*im.h;
+    int *idx = calloc(n, sizeof(int));
+    int i, j;
+    // Every pixel, so all the border cases are covered.
+    for(i = 0; i < n; ++i) idx[i] = (i*7)%n;
+    descriptor *d = calloc(n, sizeof(descriptor));
+    for(i = 0; i < n; ++i) d[i] = describe_index(im, idx[i]);
+    descriptor_set s = describe_corners(im, idx, n, 0);
+    TEST(same_descriptors(d, n, s));
+
+    descriptor_set u = describe_corners(im, idx, n, 1);
+    int ok = 1;
+    for(i = 0; i < n; ++i){
+        float *a = s.data + (size_t)i*s.stride;
+        float *b = u.data + (size_t)i*u.stride;
+        float norm = 0, len = 0;
+        for(j = 0; j < s.size; ++j) norm += a[j]*a[j];
+        for(j = 0; j < u.size; ++j) len += b[j]*b[j];
+        norm = sqrtf(norm);
+        if(norm > 0 && !within_eps(len, 1, 1e-4)) ok = 0;
+        for(j = 0; j < s.size && norm > 0; ++j){
+            if(!within_eps(b[j]*norm, a[j], 1e-4)) ok = 0;
+        }
+    }
+    TEST(ok);
+
+    free_descriptor_set(s);
+    free_descriptor_set(u);
+    free_descriptors(d, n);
+    free(idx);
+    free_image(im);
+    free_image(dog);
+}
+
+void test_harris_strips()
+{
+    image dog = load_image("data/dog.jpg");
+    image im = nn_resize(dog, 157, 211);
+    int nmss[] = {0, 1, 3, 7};
+    int t, i, p;
+    // Strips are sized by the thread count, so the same corners with 1, 7
+    // and 16 threads.
+#ifdef _OPENMP
+    int threads = omp_get_max_threads();
+    int counts[3] = {1, 7, 16};
+    for(p = 0; p < 3; ++p){
+        omp_set_num_threads(counts[p]);
+#else
+    for(p = 0; p < 1; ++p){
+#endif
+        for(t = 0; t < 4; ++t){
+            // Single pass reference.
+            image R = harris_response(im, 2);
+            int n = 0;
+            int *idx = nms_candidates(R, nmss[t], .001, &n);
+            descriptor_set s = harris_corner_set(im, 2, .001, nmss[t], 0, 0);
+            int ok = s.n == n && n > 0;
+            for(i = 0; ok && i < n; ++i){
+                ok = s.p[i].x == idx[i]%im.w && s.p[i].y == idx[i]/im.w;
+            }
+            TEST(ok);
+
+            int k = n/3, kept = 0;
+            int *sel = anms_select(R, idx, n, k, &kept);
+            descriptor_set b = harris_corner_set(im, 2, .001, nmss[t], k, 0);
+            ok = b.n == kept;
+            for(i = 0; ok && i < kept; ++i){
+                ok = b.p[i].x == sel[i]%im.w && b.p[i].y == sel[i]/im.w;
+            }
+            TEST(ok);
+            free(sel);
+            free(idx);
+            free_descriptor_set(s);
+            free_descriptor_set(b);
+            free_image(R);
+        }
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    free_image(im);
+    free_image(dog);
+}
+
+// Brute force FAST score: largest t such that arc circle pixels in a row
+// are all brighter than p + t or all darker than p - t, 0 if below thresh.
+float fast_reference(image g, int x, int y, float thresh, int arc)
+{
+    static const int dx[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+    static const int dy[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+    float p = g.data[y*g.w + x];
+    float best = -INFINITY;
+    int s, k, corner = 0;
+    for(s = 0; s < 16; ++s){
+        float lo = INFINITY, hi = -INFINITY;
+        int bright = 1, dark = 1;
+        for(k = 0; k < arc; ++k){
+            float v = g.data[(y + dy[(s+k)%16])*g.w + x + dx[(s+k)%16]];
+            if(!(v > p + thresh)) bright = 0;
+            if(!(v < p - thresh)) dark = 0;
+            lo = MIN(lo, v - p);
+            hi = MAX(hi, v - p);
+        }
+        corner |= bright | dark;
+        best = MAX(best, MAX(lo, -hi));
+    }
+    return corner ? best : 0;
+}
+
+void test_fast()
+{
+    image dog = load_image("data/dog.jpg");
+    image im = nn_resize(dog, 203, 131);
+    image g = rgb_to_grayscale(im);
+    int arcs[] = {9, 12};
+    int t, x, y;
+    for(t = 0; t < 2; ++t){
+        image S = fast_score(im, .05, arcs[t]);
+        int diff = 0, corners = 0;
+        for(y = 0; y < im.h; ++y){
+            for(x = 0; x < im.w; ++x){
+                float want = 0;
+                if(x >= 3 && y >= 3 && x < im.w - 3 && y < im.h - 3){
+                    want = fast_reference(g, x, y, .05, arcs[t]);
+                }
+                diff += S.data[y*im.w + x] != want;
+                corners += want > 0;
+            }
+        }
+        TEST(diff == 0 && corners > 0);
+
+        int n = 0;
+        descriptor_set d = detect_corner_set(im, arcs[t] == 9 ? FAST9 : FAST12, 2, .05*255, 3, 0);
+        int *idx = nms_candidates(S, 3, 0, &n);
+        TEST(d.n == n && d.p[n-1].x == idx[n-1]%im.w && d.p[n-1].y == idx[n-1]/im.w);
+        free(idx);
+        free_descriptor_set(d);
+        free_image(S);
+    }
+    free_image(g);
+    free_image(im);
+    free_image(dog);
+}
+
+void test_binary_descriptors()
+{
+    // Patches are only read around the corner, so shifting the image
+    // shifts the descriptors with it.
+    image dog = load_image("data/dog.jpg");
+    image im = nn_resize(dog, 120, 90);
+    image sh = make_image(im.w - 7, im.h - 5, im.c);
+    int i, j, k, x, y;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < sh.h; ++y){
+            for(x = 0; x < sh.w; ++x){
+                set_pixel(sh, x, y, k, get_pixel(im, x + 7, y + 5, k));
+            }
+        }
+    }
+    int n = 0;
+    int a[64], b[64];
+    for(y = 25; y < 60; y += 6){
+        for(x = 25; x < 90; x += 9){
+            a[n] = y*im.w + x;
+            b[n] = (y - 5)*sh.w + x - 7;
+            ++n;
+        }
+    }
+    binary_set da = describe_binary(im, a, n);
+    binary_set db = describe_binary(sh, b, n);
+    TEST(memcmp(da.bits, db.bits, n*BINARY_WORDS*sizeof(unsigned long long)) == 0);
+    int zeros = 0;
+    for(i = 0; i < n; ++i) zeros += da.bits[i*BINARY_WORDS] == 0;
+    TEST(zeros < n);
+
+    // Matcher against brute force on random bits, with repeats for ties.
+    srand(3);
+    binary_set ra = make_binary_set(37), rb = make_binary_set(53);
+    for(i = 0; i < ra.n*BINARY_WORDS; ++i) ra.bits[i] = ((unsigned long long)rand() << 33) ^ rand();
+    for(i = 0; i < rb.n*BINARY_WORDS; ++i) rb.bits[i] = ((unsigned long long)rand() << 33) ^ rand();
+    for(i = 0; i < 10; ++i) memcpy(rb.bits + (20 + i)*BINARY_WORDS, rb.bits + i*BINARY_WORDS, 4*sizeof(unsigned long long));
+    for(i = 0; i < 10; ++i) memcpy(ra.bits + i*BINARY_WORDS, rb.bits + (30 + i)*BINARY_WORDS, 4*sizeof(unsigned long long));
+    for(i = 0; i < ra.n; ++i) ra.p[i] = make_point(i, 0);
+    for(i = 0; i < rb.n; ++i) rb.p[i] = make_point(i, 1);
+    int mn = 0;
+    match *m = match_binary(ra, rb, &mn);
+
+    int *bi = calloc(ra.n, sizeof(int)), *bd = calloc(ra.n, sizeof(int));
+    for(i = 0; i < ra.n; ++i){
+        bd[i] = 1000;
+        for(j = 0; j < rb.n; ++j){
+            int d = 0;
+            for(k = 0; k < BINARY_WORDS; ++k){
+                d += __builtin_popcountll(ra.bits[i*BINARY_WORDS + k] ^ rb.bits[j*BINARY_WORDS + k]);
+            }
+            if(d < bd[i]){
+                bd[i] = d;
+                bi[i] = j;
+            }
+        }
+    }
+    // Every b used once, greedily from the smallest distance, ties by ai.
+    char *used = calloc(rb.n, 1), *done = calloc(ra.n, 1);
+    int ok = 1, count = 0;
+    for(;;){
+        int best = -1;
+        for(i = 0; i < ra.n; ++i){
+            if(!done[i] && (best < 0 || bd[i] < bd[best])) best = i;
+        }
+        if(best < 0) break;
+        done[best] = 1;
+        if(used[bi[best]]) continue;
+        used[bi[best]] = 1;
+        if(count >= mn || m[count].ai != best || m[count].bi != bi[best] ||
+                m[count].distance != bd[best] || m[count].q.x != bi[best]) ok = 0;
+        ++count;
+    }
+    TEST(ok && count == mn);
+
+    free(m);
+    free(bi);
+    free(bd);
+    free(used);
+    free(done);
+    free_binary_set(ra);
+    free_binary_set(rb);
+    free_binary_set(da);
+    free_binary_set(db);
+    free_image(sh);
+    free_image(im);
+    free_image(dog);
+}
+
+typedef struct{
+    float r2, v;
+    int i;
+} anms_ref;
+
+int anms_ref_compare(const void *a, const void *b)
+{
+    anms_ref pa = *(anms_ref *)a;
+    anms_ref pb = *(anms_ref *)b;
+    if(pa.r2 != pb.r2) return pa.r2 > pb.r2 ? -1 : 1;
+    if(pa.v != pb.v) return pa.v > pb.v ? -1 : 1;
+    return pa.i - pb.i;
+}
+
+void test_anms()
+{
+    srand(2);
+    image im = make_image(211, 137, 1);
+    int i, j;
+    for(i = 0; i < im.w*im.h; ++i) im.data[i] = rand()%1000;
+    int n = 0;
+    int *idx = nms_candidates(im, 1, 100, &n);
+
+    // Brute force radii and a full sort.
+    anms_ref *p = calloc(n, sizeof(anms_ref));
+    for(i = 0; i < n; ++i){
+        float v = im.data[idx[i]];
+        float best = INFINITY;
+        for(j = 0; j < n; ++j){
+            if(.9*im.data[idx[j]] <= v) continue;
+            float dx = idx[j]%im.w - idx[i]%im.w;
+            float dy = idx[j]/im.w - idx[i]/im.w;
+            best = MIN(best, dx*dx + dy*dy);
+        }
+        p[i].r2 = best;
+        p[i].v = v;
+        p[i].i = idx[i];
+    }
+    qsort(p, n, sizeof(anms_ref), anms_ref_compare);
+
+    int ks[] = {1, 10, 100, n/2};
+    int t;
+    for(t = 0; t < 4; ++t){
+        int k = ks[t], kept = 0;
+        int *out = anms_select(im, idx, n, k, &kept);
+        char *want = calloc(im.w*im.h, 1);
+        for(i = 0; i < k; ++i) want[p[i].i] = 1;
+        int ok = kept == k;
+        for(i = 0; ok && i < kept; ++i){
+            if(!want[out[i]] || (i && out[i] <= out[i-1])) ok = 0;
+        }
+        TEST(ok);
+        free(want);
+        free(out);
+    }
+    int kept = 0;
+    int *all = anms_select(im, idx, n, 0, &kept);
+    TEST(kept == n && memcmp(all, idx, n*sizeof(int)) == 0);
+    free(all);
+    free(p);
+    free(idx);
+    free_image(im);
+}
+
+void test_track_corners()
+{
+    // A textured block moves over a still background, so only the cells
+    // around it should be detected again, and the tracked corners should
+    // agree with detecting from scratch.
+    image dog = load_image("data/dog.jpg");
+    image bg = nn_resize(dog, 256, 192);
+    corner_tracker t = make_corner_tracker(HARRIS, 2, .001, 3, 0, 0, .01, 4);
+    int cells = ((bg.w + 31)/32)*((bg.h + 31)/32);
+    int f, i, j, k, x, y;
+    image frame = copy_image(bg);
+    for(f = 0; f < 5; ++f){
+        free_image(frame);
+        frame = copy_image(bg);
+        for(k = 0; k < bg.c; ++k){
+            for(y = 0; y < 40; ++y){
+                for(x = 0; x < 40; ++x){
+                    set_pixel(frame, 40 + 2*f + x, 100 + y, k, get_pixel(bg, 150 + x, 40 + y, k));
+                }
+            }
+        }
+        int redone = track_corners(&t, frame);
+        if(f == 0) TEST(redone == cells);
+        else TEST(redone > 0 && redone < cells/3);
+    }
+    int n = 0;
+    int *idx = detect_corner_indexes(frame, HARRIS, 2, .001, 3, 0, &n);
+    int found = 0, extra;
+    for(i = 0; i < n; ++i){
+        for(j = 0; j < t.corners.n; ++j){
+            if(t.corners.p[j].y*frame.w + t.corners.p[j].x == idx[i]) break;
+        }
+        found += j < t.corners.n;
+    }
+    extra = t.corners.n - found;
+    TEST(n > 20);
+    TEST(found >= .9*n);
+    TEST(extra <= .1*n);
+
+    // Nothing changes, nothing moves.
+    int count = t.corners.n;
+    point *p = calloc(count, sizeof(point));
+    memcpy(p, t.corners.p, count*sizeof(point));
+    TEST(track_corners(&t, frame) == 0);
+    TEST(t.corners.n == count && memcmp(p, t.corners.p, count*sizeof(point)) == 0);
+    free(p);
+    free(idx);
+    free_corner_tracker(t);
+
+    // With a budget the tracker is full from the first frame. A high
+    // contrast checkerboard appearing later still gets its corners in,
+    // pushing out weaker ones, and the budget holds.
+    int budget = 30;
+    t = make_corner_tracker(HARRIS, 2, .001, 3, budget, 0, .01, 4);
+    track_corners(&t, bg);
+    TEST(t.corners.n == budget);
+    free_image(frame);
+    frame = copy_image(bg);
+    for(k = 0; k < bg.c; ++k){
+        for(y = 0; y < 48; ++y){
+            for(x = 0; x < 48; ++x){
+                set_pixel(frame, 160 + x, 20 + y, k, (x/12 + y/12)%2);
+            }
+        }
+    }
+    track_corners(&t, frame);
+    int inside = 0;
+    for(j = 0; j < t.corners.n; ++j){
+        inside += t.corners.p[j].x >= 160 && t.corners.p[j].x < 208 && t.corners.p[j].y >= 20 && t.corners.p[j].y < 68;
+    }
+    TEST(t.corners.n == budget);
+    TEST(inside >= 4);
+    free_corner_tracker(t);
+    free_image(frame);
+
+    // Two spots merge into one between them. Both corners move onto it,
+    // and only one of them may stay.
+    t = make_corner_tracker(HARRIS, 2, .001, 3, 0, 0, .01, 4);
+    for(f = 0; f < 2; ++f){
+        frame = make_image(96, 96, 1);
+        int sx[2] = {40, 48};
+        for(k = 0; k < 2 - f; ++k){
+            for(y = 0; y < 4; ++y){
+                for(x = 0; x < 4; ++x) set_pixel(frame, (f ? 44 : sx[k]) + x, 46 + y, 0, 1);
+            }
+        }
+        track_corners(&t, frame);
+        int close = 0;
+        for(i = 0; i < t.corners.n; ++i){
+            close += abs(t.corners.p[i].x - 45) <= 8 && abs(t.corners.p[i].y - 47) <= 4;
+        }
+        TEST(f ? close == 1 : close >= 2);
+        free_image(frame);
+    }
+    free_corner_tracker(t);
+    free_image(bg);
+    free_image(dog);
+}
+
+void test_match_descriptors()
+{
+    // Queries are noisy copies of shuffled rows of b, and a few rows of b
+    // appear twice, including as the last row, so ties must go to the
+    // lower index. Lengths cover the SIMD blocks, the tail and both.
+    int sizes[3] = {75, 8, 5};
+    int t, i, j, k;
+    srand(5);
+    for(t = 0; t < 3; ++t){
+        int n = sizes[t], an = 40, bn = 61;
+        descriptor *a = calloc(an, sizeof(descriptor));
+        descriptor *b = calloc(bn, sizeof(descriptor));
+        for(i = 0; i < bn; ++i){
+            b[i].n = n;
+            b[i].p = make_point(i, 0);
+            b[i].data = calloc(n, sizeof(float));
+            for(k = 0; k < n; ++k) b[i].data[k] = (float)rand()/RAND_MAX - .5;
+        }
+        for(i = 0; i < 4; ++i) memcpy(b[bn - 1 - i*9].data, b[3 + i].data, n*sizeof(float));
+        for(j = 0; j < an; ++j){
+            int src = (j*7)%(bn - 20);
+            a[j].n = n;
+            a[j].p = make_point(j, 1);
+            a[j].data = calloc(n, sizeof(float));
+            for(k = 0; k < n; ++k) a[j].data[k] = b[src].data[k] + .01*((float)rand()/RAND_MAX - .5);
+        }
+        int mn = 0;
+        match *m = match_descriptors(a, an, b, bn, &mn);
+        int ok = mn > 0;
+        int *used = calloc(bn, sizeof(int));
+        for(i = 0; i < mn; ++i){
+            int ai = m[i].ai, bind = 0;
+            float best = INFINITY;
+            for(j = 0; j < bn; ++j){
+                float d = l1_distance(a[ai].data, b[j].data, n);
+                if(d < best){
+                    best = d;
+                    bind = j;
+                }
+            }
+            ok &= m[i].bi == bind && within_eps(m[i].distance, best, .0001) && !used[bind];
+            ok &= m[i].q.x == bind && m[i].p.x == ai;
+            ok &= i == 0 || m[i-1].distance <= m[i].distance;
+            used[bind] = 1;
+        }
+        TEST(ok);
+        float sum = 0;
+        for(k = 0; k < n; ++k) sum += fabsf(a[0].data[k] - b[1].data[k]);
+        TEST(within_eps(l1_distance(a[0].data, b[1].data, n), sum, .001));
+        free(used);
+        free(m);
+        free_descriptors(a, an);
+        free_descriptors(b, bn);
+    }
+}
+
+static int match_ai_compare(const void *a, const void *b)
+{
+    return ((match *)a)->ai - ((match *)b)->ai;
+}
+
+void test_kd_forest()
+{
+    image dog = load_image("data/dog.jpg");
+    image im = nn_resize(dog, 320, 240);
+    image sh = make_image(im.w - 11, im.h - 6, im.c);
+    int i, j, k, x, y;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < sh.h; ++y){
+            for(x = 0; x < sh.w; ++x){
+                set_pixel(sh, x, y, k, get_pixel(im, x + 11, y + 6, k) + .02*((float)rand()/RAND_MAX - .5));
+            }
+        }
+    }
+    descriptor_set a = harris_corner_set(im, 2, .0005, 3, 0, 0);
+    descriptor_set b = harris_corner_set(sh, 2, .0005, 3, 0, 0);
+    kd_forest f = make_kd_forest(b, 4);
+    TEST(a.n > 100 && b.n > 100);
+
+    // Every tree's leaves hold each point exactly once.
+    int ok = 1;
+    int *count = calloc(b.n, sizeof(int));
+    for(k = 0; k < f.trees; ++k){
+        memset(count, 0, b.n*sizeof(int));
+        for(i = 0; i < f.nodes[k]; ++i){
+            kd_node n = f.node[k][i];
+            if(n.dim >= 0) continue;
+            for(j = n.a; j < n.b; ++j) ++count[f.index[k][j]];
+        }
+        for(i = 0; i < b.n; ++i) ok &= count[i] == 1;
+    }
+    TEST(ok);
+    free(count);
+
+    // Exact search is the brute force matcher.
+    descriptor *ad = descriptor_set_view(a), *bd = descriptor_set_view(b);
+    int en = 0, mn = 0;
+    match *e = match_descriptors(ad, a.n, bd, b.n, &en);
+    match *m = match_kd_forest(f, a, 0, &mn);
+    qsort(e, en, sizeof(match), match_ai_compare);
+    qsort(m, mn, sizeof(match), match_ai_compare);
+    ok = en == mn;
+    for(i = 0; ok && i < mn; ++i) ok &= e[i].bi == m[i].bi && e[i].distance == m[i].distance;
+    TEST(ok);
+    free(m);
+
+    // Approximate search finds real distances, mostly the nearest ones.
+    int *truth = calloc(a.n, sizeof(int));
+    for(i = 0; i < a.n; ++i) truth[i] = -1;
+    for(i = 0; i < en; ++i) truth[e[i].ai] = e[i].bi;
+    m = match_kd_forest(f, a, 64, &mn);
+    int agree = 0;
+    ok = mn > 0;
+    for(i = 0; i < mn; ++i){
+        float d = l1_distance(ad[m[i].ai].data, bd[m[i].bi].data, a.size);
+        ok &= within_eps(d, m[i].distance, .0001) && m[i].q.x == b.p[m[i].bi].x;
+        ok &= i == 0 || m[i-1].distance <= m[i].distance;
+        agree += truth[m[i].ai] == m[i].bi;
+    }
+    TEST(ok);
+    TEST(agree >= .8*en);
+
+    free(truth);
+    free(m);
+    free(e);
+    free(ad);
+    free(bd);
+    free_kd_forest(f);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(sh);
+    free_image(im);
+    free_image(dog);
+}
+
+void test_match_filters()
+{
+    // Half of the queries are noisy copies of rows of b, the others sit
+    // between two rows, so the ratio test and mutual check both have
+    // something to reject. Checked against distances computed directly.
+    int n = 75, an = 60, bn = 50;
+    int i, j, k, t;
+    srand(9);
+    descriptor *a = calloc(an, sizeof(descriptor));
+    descriptor *b = calloc(bn, sizeof(descriptor));
+    for(i = 0; i < bn; ++i){
+        b[i].n = n;
+        b[i].p = make_point(i, 0);
+        b[i].data = calloc(n, sizeof(float));
+        for(k = 0; k < n; ++k) b[i].data[k] = (float)rand()/RAND_MAX - .5;
+    }
+    for(j = 0; j < an; ++j){
+        int u = (j*13)%bn, v = (j*17 + 5)%bn;
+        float w = j%2 ? .5 : 0;
+        a[j].n = n;
+        a[j].p = make_point(j, 1);
+        a[j].data = calloc(n, sizeof(float));
+        for(k = 0; k < n; ++k){
+            a[j].data[k] = (1 - w)*b[u].data[k] + w*b[v].data[k] + .05*((float)rand()/RAND_MAX - .5);
+        }
+    }
+    float *d = calloc(an*bn, sizeof(float));
+    for(j = 0; j < an; ++j){
+        for(i = 0; i < bn; ++i) d[j*bn + i] = l1_distance(a[j].data, b[i].data, n);
+    }
+    float ratios[3] = {0, .8, .8};
+    int mutuals[3] = {0, 0, 1};
+    for(t = 0; t < 3; ++t){
+        int mn = 0;
+        match *m = match_descriptors_filtered(a, an, b, bn, ratios[t], mutuals[t], &mn);
+        int *want = calloc(an, sizeof(int));
+        int *used = calloc(bn, sizeof(int));
+        int expect = 0, ok = 1;
+        for(j = 0; j < an; ++j){
+            int best = 0;
+            float second = INFINITY;
+            for(i = 1; i < bn; ++i){
+                if(d[j*bn + i] < d[j*bn + best]){
+                    second = d[j*bn + best];
+                    best = i;
+                } else if(d[j*bn + i] < second){
+                    second = d[j*bn + i];
+                }
+            }
+            want[j] = best;
+            if(ratios[t] > 0 && !(d[j*bn + best] < ratios[t]*second)) want[j] = -1;
+            if(mutuals[t] && want[j] >= 0){
+                int back = 0;
+                for(i = 1; i < an; ++i) if(d[i*bn + best] < d[back*bn + best]) back = i;
+                if(back != j) want[j] = -1;
+            }
+        }
+        // Closest first, each descriptor of b only once.
+        int *order = calloc(an, sizeof(int));
+        int count = 0;
+        for(j = 0; j < an; ++j) if(want[j] >= 0) order[count++] = j;
+        for(i = 0; i < count; ++i){
+            for(j = i + 1; j < count; ++j){
+                if(d[order[j]*bn + want[order[j]]] < d[order[i]*bn + want[order[i]]]){
+                    int s = order[i]; order[i] = order[j]; order[j] = s;
+                }
+            }
+        }
+        for(i = 0; i < count; ++i){
+            j = order[i];
+            if(used[want[j]]) want[j] = -1;
+            else used[want[j]] = 1;
+            expect += want[j] >= 0;
+        }
+        ok = mn == expect;
+        for(i = 0; ok && i < mn; ++i) ok &= want[m[i].ai] == m[i].bi;
+        TEST(ok);
+        if(t == 1) TEST(mn > an/4 && mn < 3*an/4);
+        free(order);
+        free(want);
+        free(used);
+        free(m);
+    }
+    free(d);
+    free_descriptors(a, an);
+    free_descriptors(b, bn);
+}
+
+void test_match_blocked()
+{
+    // The blocked matcher has to give exactly what the search gives, for
+    // sizes that leave partial lanes, tiles and quads of b.
+    int sizes[3] = {75, 8, 5};
+    int ans[3] = {67, 131, 9}, bns[3] = {53, 70, 6};
+    float ratios[3] = {0, .8, 0};
+    int mutuals[3] = {0, 0, 1};
+    int s, t, i, k;
+    srand(11);
+    for(s = 0; s < 3; ++s){
+        int n = sizes[s], an = ans[s], bn = bns[s];
+        descriptor *a = calloc(an, sizeof(descriptor));
+        descriptor *b = calloc(bn, sizeof(descriptor));
+        for(i = 0; i < bn; ++i){
+            b[i].n = n;
+            b[i].p = make_point(i, 0);
+            b[i].data = calloc(n, sizeof(float));
+            for(k = 0; k < n; ++k) b[i].data[k] = (float)rand()/RAND_MAX - .5;
+        }
+        for(i = 0; i < an; ++i){
+            a[i].n = n;
+            a[i].p = make_point(i, 1);
+            a[i].data = calloc(n, sizeof(float));
+            for(k = 0; k < n; ++k) a[i].data[k] = b[i%bn].data[k] + .2*((float)rand()/RAND_MAX - .5);
+        }
+        for(t = 0; t < 3; ++t){
+            int mn = 0, bn2 = 0;
+            match *m = match_descriptors_filtered(a, an, b, bn, ratios[t], mutuals[t], &mn);
+            match *mb = match_descriptors_blocked(a, an, b, bn, ratios[t], mutuals[t], &bn2);
+            int ok = mn == bn2 && mn > 0;
+            for(i = 0; ok && i < mn; ++i){
+                ok &= m[i].ai == mb[i].ai && m[i].bi == mb[i].bi && m[i].distance == mb[i].distance;
+            }
+            TEST(ok);
+            free(m);
+            free(mb);
+        }
+        free_descriptors(a, an);
+        free_descriptors(b, bn);
+    }
+}
+
+void test_pq_database()
+{
+    // Three images of random descriptors, looked up with noisy copies of
+    // the descriptors of the second one.
+    int n = 75, count = 3, per = 4000;
+    int i, j, k;
+    srand(13);
+    descriptor_set sets[3];
+    for(k = 0; k < count; ++k){
+        sets[k] = make_descriptor_set(per, n);
+        for(i = 0; i < per; ++i){
+            sets[k].p[i] = make_point(i, k);
+            for(j = 0; j < n; ++j) sets[k].data[i*sets[k].stride + j] = (float)rand()/RAND_MAX - .5;
+        }
+    }
+    descriptor_set q = make_descriptor_set(per, n);
+    for(i = 0; i < per; ++i){
+        q.p[i] = make_point(i, 9);
+        for(j = 0; j < n; ++j) q.data[i*q.stride + j] = sets[1].data[i*sets[1].stride + j] + .05*((float)rand()/RAND_MAX - .5);
+    }
+    pq_database db = make_pq_database(sets, count, 24, 32);
+    TEST(db.n == count*per && db.m == 24 && db.images == count);
+    // 12 bytes of codes and 4 of keypoint per descriptor instead of 300,
+    // at least 16x with the tables and padding.
+    TEST(db.bytes*16 <= (size_t)count*per*n*sizeof(float));
+    int ok = 1;
+    for(i = 0; i < db.blocks*32; ++i){
+        int im = pq_database_image(db, i);
+        ok &= im >= 0 && im < count;
+    }
+    TEST(ok);
+
+    int mn = 0, right = 0;
+    match *m = match_pq_database(db, q, 4, 0, &mn);
+    for(i = 0; i < mn; ++i){
+        point p = pq_database_point(db, m[i].bi);
+        right += pq_database_image(db, m[i].bi) == 1 && p.x == m[i].ai && p.y == 1;
+    }
+    TEST(right > 9*per/10);
+
+    // Every list gives the exact nearest code, which no subset can beat.
+    int an = 0;
+    ok = 1;
+    match *all = match_pq_database(db, q, db.lists, 0, &an);
+    float *best = calloc(per, sizeof(float));
+    for(i = 0; i < an; ++i) best[all[i].ai] = all[i].distance;
+    for(i = 0; i < mn; ++i) if(best[m[i].ai] > 0) ok &= best[m[i].ai] <= m[i].distance;
+    TEST(ok && an >= mn);
+
+    save_pq_database(db, "data/pq_database.bin");
+    pq_database l = load_pq_database("data/pq_database.bin");
+    remove("data/pq_database.bin");
+    TEST(l.mapped && l.n == db.n && l.lists == db.lists);
+    int ln = 0;
+    match *lm = match_pq_database(l, q, 4, 0, &ln);
+    ok = ln == mn;
+    for(i = 0; ok && i < mn; ++i) ok &= lm[i].ai == m[i].ai && lm[i].bi == m[i].bi && lm[i].distance == m[i].distance;
+    TEST(ok);
+
+    free(best);
+    free(all);
+    free(lm);
+    free(m);
+    free_pq_database(l);
+    free_pq_database(db);
+    free_descriptor_set(q);
+    for(k = 0; k < count; ++k) free_descriptor_set(sets[k]);
+}
+
+void test_match_graph()
+{
+    // Three crops of the dog, each overlapping the next by half, and an
+    // image of noise. With one neighbour each, only the overlapping crops
+    // should be paired, and the edges should hold the same matches as
+    // matching each pair directly.
+    image dog = load_image("data/dog.jpg");
+    int w = dog.w/2, step = dog.w/4;
+    image ims[4];
+    int i, j, k, x, y;
+    for(i = 0; i < 3; ++i){
+        ims[i] = make_image(w, dog.h, dog.c);
+        for(k = 0; k < dog.c; ++k){
+            for(y = 0; y < dog.h; ++y){
+                for(x = 0; x < w; ++x) set_pixel(ims[i], x, y, k, get_pixel(dog, x + i*step, y, k));
+            }
+        }
+    }
+    srand(15);
+    image noise = make_image(w, dog.h, dog.c);
+    for(i = 0; i < noise.w*noise.h*noise.c; ++i) noise.data[i] = (float)rand()/RAND_MAX;
+    ims[3] = smooth_image(noise, 1);
+
+    match_graph g = make_match_graph(ims, 4, HARRIS, 2, .0005, 3, 0, .8, 0, 1);
+    int has01 = 0, has12 = 0, ok = 1;
+    for(i = 0; i < g.edges; ++i){
+        match_edge e = g.edge[i];
+        ok &= e.a < e.b && (i == 0 || e.a > g.edge[i-1].a || (e.a == g.edge[i-1].a && e.b > g.edge[i-1].b));
+        has01 |= e.a == 0 && e.b == 1;
+        has12 |= e.a == 1 && e.b == 2;
+        // Most matches should be the shift between the crops.
+        int shifted = 0;
+        for(j = 0; j < e.n; ++j) shifted += fabsf(e.m[j].p.x - e.m[j].q.x - (e.b - e.a)*step) < 1 && e.m[j].p.y == e.m[j].q.y;
+        ok &= shifted > e.n/2;
+
+        descriptor *ad = set_to_descriptors(g.sets[e.a]);
+        descriptor *bd = set_to_descriptors(g.sets[e.b]);
+        int mn = 0;
+        match *m = match_descriptors_filtered(ad, g.sets[e.a].n, bd, g.sets[e.b].n, .8, 0, &mn);
+        ok &= mn == e.n;
+        for(j = 0; ok && j < mn; ++j) ok &= m[j].ai == e.m[j].ai && m[j].bi == e.m[j].bi;
+        free(m);
+        free_descriptors(ad, g.sets[e.a].n);
+        free_descriptors(bd, g.sets[e.b].n);
+    }
+    TEST(ok);
+    TEST(has01 && has12 && g.edges == 2);
+    free_match_graph(g);
+    for(i = 0; i < 4; ++i) free_image(ims[i]);
+    free_image(noise);
+    free_image(dog);
+}
+
 void test_hw3()
 {
     test_structure();
     test_cornerness();
     test_projection();
     test_compute_homography();
+    test_count_inliers();
+    test_fit_homography();
+    test_prosac();
+    test_ransac_parallel();
+    test_motion_models();
+    test_nms();
+    test_warp_perspective();
+    test_structure_fused();
+    test_anms();
+    test_descriptor_set();
+    test_describe_corners();
+    test_harris_strips();
+    test_fast();
+    test_binary_descriptors();
+    test_track_corners();
+    test_match_descriptors();
+    test_kd_forest();
+    test_match_filters();
+    test_match_blocked();
+    test_pq_database();
+    test_match_graph();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
@@ -205,16 +205,21 @@ structure_matrix = lib.structure_matrix
 structure_matrix.argtypes = [IMAGE, c_float]
 structure_matrix.restype = IMAGE
 
-find_and_draw_matches = lib.find_and_draw_matches
-find_and_draw_matches.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int]
-find_and_draw_matches.restype = IMAGE
+(HARRIS, FAST9, FAST12) = range(3)
+
+find_and_draw_matches_lib = lib.find_and_draw_matches
+find_and_draw_matches_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_int]
+find_and_draw_matches_lib.restype = IMAGE
+
+def find_and_draw_matches(a, b, sigma=2, thresh=5, nms=3, detector=HARRIS):
+    return find_and_draw_matches_lib(a, b, sigma, thresh, nms, detector)
 
 panorama_image_lib = lib.panorama_image
-panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int, c_int]
+panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int, c_int, c_int, c_int, c_float, c_int, c_float, c_float]
 panorama_image_lib.restype = IMAGE
 
-def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30, draw=0):
-    return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff, draw)
+def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30, draw=0, max_corners=0, detector=HARRIS, ratio=0, mutual=0, confidence=0, explain=0):
+    return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff, draw, max_corners, detector, ratio, mutual, confidence, explain)
 
 ##### HOMEWORK 4
 